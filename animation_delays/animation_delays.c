@@ -15,16 +15,23 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "common/conf.h"
+#include "common/db.h"
 #include "common/HPMi.h"
 #include "common/memmgr.h"
 #include "common/mmo.h"
+#include "common/mutex.h"
 #include "common/nullpo.h"
+#include "common/thread.h"
 #include "common/timer.h"
 
+#include "map/atcommand.h"
+#include "map/clif.h"
 #include "map/pc.h"
 #include "map/skill.h"
+#include "map/status.h"
 
 #include "plugins/HPMHooking.h"
 #include "common/HPMDataCheck.h"
@@ -66,6 +73,46 @@
 
 #ifdef ANIM_BREAK_ON_HIT
 	#define MULTIHIT_INTERVAL 200
+	#define ANIM_HIT_SERIES 8 // Pending hit series kept per character, further ones are ignored
+#endif
+
+/**
+ * Log of rejected skills
+ *
+ * Comment/uncomment to toggle the log.
+ * Skills rejected by a delay are kept in memory, the last ANIM_REJECT_RING of them, and appended
+ * every ANIM_REJECT_FLUSH ms to the log file by a background thread. @adelaystats shows the rejections
+ * per skill, which helps telling speedhacks apart from lag and spotting entries that are too strict.
+ * Lines are: time, char id, last skill, skill, delay checked (ms), time since last skill (ms) and, unless
+ * ANIM_DELAY_ALLOW_DANCING lets every skill after a move through, whether the character moved (0/1).
+ */
+//#define ANIM_REJECT_LOG "log/animation_delays.log"
+
+/**
+ * Delay calibration mode
+ * (Disabled by default, for test servers)
+ *
+ * Comment/uncomment to toggle calibration.
+ * Records the intervals between consecutive skills of players per (last skill, next skill, class, gender),
+ * in ANIM_CALIBRATION_BUCKETS buckets of ANIM_CALIBRATION_STEP ms. Each session keeps ANIM_CALIBRATION_SLOTS
+ * skill pairs, merged into the server totals on logout. On shutdown, suggested skill_adelay.conf entries
+ * are written to the file below, using the ANIM_CALIBRATION_PERCENTILE of each skill pair with at least
+ * ANIM_CALIBRATION_MIN_SAMPLES samples. Intervals after a move or a rejected skill aren't recorded.
+ */
+//#define ANIM_CALIBRATION "log/skill_adelay_suggested.conf"
+
+#ifdef ANIM_CALIBRATION
+	#define ANIM_CALIBRATION_STEP 20
+	#define ANIM_CALIBRATION_BUCKETS 100
+	#define ANIM_CALIBRATION_SLOTS 16
+	#define ANIM_CALIBRATION_PERCENTILE 5
+	#define ANIM_CALIBRATION_MIN_SAMPLES 50
+#endif
+
+#ifdef ANIM_REJECT_LOG
+	#define ANIM_REJECT_RING 8192
+	#define ANIM_REJECT_FLUSH 1000
+	#define ANIM_REJECT_LINES 10 // Max skills listed by @adelaystats
 #endif
 
 HPExport struct hplugin_info pinfo = {
@@ -80,24 +127,118 @@ struct skill_adelay_entry {
 	int delay; // Skill animation delay
 	int delay_others; // skill animation delay imposed on other skills used afterwards
 	int max_delay; // Skill maximum delay
-#ifdef	ANIM_DELAY_ALLOW_BYPASS
-	bool bypass; // Skill bypasses existing delay
+};
+
+#define ADELAY_BITSET_WORDS ((MAX_SKILL_DB + 31) / 32)
+#define adelay_bit_get(set, index) (((set)[(index) / 32] & (1U << ((index) % 32))) != 0)
+#define adelay_bit_set(set, index) ((set)[(index) / 32] |= 1U << ((index) % 32))
+
+/* Skill adelays by skill index, in a single allocation */
+struct skill_adelay_table {
+	struct skill_adelay_entry entries[MAX_SKILL_DB];
+	uint32 defined[ADELAY_BITSET_WORDS]; // Skills listed in skill_adelay.conf
+#ifdef ANIM_DELAY_ALLOW_BYPASS
+	uint32 bypass[ADELAY_BITSET_WORDS]; // Skill bypasses existing delay
 #endif
 };
 
-/* List of skill adelays */
-struct skill_adelay_entry *skill_adelay_list[MAX_SKILL_ID];
+/* Current table. Replaced as a whole on every reload, NULL until the first one */
+struct skill_adelay_table *skill_adelays = NULL;
+/* Bumped on every reload, tells cached ticks built from a previous table */
+int skill_adelays_generation = 0;
+
+#ifdef ANIM_REJECT_LOG
+/* Skill rejected because of the delay of the last one */
+struct skill_adelay_reject {
+	time_t time;
+	int char_id;
+	uint16 last_skill_id;
+	uint16 skill_id;
+	int required; // Delay checked, ms
+	int observed; // Time since last skill, ms
+#ifndef ANIM_DELAY_ALLOW_DANCING
+	bool moved; // Character moved since last skill
+#endif
+};
+
+/* Rejections caused by a skill's delay */
+struct skill_adelay_reject_count {
+	uint16 skill_id;
+	uint32 count;
+	int64 early; // Sum of required - observed, ms
+};
+
+/* Rejection log */
+struct skill_adelay_reject_log {
+	struct skill_adelay_reject* ring; // Last ANIM_REJECT_RING rejections, oldest overwritten first
+	int64 seq; // Rejections recorded
+	int64 flushed; // Rejections handed to the writer
+	int64 dropped; // Overwritten before being handed
+	struct skill_adelay_reject* batch; // Handed to the writer
+	int batch_count; // 0 once written
+	FILE* fp;
+	struct thread_handle* writer;
+	struct mutex_data* lock;
+	struct cond_data* wake;
+	bool stop;
+	int timer;
+	struct skill_adelay_reject_count counts[MAX_SKILL_DB]; // By index of the last skill
+};
+
+struct skill_adelay_reject_log reject_log = { 0 };
+#endif
+
+#ifdef ANIM_CALIBRATION
+/* Intervals of a skill pair recorded by a session */
+struct skill_adelay_calib_slot {
+	uint16 last_skill_id; // 0 if unused
+	uint16 skill_id;
+	uint16 total;
+	uint16 buckets[ANIM_CALIBRATION_BUCKETS];
+};
+
+/* Intervals of a skill pair for a class and gender, merged from sessions */
+struct skill_adelay_calib_hist {
+	uint16 last_skill_id;
+	uint16 skill_id;
+	int class;
+	int sex;
+	uint32 total;
+	uint32 buckets[ANIM_CALIBRATION_BUCKETS];
+};
+
+/* Merged histograms by (last skill, next skill, class, gender) */
+struct DBMap* calib_db = NULL;
+#endif
+
+#ifdef ANIM_BREAK_ON_HIT
+/* Pending hits of a multihit series, landing every MULTIHIT_INTERVAL from next to last */
+struct skill_adelay_hits {
+	int64 next; // 0 if unused
+	int64 last;
+};
+#endif
 
 /* Last skill used per character */
 struct skill_adelay_timer {
 	uint16 last_skill_id;
 	int64 tick;
-#ifdef ANIM_DELAY_ALLOW_DANCING
+	int64 allowed_same; // Earliest tick to use last skill again
+	int64 allowed_others; // Earliest tick to use any other skill
+	int generation; // skill_adelays_generation the ticks were computed with
+#if defined(ANIM_DELAY_ALLOW_DANCING) || defined(ANIM_REJECT_LOG) || defined(ANIM_CALIBRATION)
 	int x;
 	int y;
 #endif
+#ifdef ANIM_CALIBRATION
+	bool rejected; // A skill was rejected since last skill
+	int calib_class; // Class and gender the slots were recorded with
+	int calib_sex;
+	struct skill_adelay_calib_slot calib[ANIM_CALIBRATION_SLOTS];
+#endif
 #ifdef ANIM_BREAK_ON_HIT
-	time_t hit_tick;
+	int64 hit_tick; // Last hit received
+	struct skill_adelay_hits hits[ANIM_HIT_SERIES];
 #endif
 };
 
@@ -112,12 +253,22 @@ static struct skill_adelay_timer* get_adelays_timer(struct map_session_data* sd)
 		CREATE(data, struct skill_adelay_timer, 1);
 		data->last_skill_id = 0;
 		data->tick = 0;
-#ifdef ANIM_DELAY_ALLOW_DANCING
+		data->allowed_same = 0;
+		data->allowed_others = 0;
+		data->generation = skill_adelays_generation;
+#if defined(ANIM_DELAY_ALLOW_DANCING) || defined(ANIM_REJECT_LOG) || defined(ANIM_CALIBRATION)
 		data->x = -1;
 		data->y = -1;
 #endif
+#ifdef ANIM_CALIBRATION
+		data->rejected = false;
+		data->calib_class = sd->status.class;
+		data->calib_sex = sd->status.sex;
+		memset(data->calib, 0, sizeof(data->calib));
+#endif
 #ifdef ANIM_BREAK_ON_HIT
 		data->hit_tick = 0;
+		memset(data->hits, 0, sizeof(data->hits));
 #endif
 		addToMSD(sd, data, 0, true);
 	}
@@ -125,6 +276,216 @@ static struct skill_adelay_timer* get_adelays_timer(struct map_session_data* sd)
 	return data;
 }
 
+/**
+ * Resolves a Delay/DelayOthers value of an entry into milliseconds checked
+ */
+static int get_effective_delay(const struct skill_adelay_entry* entry, int delay, struct map_session_data* sd)
+{
+	if (delay < 0) // Delay is a percentage over character's adelay
+		delay = abs(delay) * status_get_adelay(&sd->bl) / 100;
+
+	if (entry->max_delay != 0 && delay > entry->max_delay) // Delay should not exceed MaxDelay
+		delay = entry->max_delay;
+
+	return delay * ANIM_DELAY_LENIENCY / 100;
+}
+
+/**
+ * Computes the earliest ticks skills can follow the last one at
+ */
+static void update_adelays_ticks(struct map_session_data* sd, struct skill_adelay_timer* data)
+{
+	const struct skill_adelay_table *table = skill_adelays;
+
+	data->allowed_same = 0;
+	data->allowed_others = 0;
+	data->generation = skill_adelays_generation;
+
+	if (table == NULL || data->last_skill_id == 0)
+		return;
+
+	int index = skill->get_index(data->last_skill_id);
+
+	if (!adelay_bit_get(table->defined, index))
+		return;
+
+	const struct skill_adelay_entry *entry = &table->entries[index];
+	int delay = get_effective_delay(entry, entry->delay, sd); // Direct delay
+
+	data->allowed_same = data->tick + delay;
+	data->allowed_others = data->tick + delay;
+
+	if (entry->delay_others != 0) // Delay if it's a different skill
+		data->allowed_others = data->tick + get_effective_delay(entry, entry->delay_others, sd);
+}
+
+#ifdef ANIM_CALIBRATION
+/**
+ * Adds the intervals of a session slot to the server totals and clears it
+ */
+static void calib_merge_slot(struct skill_adelay_timer* data, struct skill_adelay_calib_slot* slot)
+{
+	if (slot->last_skill_id == 0)
+		return;
+
+	int64 key = (int64)((uint64)slot->last_skill_id << 48 | (uint64)slot->skill_id << 32 | (uint64)(uint16)data->calib_class << 16 | (uint64)(uint8)data->calib_sex);
+	struct skill_adelay_calib_hist* hist = i64db_get(calib_db, key);
+
+	if (hist == NULL) {
+		CREATE(hist, struct skill_adelay_calib_hist, 1);
+		hist->last_skill_id = slot->last_skill_id;
+		hist->skill_id = slot->skill_id;
+		hist->class = data->calib_class;
+		hist->sex = data->calib_sex;
+		i64db_put(calib_db, key, hist);
+	}
+
+	hist->total += slot->total;
+	for (int i = 0; i < ANIM_CALIBRATION_BUCKETS; i++)
+		hist->buckets[i] += slot->buckets[i];
+
+	memset(slot, 0, sizeof(*slot));
+}
+
+/**
+ * Adds every slot of a session to the server totals
+ */
+static void calib_merge(struct skill_adelay_timer* data)
+{
+	for (int i = 0; i < ANIM_CALIBRATION_SLOTS; i++)
+		calib_merge_slot(data, &data->calib[i]);
+}
+
+/**
+ * Records the interval between last skill and skill_id
+ */
+static void calib_record(struct map_session_data* sd, struct skill_adelay_timer* data, uint16 skill_id, int64 tick)
+{
+	int64 interval = tick - data->tick;
+	bool sample = data->last_skill_id != 0 && !data->rejected && data->x == sd->bl.x && data->y == sd->bl.y
+		&& interval < ANIM_CALIBRATION_BUCKETS * ANIM_CALIBRATION_STEP; // Longer ones aren't a chain of skills
+
+	data->rejected = false;
+	if (!sample)
+		return;
+
+	if (data->calib_class != sd->status.class || data->calib_sex != sd->status.sex) { // Job or gender change
+		calib_merge(data);
+		data->calib_class = sd->status.class;
+		data->calib_sex = sd->status.sex;
+	}
+
+	struct skill_adelay_calib_slot* slot = &data->calib[(data->last_skill_id * 31 + skill_id) % ANIM_CALIBRATION_SLOTS];
+
+	if (slot->last_skill_id != data->last_skill_id || slot->skill_id != skill_id || slot->total == UINT16_MAX) {
+		calib_merge_slot(data, slot);
+		slot->last_skill_id = data->last_skill_id;
+		slot->skill_id = skill_id;
+	}
+
+	slot->total++;
+	slot->buckets[interval / ANIM_CALIBRATION_STEP]++;
+}
+
+/**
+ * Interval under which percent% of the samples are
+ */
+static int calib_percentile(const struct skill_adelay_calib_hist* hist, int percent)
+{
+	uint32 threshold = (uint32)((uint64)hist->total * percent / 100);
+	uint32 seen = 0;
+
+	for (int i = 0; i < ANIM_CALIBRATION_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen > threshold)
+			return i * ANIM_CALIBRATION_STEP;
+	}
+
+	return ANIM_CALIBRATION_BUCKETS * ANIM_CALIBRATION_STEP;
+}
+
+/**
+ * Writes suggested skill_adelay.conf entries from the recorded intervals
+ * Entries aren't per class, so the lowest interval over every class and gender is suggested.
+ */
+static void calib_export(void)
+{
+	struct skill_adelay_calib_hist* hist;
+	int *delay, *delay_others;
+	uint16* skill_ids;
+	int entries = 0;
+
+	CREATE(delay, int, MAX_SKILL_DB);
+	CREATE(delay_others, int, MAX_SKILL_DB);
+	CREATE(skill_ids, uint16, MAX_SKILL_DB);
+	for (int i = 0; i < MAX_SKILL_DB; i++)
+		delay[i] = delay_others[i] = -1;
+
+	FILE* fp = fopen(ANIM_CALIBRATION, "w");
+	if (fp == NULL) {
+		ShowError("animation_delays: could not write %s\n", ANIM_CALIBRATION);
+		aFree(delay);
+		aFree(delay_others);
+		aFree(skill_ids);
+		return;
+	}
+
+	fprintf(fp, "// Suggested skill animation delays, %d%% percentile of the recorded intervals.\n", ANIM_CALIBRATION_PERCENTILE);
+	fprintf(fp, "// Review before merging into skill_adelay.conf.\n\n");
+
+	struct DBIterator* iter = db_iterator(calib_db);
+	for (hist = dbi_first(iter); dbi_exists(iter); hist = dbi_next(iter)) {
+		if (hist->total < ANIM_CALIBRATION_MIN_SAMPLES)
+			continue;
+
+		int index = skill->get_index(hist->last_skill_id);
+		int value = calib_percentile(hist, ANIM_CALIBRATION_PERCENTILE);
+		int* target = hist->skill_id == hist->last_skill_id ? &delay[index] : &delay_others[index];
+
+		if (*target < 0 || value < *target)
+			*target = value;
+		skill_ids[index] = hist->last_skill_id;
+
+		fprintf(fp, "// %s -> %s, %s %s: %d ms over %u samples\n", skill->get_name(hist->last_skill_id), skill->get_name(hist->skill_id),
+			pc->job_name(hist->class), hist->sex == SEX_MALE ? "male" : "female", value, hist->total);
+	}
+	dbi_destroy(iter);
+
+	for (int i = 1; i < MAX_SKILL_DB; i++) {
+		if (delay[i] < 0 && delay_others[i] < 0)
+			continue;
+
+		fprintf(fp, "\n%s: {\n", skill->get_name(skill_ids[i]));
+		if (delay[i] >= 0)
+			fprintf(fp, "\tDelay: %d\n", delay[i]);
+		if (delay_others[i] >= 0 && delay_others[i] != delay[i])
+			fprintf(fp, "\tDelayOthers: %d\n", delay_others[i]);
+		fprintf(fp, "}\n");
+		entries++;
+	}
+
+	fclose(fp);
+	ShowStatus("animation_delays: wrote %d suggested entries to %s\n", entries, ANIM_CALIBRATION);
+
+	aFree(delay);
+	aFree(delay_others);
+	aFree(skill_ids);
+}
+
+/**
+ * Merges the intervals of a leaving player
+ */
+static int pre_map_quit(struct map_session_data** sd)
+{
+	struct skill_adelay_timer* data = getFromMSD(*sd, 0);
+
+	if (data != NULL)
+		calib_merge(data);
+
+	return 0;
+}
+#endif
+
 /**
  * Store last skill usage time and id
  */
@@ -141,12 +502,16 @@ static void set_adelays_timer(struct block_list* src, uint16 skill_id)
 	int64 tick = timer->gettick();
 
 	struct skill_adelay_timer* adelays_data = get_adelays_timer(sd);
+#ifdef ANIM_CALIBRATION
+	calib_record(sd, adelays_data, skill_id, tick);
+#endif
 	adelays_data->last_skill_id = skill_id;
 	adelays_data->tick = tick;
-#ifdef ANIM_DELAY_ALLOW_DANCING
+#if defined(ANIM_DELAY_ALLOW_DANCING) || defined(ANIM_REJECT_LOG) || defined(ANIM_CALIBRATION)
 	adelays_data->x = sd->bl.x;
 	adelays_data->y = sd->bl.y;
 #endif
+	update_adelays_ticks(sd, adelays_data);
 }
 
 /**
@@ -184,17 +549,16 @@ static void validate_delay_others(struct config_setting_t* conf, struct skill_ad
 /**
  * Validate "Bypass" entry
  */
-static void validate_bypass(struct config_setting_t* conf, struct skill_adelay_entry* tmp)
+static void validate_bypass(struct config_setting_t* conf, struct skill_adelay_table* table, int index)
 {
 #ifdef ANIM_DELAY_ALLOW_BYPASS
 	nullpo_retv(conf);
-	nullpo_retv(tmp);
+	nullpo_retv(table);
 
-	tmp->bypass = false;
 	bool bypass;
 
-	if (libconfig->setting_lookup_bool_real(conf, "Bypass", &bypass) == CONFIG_TRUE) {
-		tmp->bypass = bypass;
+	if (libconfig->setting_lookup_bool_real(conf, "Bypass", &bypass) == CONFIG_TRUE && bypass) {
+		adelay_bit_set(table->bypass, index);
 	}
 #endif
 }
@@ -217,20 +581,24 @@ static void validate_max_delay(struct config_setting_t* conf, struct skill_adela
 
 /**
  * Reads animation delay info from db/skill_adelay.conf
+ * A new table is built aside and swapped in once complete, the previous one is freed.
  */
 static void read_skill_animation_delays(bool minimal)
 {
 	struct config_t skill_adelay_conf;
 	struct config_setting_t *sk = NULL;
+	struct skill_adelay_table *table;
 	char config_filename[280];
 	int i = 0;
 
 	snprintf(config_filename, sizeof(config_filename), "%s/skill_adelay.conf", map->db_path);
 	if (!libconfig->load_file(&skill_adelay_conf, config_filename)) {
 		ShowError("Could not read file %s/skill_adelay.conf\n", map->db_path);
-		return;
+		return; // Keep the current table
 	}
 
+	CREATE(table, struct skill_adelay_table, 1);
+
 	while ((sk = libconfig->setting_get_elem(skill_adelay_conf.root, i++))) {
 		const char *sk_name = config_setting_name(sk);
 		int skill_id = skill->name2id(sk_name);
@@ -242,18 +610,272 @@ static void read_skill_animation_delays(bool minimal)
 
 
 		int index = skill->get_index(skill_id);
-		struct skill_adelay_entry *tmp;
-		skill_adelay_list[index] = CREATE(tmp, struct skill_adelay_entry, 1);
+		struct skill_adelay_entry *tmp = &table->entries[index];
+		adelay_bit_set(table->defined, index);
 
 		validate_delay(sk, tmp);
 		validate_delay_others(sk, tmp);
 		validate_max_delay(sk, tmp);
-		validate_bypass(sk, tmp);
+		validate_bypass(sk, table, index);
 	}
 
 	libconfig->destroy(&skill_adelay_conf);
+
+	struct skill_adelay_table *old = skill_adelays;
+	skill_adelays = table;
+	skill_adelays_generation++;
+	if (old != NULL)
+		aFree(old);
 }
 
+#ifdef ANIM_REJECT_LOG
+/**
+ * Records a rejected skill. Only touches memory, the log file is written by the writer thread.
+ */
+static void record_reject(struct map_session_data* sd, struct skill_adelay_timer* data, uint16 skill_id, int64 tick, int64 allowed)
+{
+	if (reject_log.ring == NULL) // Not online yet
+		return;
+
+	struct skill_adelay_reject* reject = &reject_log.ring[reject_log.seq++ % ANIM_REJECT_RING];
+
+	reject->time = time(NULL);
+	reject->char_id = sd->status.char_id;
+	reject->last_skill_id = data->last_skill_id;
+	reject->skill_id = skill_id;
+	reject->required = (int)(allowed - data->tick);
+	reject->observed = (int)(tick - data->tick);
+#ifndef ANIM_DELAY_ALLOW_DANCING
+	reject->moved = data->x != sd->bl.x || data->y != sd->bl.y;
+#endif
+
+	struct skill_adelay_reject_count* count = &reject_log.counts[skill->get_index(data->last_skill_id)];
+	count->skill_id = data->last_skill_id;
+	count->count++;
+	count->early += allowed - tick;
+}
+
+/**
+ * Appends rejections to the log file
+ */
+static void write_rejects(const struct skill_adelay_reject* batch, int count)
+{
+	char timestr[32];
+
+	for (int i = 0; i < count; i++) {
+		const struct skill_adelay_reject* reject = &batch[i];
+
+		strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", localtime(&reject->time));
+#ifdef ANIM_DELAY_ALLOW_DANCING
+		fprintf(reject_log.fp, "%s\t%d\t%d\t%d\t%d\t%d\n", timestr, reject->char_id,
+			reject->last_skill_id, reject->skill_id, reject->required, reject->observed);
+#else
+		fprintf(reject_log.fp, "%s\t%d\t%d\t%d\t%d\t%d\t%d\n", timestr, reject->char_id,
+			reject->last_skill_id, reject->skill_id, reject->required, reject->observed, reject->moved ? 1 : 0);
+#endif
+	}
+	fflush(reject_log.fp);
+}
+
+/**
+ * Writer thread, writes the batches handed by reject_flush_timer
+ */
+static void* reject_writer(void* param)
+{
+	mutex->lock(reject_log.lock);
+	while (!reject_log.stop) {
+		if (reject_log.batch_count == 0) {
+			mutex->cond_wait(reject_log.wake, reject_log.lock, -1);
+			continue;
+		}
+
+		// Main thread doesn't touch the batch until batch_count is back to 0
+		mutex->unlock(reject_log.lock);
+		write_rejects(reject_log.batch, reject_log.batch_count);
+		mutex->lock(reject_log.lock);
+		reject_log.batch_count = 0;
+	}
+	mutex->unlock(reject_log.lock);
+
+	return NULL;
+}
+
+/**
+ * Hands the rejections recorded since last flush to the writer
+ * Rejections stay in the ring while the writer is still busy with the previous batch.
+ */
+static int reject_flush_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	if (reject_log.fp == NULL || reject_log.seq == reject_log.flushed)
+		return 0;
+
+	if (reject_log.writer != NULL)
+		mutex->lock(reject_log.lock);
+
+	if (reject_log.batch_count == 0) {
+		int64 pending = reject_log.seq - reject_log.flushed;
+
+		if (pending > ANIM_REJECT_RING) { // Ring wrapped over unflushed rejections
+			reject_log.dropped += pending - ANIM_REJECT_RING;
+			reject_log.flushed = reject_log.seq - ANIM_REJECT_RING;
+			pending = ANIM_REJECT_RING;
+		}
+
+		for (int i = 0; i < pending; i++)
+			reject_log.batch[i] = reject_log.ring[(reject_log.flushed + i) % ANIM_REJECT_RING];
+		reject_log.flushed = reject_log.seq;
+		reject_log.batch_count = (int)pending;
+	}
+
+	if (reject_log.writer != NULL) {
+		mutex->cond_signal(reject_log.wake);
+		mutex->unlock(reject_log.lock);
+	} else { // No writer thread, write from here
+		write_rejects(reject_log.batch, reject_log.batch_count);
+		reject_log.batch_count = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * Opens the log file and starts the writer
+ */
+static void reject_log_init(void)
+{
+	CREATE(reject_log.ring, struct skill_adelay_reject, ANIM_REJECT_RING);
+	CREATE(reject_log.batch, struct skill_adelay_reject, ANIM_REJECT_RING);
+
+	if ((reject_log.fp = fopen(ANIM_REJECT_LOG, "a")) == NULL) {
+		ShowError("animation_delays: could not open %s, rejected skills won't be logged\n", ANIM_REJECT_LOG);
+		return;
+	}
+
+	reject_log.lock = mutex->create();
+	reject_log.wake = mutex->cond_create();
+	reject_log.writer = thread->create(reject_writer, NULL);
+	if (reject_log.writer == NULL)
+		ShowWarning("animation_delays: could not start the log thread, rejected skills will be logged from the main loop\n");
+
+	timer->add_func_list(reject_flush_timer, "animation_delays::reject_flush_timer");
+	reject_log.timer = timer->add_interval(timer->gettick() + ANIM_REJECT_FLUSH, reject_flush_timer, 0, 0, ANIM_REJECT_FLUSH);
+}
+
+/**
+ * Stops the writer and writes the remaining rejections
+ */
+static void reject_log_final(void)
+{
+	if (reject_log.timer != INVALID_TIMER)
+		timer->delete(reject_log.timer, reject_flush_timer);
+
+	if (reject_log.writer != NULL) {
+		mutex->lock(reject_log.lock);
+		reject_log.stop = true;
+		mutex->cond_signal(reject_log.wake);
+		mutex->unlock(reject_log.lock);
+		thread->wait(reject_log.writer, NULL);
+		reject_log.writer = NULL;
+	}
+
+	if (reject_log.fp != NULL) {
+		// Batch left by the writer, then the ring
+		write_rejects(reject_log.batch, reject_log.batch_count);
+		reject_log.batch_count = 0;
+		reject_flush_timer(INVALID_TIMER, timer->gettick(), 0, 0);
+		fclose(reject_log.fp);
+		reject_log.fp = NULL;
+	}
+
+	if (reject_log.lock != NULL) {
+		mutex->cond_destroy(reject_log.wake);
+		mutex->destroy(reject_log.lock);
+	}
+
+	if (reject_log.ring != NULL) {
+		aFree(reject_log.ring);
+		aFree(reject_log.batch);
+		reject_log.ring = NULL;
+	}
+}
+
+/**
+ * Orders rejection counters by count, highest first
+ */
+static int reject_count_compare(const void* a, const void* b)
+{
+	const struct skill_adelay_reject_count* ca = a;
+	const struct skill_adelay_reject_count* cb = b;
+
+	if (ca->count != cb->count)
+		return ca->count > cb->count ? -1 : 1;
+	return ca->skill_id - cb->skill_id;
+}
+#endif
+
+#ifdef ANIM_BREAK_ON_HIT
+/**
+ * Moves pending hits that already landed into hit_tick
+ */
+static void update_last_hit(struct skill_adelay_timer* data, int64 tick)
+{
+	for (int i = 0; i < ANIM_HIT_SERIES; i++) {
+		struct skill_adelay_hits* hits = &data->hits[i];
+
+		if (hits->next == 0 || hits->next > tick)
+			continue;
+
+		int64 landed = tick >= hits->last ? hits->last
+			: hits->next + (tick - hits->next) / MULTIHIT_INTERVAL * MULTIHIT_INTERVAL;
+
+		data->hit_tick = max(data->hit_tick, landed);
+		hits->next = landed < hits->last ? landed + MULTIHIT_INTERVAL : 0;
+	}
+}
+
+/**
+ * Schedules div hits on a player starting at tick
+ * A series is merged into a pending one only when they overlap or touch on the same MULTIHIT_INTERVAL
+ * grid, so every hit lands when it would have on its own. Others are kept apart, up to ANIM_HIT_SERIES.
+ * Series beyond that are ignored, which keeps the delay in place rather than breaking it early.
+ */
+static void add_hits(struct block_list* dst, int64 tick, int div)
+{
+	struct map_session_data* sd = BL_CAST(BL_PC, dst);
+	struct skill_adelay_hits* free_hits = NULL;
+
+	if (sd == NULL || div <= 0)
+		return;
+
+	struct skill_adelay_timer* data = get_adelays_timer(sd);
+	int64 last = tick + (int64)(div - 1) * MULTIHIT_INTERVAL;
+
+	update_last_hit(data, timer->gettick());
+
+	for (int i = 0; i < ANIM_HIT_SERIES; i++) {
+		struct skill_adelay_hits* hits = &data->hits[i];
+
+		if (hits->next == 0) {
+			if (free_hits == NULL)
+				free_hits = hits;
+			continue;
+		}
+
+		if ((tick - hits->next) % MULTIHIT_INTERVAL == 0
+			&& tick <= hits->last + MULTIHIT_INTERVAL && last >= hits->next - MULTIHIT_INTERVAL) {
+			hits->next = min(hits->next, tick);
+			hits->last = max(hits->last, last);
+			return;
+		}
+	}
+
+	if (free_hits != NULL) {
+		free_hits->next = tick;
+		free_hits->last = last;
+	}
+}
+#endif
+
 /**
  * Checks if it possible to use the requested skill_id taking into account
  * the animation delay of the last used skill
@@ -270,6 +892,8 @@ static int post_skill_not_ok(int retVal, uint16 skill_id, struct map_session_dat
 		return 0;
 
 #ifdef ANIM_BREAK_ON_HIT
+	update_last_hit(data, timer->gettick());
+
 	if (data->hit_tick > data->tick) {
 		// User got hit after last skill, breaking the animation
 		return 0;
@@ -282,59 +906,54 @@ static int post_skill_not_ok(int retVal, uint16 skill_id, struct map_session_dat
 		return 0;
 #endif
 
-	int last_skill_index = skill->get_index(data->last_skill_id);
+	if (data->generation != skill_adelays_generation)
+		// Skill db was reloaded since last skill
+		update_adelays_ticks(sd, data);
+
+	int64 allowed = data->last_skill_id == skill_id ? data->allowed_same : data->allowed_others;
+	int64 tick = timer->gettick();
+
+	if (tick >= allowed)
+		// Last skill delay is over
+		return 0;
+
+	const struct skill_adelay_table *table = skill_adelays;
 	int current_skill_index = skill->get_index(skill_id);
-	struct skill_adelay_entry *last_skill_adelay = skill_adelay_list[last_skill_index];
-	struct skill_adelay_entry *current_skill_adelay = skill_adelay_list[current_skill_index];
 
-	if (!last_skill_adelay || !current_skill_adelay)
+	if (!adelay_bit_get(table->defined, current_skill_index))
 		return 0;
 
 #ifdef ANIM_DELAY_ALLOW_BYPASS
-	if (current_skill_adelay->bypass)
+	if (adelay_bit_get(table->bypass, current_skill_index))
 		// Skill ignores any delay
 		return 0;
 #endif
 
-	int delay = last_skill_adelay->delay; // Direct delay
-
-	if (data->last_skill_id != skill_id && last_skill_adelay->delay_others != 0) // Delay if it's a different skill
-		delay = last_skill_adelay->delay_others;
-
-	if (delay < 0) // Delay is a percentage over character's adelay
-		delay = abs(delay) * status_get_adelay(&sd->bl) / 100;
-
-	if (last_skill_adelay->max_delay != 0 && delay > last_skill_adelay->max_delay) // Delay should not exceed MaxDelay
-		delay = last_skill_adelay->max_delay;
-
-	int64 tick = timer->gettick();
-	int64 tick_diff = tick - data->tick;
-
-	if (tick_diff < (delay * ANIM_DELAY_LENIENCY / 100))
-		// Last skill delay still in place
-		return 1;
-
-	return 0;
+	// Last skill delay still in place
+#ifdef ANIM_CALIBRATION
+	data->rejected = true;
+#endif
+#ifdef ANIM_REJECT_LOG
+	record_reject(sd, data, skill_id, tick, allowed);
+#endif
+	return 1;
 }
 
-/**
- * Update last_hit_tick from player
- */
-#ifdef ANIM_BREAK_ON_HIT
-static int update_last_hit_timer(int tid, int64 tick, int id, intptr_t data)
+/****************************/
+/* Hooks */
+static void post_status_calc_bl_(struct block_list* bl, enum scb_flag flag, enum e_status_calc_opt opt)
 {
-	struct map_session_data* sd = map->id2sd(id);
-	if (sd == NULL)
-		return 0;
+	if (bl == NULL || bl->type != BL_PC || (flag & SCB_ASPD) == 0)
+		return;
 
-	struct skill_adelay_timer* skill_data = get_adelays_timer(sd);
-	skill_data->hit_tick = tick;
-	return 1;
+	struct map_session_data* sd = BL_CAST(BL_PC, bl);
+	struct skill_adelay_timer* data = getFromMSD(sd, 0);
+
+	if (data != NULL && data->last_skill_id != 0)
+		// Percentage delays follow the new adelay
+		update_adelays_ticks(sd, data);
 }
-#endif
 
-/****************************/
-/* Hooks */
 static int post_clif_skill_nodamage(int retVal, struct block_list* src, struct block_list* dst, uint16 skill_id, int heal, int fail)
 {
 	set_adelays_timer(src, skill_id);
@@ -363,11 +982,8 @@ static int post_clif_skill_damage(int retVal, struct block_list* src, struct blo
 	}
 
 #ifdef ANIM_BREAK_ON_HIT
-	if (dst != NULL && dst->type == BL_PC && in_damage > 0) {
-		for (int i = 0; i < div; i++) {
-			timer->add(tick + sdelay + (i * MULTIHIT_INTERVAL), update_last_hit_timer, dst->id, 0);
-		}
-	}
+	if (dst != NULL && dst->type == BL_PC && in_damage > 0)
+		add_hits(dst, tick + sdelay, div);
 #endif
 
 	return retVal;
@@ -376,16 +992,57 @@ static int post_clif_skill_damage(int retVal, struct block_list* src, struct blo
 #ifdef ANIM_BREAK_ON_HIT
 static int post_clif_damage(int retVal, struct block_list* src, struct block_list* dst, int sdelay, int ddelay, int64 in_damage, short div, enum battle_dmg_type type, int64 in_damage2)
 {
-	if (dst != NULL && dst->type == BL_PC && in_damage > 0) {
-		for (int i = 0; i < div; i++) {
-			timer->add(timer->gettick() + sdelay + (i * MULTIHIT_INTERVAL), update_last_hit_timer, dst->id, 0);
-		}
-	}
+	if (dst != NULL && dst->type == BL_PC && in_damage > 0)
+		add_hits(dst, timer->gettick() + sdelay, div);
 	return retVal;
 }
 #endif
 
 
+#ifdef ANIM_REJECT_LOG
+/**
+ * Shows skills rejected because of the delay of the last skill
+ * Usage: @adelaystats [<skill name or id>]
+ */
+ACMD(adelaystats) {
+	char output[CHAT_SIZE_MAX];
+
+	if (message != NULL && *message != '\0') {
+		int skill_id = skill->name2id(message);
+
+		if (skill_id == 0)
+			skill_id = atoi(message);
+		if (skill_id <= 0 || skill->get_index(skill_id) == 0) {
+			clif->message(fd, "Unknown skill.");
+			return false;
+		}
+
+		const struct skill_adelay_reject_count* count = &reject_log.counts[skill->get_index(skill_id)];
+		snprintf(output, sizeof(output), "%s: %u skills rejected, %.0f ms too early on average",
+			skill->get_name(skill_id), count->count, count->count > 0 ? (double)count->early / count->count : 0.);
+		clif->message(fd, output);
+		return true;
+	}
+
+	struct skill_adelay_reject_count* counts;
+	CREATE(counts, struct skill_adelay_reject_count, MAX_SKILL_DB);
+	memcpy(counts, reject_log.counts, sizeof(reject_log.counts));
+	qsort(counts, MAX_SKILL_DB, sizeof(*counts), reject_count_compare);
+
+	snprintf(output, sizeof(output), "%"PRId64" skills rejected, %"PRId64" not logged yet, %"PRId64" lost to a full buffer",
+		reject_log.seq, reject_log.seq - reject_log.flushed, reject_log.dropped);
+	clif->message(fd, output);
+
+	for (int i = 0; i < ANIM_REJECT_LINES && counts[i].count > 0; i++) {
+		snprintf(output, sizeof(output), "  %s: %u rejected, %.0f ms too early on average",
+			skill->get_name(counts[i].skill_id), counts[i].count, (double)counts[i].early / counts[i].count);
+		clif->message(fd, output);
+	}
+
+	aFree(counts);
+	return true;
+}
+#endif
 
 // Plugin initialization
 HPExport void plugin_init(void)
@@ -398,7 +1055,39 @@ HPExport void plugin_init(void)
 	addHookPost(clif, skill_nodamage, post_clif_skill_nodamage);
 	addHookPost(clif, skill_poseffect, post_clif_skill_poseffect);
 	addHookPost(clif, skill_damage, post_clif_skill_damage);
+	/* Hook to keep cached delays up to date with ASPD */
+	addHookPost(status, calc_bl_, post_status_calc_bl_);
 #ifdef ANIM_BREAK_ON_HIT
 	addHookPost(clif, damage, post_clif_damage);
 #endif
+#ifdef ANIM_REJECT_LOG
+	addAtcommand("adelaystats", adelaystats);
+	reject_log.timer = INVALID_TIMER;
+#endif
+#ifdef ANIM_CALIBRATION
+	calib_db = i64db_alloc(DB_OPT_RELEASE_DATA);
+	addHookPre(map, quit, pre_map_quit);
+#endif
+}
+
+HPExport void server_online(void)
+{
+#ifdef ANIM_REJECT_LOG
+	reject_log_init();
+#endif
+}
+
+HPExport void plugin_final(void)
+{
+#ifdef ANIM_CALIBRATION
+	calib_export();
+	db_destroy(calib_db);
+#endif
+#ifdef ANIM_REJECT_LOG
+	reject_log_final();
+#endif
+	if (skill_adelays != NULL) {
+		aFree(skill_adelays);
+		skill_adelays = NULL;
+	}
 }
@@ -0,0 +1,22 @@
+-- Persisted buying stores of parallel_autotrade (AUTOTRADE_PERSISTENCY)
+-- Import into the main database, next to autotrade_merchants and autotrade_data
+
+CREATE TABLE IF NOT EXISTS `autotrade_buyers` (
+  `account_id` INT(11) NOT NULL DEFAULT '0',
+  `char_id` INT(11) NOT NULL DEFAULT '0',
+  `sex` TINYINT(2) NOT NULL DEFAULT '0',
+  `title` VARCHAR(80) NOT NULL DEFAULT 'Buying',
+  `limit` INT(11) NOT NULL DEFAULT '0',
+  `max_weight` INT(11) NOT NULL DEFAULT '0',
+  `inventory_size` INT(11) NOT NULL DEFAULT '0',
+  PRIMARY KEY (`char_id`),
+  KEY `account_id` (`account_id`)
+) ENGINE=InnoDB;
+
+CREATE TABLE IF NOT EXISTS `autotrade_buyers_data` (
+  `char_id` INT(11) NOT NULL DEFAULT '0',
+  `nameid` INT(11) NOT NULL DEFAULT '0',
+  `amount` INT(11) NOT NULL DEFAULT '0',
+  `price` INT(11) NOT NULL DEFAULT '0',
+  PRIMARY KEY (`char_id`, `nameid`)
+) ENGINE=InnoDB;
@@ -0,0 +1,18 @@
+-- Sales and buys of parallel_autotrade clones (AT_SALES_RING)
+-- Import into the main database. Rows are only ever appended
+
+CREATE TABLE IF NOT EXISTS `autotrade_sales` (
+  `id` BIGINT(20) UNSIGNED NOT NULL AUTO_INCREMENT,
+  `time` DATETIME NOT NULL,
+  `type` TINYINT(2) NOT NULL DEFAULT '0',
+  `map` VARCHAR(11) NOT NULL DEFAULT '',
+  `clone_id` INT(11) NOT NULL DEFAULT '0',
+  `other_id` INT(11) NOT NULL DEFAULT '0',
+  `nameid` INT(11) NOT NULL DEFAULT '0',
+  `refine` TINYINT(3) UNSIGNED NOT NULL DEFAULT '0',
+  `amount` INT(11) NOT NULL DEFAULT '0',
+  `price` INT(11) NOT NULL DEFAULT '0',
+  PRIMARY KEY (`id`),
+  KEY `nameid` (`nameid`),
+  KEY `clone_id` (`clone_id`)
+) ENGINE=InnoDB;
@@ -15,20 +15,36 @@
 //= @autotrade
 //= @at
 //===== Important: ==========================================
-//= Increase MAX_MOB_DB and MOB_CLONE_START in mob.h for
-//= accommodating the necessary number of @at clones
+//= Concurrent @at clones are bound to the mob.h clone range,
+//= increase MAX_MOB_DB and MOB_CLONE_START in mob.h for
+//= accommodating the necessary number of @at clones.
+//= Classes are recycled as soon as a clone is removed
 //=
 //= Compatible with AUTOTRADE_PERSISTENCY
 //===========================================================
 
 #include "stdlib.h"
+#include "stddef.h"
+#include "stdio.h"
+#include "time.h"
+#ifdef WIN32
+	#include <io.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
 #include "common/hercules.h"
 #include "common/core.h"
+#include "common/ers.h"
 #include "common/msgtable.h"
 #include "common/memmgr.h"
+#include "common/mutex.h"
 #include "common/nullpo.h"
 #include "common/socket.h"
 #include "common/sql.h"
+#include "common/thread.h"
 #include "common/timer.h"
 #include "common/utils.h"
 #include "char/char.h"
@@ -39,8 +55,11 @@
 #include "map/channel.h"
 #include "map/chrif.h"
 #include "map/clif.h"
+#include "map/itemdb.h"
 #include "map/mob.h"
+#include "map/packets_struct.h"
 #include "map/pc.h"
+#include "map/searchstore.h"
 #include "plugins/HPMHooking.h"
 #include "common/HPMDataCheck.h"
 
@@ -52,6 +71,132 @@
 
 // Packet number for inter server communication from char to map server
 #define CHAR_MAP_PACKET_ID 0x15
+// Packet number for inter server communication from map to char server
+#define MAP_CHAR_PACKET_ID 0x16
+
+/**
+ * @at releases the player's session as soon as the char server acknowledges the char-select,
+ * or after AT_HANDOFF_TIMEOUT ms without an answer.
+ * Clone saves are held back until the player's final save is acknowledged, for at most AT_HANDOFF_HOLD ms
+ */
+#define AT_HANDOFF_TIMEOUT 500
+#define AT_HANDOFF_HOLD 10000
+
+// Max number of shops listed by @whosell and @whobuy
+#define AT_WHO_MAX_LINES 30
+
+/**
+ * Clone saves are snapshotted on the main thread and written behind by a dedicated SQL connection.
+ * The writer runs on its own thread only when the memory manager is disabled (it is not thread safe),
+ * as the SQL layer allocates through it. Default builds define USE_MEMMGR: there the queue is drained
+ * from the main loop, AT_PERSIST_BATCH saves per AT_PERSIST_INTERVAL, and the writes still block it.
+ */
+#ifndef USE_MEMMGR
+	#define AT_PERSIST_THREAD
+#endif
+
+// Interval (ms) at which written saves are collected and failures reported
+#define AT_PERSIST_INTERVAL 100
+// Max number of queued saves written in one transaction, and per interval when not using the writer thread
+#define AT_PERSIST_BATCH 32
+// Number of times a failed save is retried before being dropped
+#define AT_PERSIST_RETRIES 3
+/**
+ * Cart/inventory saves only write the slots changed since the last save.
+ * Every Nth save of a clone reconciles the whole table instead, verifying the incremental writes.
+ * Use 0 to only reconcile when the persisted state is unknown (first save of an @at clone, failed writes)
+ */
+#define AT_PERSIST_RECONCILE 0
+
+/**
+ * Clone timeouts and remaining time saves are driven by a single timing wheel.
+ * Resolution (ms) of the wheel, clones expire within this delay of their timeout
+ */
+#define AT_SCHED_RESOLUTION 1000
+// Number of buckets of the wheel, clones expiring later than a full turn wait for the following turns
+#define AT_SCHED_BUCKETS 1024
+// Max number of clones updated or deleted per statement, all statements of a batch share one transaction
+#define AT_SCHED_BATCH 500
+
+/**
+ * Number of threads building persisted clones at startup, each one with its own SQL connection.
+ * Merchants are partitioned by char_id and only spawning is left to the main thread.
+ * Use 0 to load serially. Requires the memory manager to be disabled as well.
+ */
+#define AT_LOAD_WORKERS 0
+
+/**
+ * Board and push cart packets of the clones entering a client's view are serialized once per clone,
+ * queued and sent in a single write once the view refresh is over.
+ * Size (bytes) of a client's queue, flushed early when full. Must stay below the max client packet length.
+ */
+#define AT_COALESCE_SIZE 4096
+
+/**
+ * Persisted merchants are read as stubs at startup (char id and map) and only spawned when their map
+ * gets its first player, or when a store search, @whosell or @whobuy needs every shop.
+ * Their autotrade timeout keeps running as stubs. Uncomment to enable, every merchant is spawned at startup otherwise.
+ */
+//#define AT_LAZY_LOAD
+
+/**
+ * Progressive restore: merchants loaded at startup are spawned by a timer every AT_SPAWN_INTERVAL ms
+ * instead of in a single stall, players can log in while the market fills up.
+ * Budget per tick in merchants (AT_SPAWN_BUDGET) and milliseconds (AT_SPAWN_BUDGET_MS), 0 for no limit.
+ * Leave both at 0 to spawn every merchant at once. Unused with AT_LAZY_LOAD.
+ */
+#define AT_SPAWN_BUDGET 0
+#define AT_SPAWN_BUDGET_MS 0
+#define AT_SPAWN_INTERVAL 50
+
+/**
+ * Trade clones are written to a binary snapshot at shutdown and restored from it at startup, skipping
+ * the SQL loader. A snapshot is used once, and only if the autotrade tables weren't modified after it.
+ * Uncomment to enable, merchants are always loaded from SQL otherwise.
+ */
+//#define AT_SNAPSHOT_FILE "save/parallel_autotrade.snapshot"
+#define AT_SNAPSHOT_VERSION 2
+
+/**
+ * Clone sales and buys are appended to a local journal as they happen, and synced to disk every AT_JOURNAL_SYNC ms
+ * by a dedicated thread. The journal is replayed into SQL at startup, so a crash only loses the last sync interval.
+ * Saves requested by the core after each sale are deferred: journaled clones are saved every
+ * AT_JOURNAL_CHECKPOINT ms, and their records dropped once written. Uncomment to enable, clones are saved on every request otherwise.
+ */
+//#define AT_JOURNAL_FILE "save/parallel_autotrade.journal"
+#define AT_JOURNAL_SYNC 20
+#define AT_JOURNAL_CHECKPOINT 60000
+// Max journal files waiting for the sync thread, synced from the main loop when full
+#define AT_JOURNAL_SYNC_QUEUE 4
+
+/**
+ * Clones left idle for AT_HIBERNATE_IDLE ms on a map without players (not seen, opened or found by a search)
+ * have their shop items moved to a local page file, checked every AT_HIBERNATE_INTERVAL ms.
+ * They are read back ahead of use when a player enters their map, sees them or finds them with a search,
+ * at most AT_HIBERNATE_PREFETCH per tick. Only opening the shop reads one back right away.
+ * Uncomment to enable, every clone is kept in memory otherwise.
+ */
+//#define AT_HIBERNATE_FILE "save/parallel_autotrade.pages"
+#define AT_HIBERNATE_IDLE 600000
+#define AT_HIBERNATE_INTERVAL 10000
+#define AT_HIBERNATE_PREFETCH 32
+
+/**
+ * Sales and buys of clones are kept in memory, the last AT_SALES_RING of them, for @marketstats.
+ * Every AT_SALES_FLUSH ms the new ones are written to autotrade_sales (see autotrade_sales.sql)
+ * through the persistence queue, AT_SALES_BATCH rows per statement. Uncomment AT_SALES_RING to enable
+ * (import autotrade_sales.sql first).
+ */
+//#define AT_SALES_RING 65536
+#define AT_SALES_FLUSH 5000
+#define AT_SALES_BATCH 500
+// Max items listed by @marketstats
+#define AT_MARKETSTATS_LINES 10
+
+#if AT_LOAD_WORKERS > 0 && defined(USE_MEMMGR)
+	#undef AT_LOAD_WORKERS
+	#define AT_LOAD_WORKERS 0 // Memory manager is not thread safe
+#endif
 
 HPExport struct hplugin_info pinfo = {
 	"parallel_autotrade",
@@ -67,22 +212,622 @@ enum trade_type {
 
 struct trade_options {
 	int pushcart;
-	int time;
-	int save_timer;
-	int quit_timer;
+	int time; // Remaining time as of the last save
+	int64 expire; // Timeout tick, 0 if none
+};
+
+enum at_table {
+	AT_TABLE_CART,
+	AT_TABLE_INVENTORY, // Buying stores only
+	AT_TABLE_MAX
+};
+
+#define AT_TABLE_SLOTS (MAX_CART > MAX_INVENTORY ? MAX_CART : MAX_INVENTORY)
+
+/* Persisted state of a clone's cart or inventory */
+struct at_item_state {
+	uint32 dirty[(AT_TABLE_SLOTS + 31) / 32]; // Slots changed since the last snapshot
+	struct item saved[AT_TABLE_SLOTS]; // Contents as last written, id being the row id (-1 while its insert is in flight)
+	bool reconcile; // Persisted state is unknown, next save diffs the whole table
+	int pending; // Reconciles in flight, slots can't be diffed until their row ids are known
+	int saves;
+};
+
+/* Shop entry of a clone, linked into the listings of its item */
+struct at_listing {
+	struct trade_clone* tc;
+	int price;
+	int amount;
+	struct item item; // Sold stack, only nameid for buying stores
+	struct at_listing* prev;
+	struct at_listing* next;
 };
 
+#define AT_LISTING_MAX (MAX_VENDING > MAX_BUYINGSTORE_SLOTS ? MAX_VENDING : MAX_BUYINGSTORE_SLOTS)
+
+/* Items of a clone's shop */
+struct at_payload {
+	struct item cart[MAX_CART];
+	int vend_num;
+	struct s_vending vending[MAX_VENDING];
+	struct s_buyingstore buyingstore;
+	struct item* inventory; // Buying stores only
+};
+
+enum at_handoff_state {
+	AT_HANDOFF_NONE,
+	AT_HANDOFF_SELECT, // Waiting for the char-select acknowledge
+	AT_HANDOFF_QUIT, // Session released, waiting for the player's final save
+};
+
+/* Session handover of an @at in progress */
+struct at_handoff {
+	enum at_handoff_state state;
+	int timer;
+	int64 tick; // @at time
+	unsigned int held; // Saves (at_persist_flag) waiting for the player's final save
+};
+
+/**
+ * Trade clone. Only keeps what vending and buying stores read, a map_session_data adapter
+ * is materialized from it whenever the core asks for the clone's session (see clone_sd).
+ */
 struct trade_clone {
 	enum trade_type type;
 	struct mob_data* md;
-	struct map_session_data sd;
+	int char_id;
+	int account_id;
+	int group_id;
+	int sex;
+	int zeny;
+	int vender_id;
+	int buyer_id;
+	int weight, max_weight;
+	int cart_weight, cart_num;
+	int inventory_size;
+	char message[MESSAGE_SIZE];
+	uint8* board_packet; // Serialized board, built on first view
+	int board_len;
+	uint8* cart_packet; // Serialized push cart status, built on first view
+	int cart_len;
+	struct at_payload* payload;
+	struct map_session_data* sd; // Materialized adapter, NULL if none
+	int release_timer;
+	int listing_count;
+	struct at_listing listings[AT_LISTING_MAX]; // Indexed shop entries
 	struct trade_options options;
+	int persist_gen; // Tells saves of a removed clone apart from a newer clone of the same char
+	int journal_delta; // Zeny change not journaled yet
+	struct at_item_state* items[AT_TABLE_MAX];
+	struct trade_clone* account_prev; // Clones of the same account
+	struct trade_clone* account_next;
+	bool scheduled;
+	int sched_bucket;
+	struct trade_clone* sched_prev; // Clones of the same scheduler bucket
+	struct trade_clone* sched_next;
+	struct at_handoff handoff;
+	int64 active_tick; // Last time the clone was seen, opened or found by a search
+	int page; // Page file slot while hibernated (payload is NULL)
+	uint64 page_checksum;
+	bool lost; // Payload couldn't be read back, removed without saving
+	bool prefetch; // Queued to be read back
+};
+
+/* Clones of an account */
+struct at_account {
+	int count;
+	struct trade_clone* head;
+};
+
+enum at_persist_flag {
+	AT_PERSIST_ITEMS = 0x1, // Cart, and inventory for buying stores
+	AT_PERSIST_ZENY = 0x2,
+	AT_PERSIST_BUYER = 0x4, // Buying store and its items, replaced as a whole
+	AT_PERSIST_TIMEOUT_DEL = 0x8, // Autotrade status removal
+	AT_PERSIST_BUYER_DEL = 0x10, // Buying store removal
+};
+
+enum at_item_op {
+	AT_OP_NONE,
+	AT_OP_UPDATE,
+	AT_OP_INSERT,
+	AT_OP_DELETE
+};
+
+/* Cart or inventory writes of a save */
+struct at_persist_items {
+	bool full; // Reconcile the whole table instead of applying the slot ops
+	bool verify; // State was believed to be in sync, rows fixed by the reconcile are drift
+	int ops;
+	uint8 op[AT_TABLE_SLOTS]; // at_item_op per slot
+	int row[AT_TABLE_SLOTS]; // Target row id, written back by the writer for inserts and reconciles
+	struct item item[AT_TABLE_SLOTS];
+	int rows_read; // Reported by the writer
+	int rows_written;
+};
+
+/* Buying store part of a save */
+struct at_persist_buyer {
+	int sex;
+	char title[MESSAGE_SIZE];
+	int max_weight;
+	int inventory_size;
+	struct s_buyingstore buyingstore;
+};
+
+/* Remaining time updates or autotrade status removals of many clones */
+struct at_persist_batch {
+	bool remove;
+	int seq; // Remaining time save number, updates only
+	int count;
+	int* char_ids;
+	int* ticks; // Remaining time, updates only
+};
+
+/* Sale of a vending clone, or buy of a buying store clone */
+struct at_sale {
+	int64 tick;
+	time_t time;
+	int nameid;
+	int refine;
+	int amount;
+	int price; // Unit price
+	int clone_id; // Char id of the clone
+	int other_id; // Char id of the buyer, or of the seller for buying stores
+	int16 m;
+	uint8 type; // trade_type of the clone
+};
+
+/* Sale events handed to the writer */
+struct at_persist_sales {
+	int count;
+	struct at_sale* events;
+};
+
+/**
+ * Pending save of a clone, or batch of scheduler writes.
+ * Only one snapshot per char_id can be waiting in the queue, newer saves overwrite it.
+ */
+struct at_persist {
+	int char_id;
+	int account_id;
+	int gen; // trade_clone persist_gen
+	enum trade_type type;
+	unsigned int flags; // Requested writes (at_persist_flag)
+	unsigned int failed; // Writes that failed, reported back by the writer
+	int retries;
+	int zeny;
+	struct at_persist_items* items[AT_TABLE_MAX];
+	struct at_persist_buyer* buyer;
+	struct at_persist_batch* batch; // Scheduler writes, not bound to a char_id
+	struct at_persist_sales* sales; // Sale events, not bound to a char_id
+	bool checkpoint; // Journal barrier, every save queued before it is written once collected
+	bool queued; // Still waiting in the queue, can be coalesced
+	bool commit; // Last write of a committed transaction
+	struct at_persist* next;
+};
+
+/* Item save counters, indexed by reconciling (1) or incremental (0) save */
+struct at_persist_stats {
+	int saves[2];
+	int64 rows_read[2];
+	int64 rows_written[2];
+	int drift; // Verifying reconciles that had to fix rows
+	int64 writes; // Clone saves and batches written
+	int64 commits;
+	int rollbacks; // Failed clone saves, none of their writes are kept
+};
+
+/* Statements prepared once on the persistence connection, parameters are bound to the fields below */
+struct at_persist_stmts {
+	struct SqlStmt* item_insert[AT_TABLE_MAX];
+	struct SqlStmt* item_update[AT_TABLE_MAX];
+	struct SqlStmt* item_delete[AT_TABLE_MAX];
+	struct SqlStmt* zeny;
+	struct SqlStmt* timeout_del;
+	struct SqlStmt* buyer_replace;
+	struct SqlStmt* buyer_items_delete;
+	struct SqlStmt* buyer_item_insert;
+	struct SqlStmt* buyer_delete;
+	struct item item;
+	int row;
+	int char_id;
+	int account_id;
+	int zeny_value;
+	struct at_persist_buyer buyer; // Title is bound on each write, its length varies
+	struct s_buyingstore_item buyer_item;
+};
+
+/* Write-behind persistence queue */
+struct at_persist_queue {
+	struct Sql* sql_handle; // Dedicated connection
+	struct at_persist* head; // Pending saves in FIFO order
+	struct at_persist* tail;
+	struct at_persist* done; // Written saves waiting to be collected by the main thread, in write order
+	struct at_persist* done_tail;
+	int timer;
+	int gen; // Last clone generation
+	struct at_persist_stmts stmts; // Only used by the thread writing saves
+#ifdef AT_PERSIST_THREAD
+	struct thread_handle* worker;
+	struct mutex_data* lock;
+	struct cond_data* wake;
+	bool stop;
+#endif
+};
+
+#if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
+/* Phases of the persisted merchants loader */
+enum at_load_phase {
+	AT_LOAD_MERCHANTS,
+	AT_LOAD_CHARACTERS,
+	AT_LOAD_STATUSES,
+	AT_LOAD_CARTS,
+	AT_LOAD_INVENTORIES, // Buying stores only
+	AT_LOAD_VENDINGS,
+	AT_LOAD_BUYINGS,
+	AT_LOAD_BUILD,
+	AT_LOAD_SPAWN,
+	AT_LOAD_MAX
+};
+
+/* Persisted merchant being built by the loader */
+struct at_load_entry {
+	enum trade_type type;
+	int char_id;
+	int account_id;
+	bool found; // Character row exists
+	char name[NAME_LENGTH];
+	char title[MESSAGE_SIZE];
+	char last_map[MAP_NAME_LENGTH_EXT];
+	int16 x, y;
+	short lv;
+	int sex;
+	int zeny;
+	int group_id;
+	int pushcart;
+	int timeout; // Remaining autotrade time, -1 if not stored
+	struct view_data vd;
+	int cart_num;
+	struct item cart[MAX_CART];
+	int vend_num;
+	struct s_vending vending[MAX_VENDING];
+	int max_weight; // Buying stores only
+	int inventory_size;
+	int inventory_num;
+	struct item* inventory;
+	struct s_buyingstore buyingstore;
+	int64 elapsed; // Time spent as a stub, counted against the timeout
+	struct trade_clone* tc; // Built clone, ready to be spawned
+	struct at_load_entry* account_prev; // Queued entries of the same account
+	struct at_load_entry* account_next;
+};
+
+/* Loader state, entries sorted by char_id */
+// Store types loaded by each worker, in turn (trade_type)
+#define AT_LOAD_TYPES 2
+
+struct at_load {
+	enum trade_type type; // Vending merchants or buying stores
+	struct at_load_entry* entries;
+	int count;
+	StringBuf filter; // Merchants partition (condition over `m`)
+	bool result;
+	int rows[AT_LOAD_MAX]; // Rows read per phase
+	int64 duration[AT_LOAD_MAX]; // Milliseconds spent per phase
+	enum at_load_phase failed_phase;
+};
+
+/* Loaded merchants waiting to be spawned (progressive restore) */
+struct at_spawn_queue {
+	struct at_load* loads; // Loader results, freed once drained
+	int load_count;
+	struct at_load_entry** entries;
+	int count;
+	int next; // Next entry to spawn
+	int spawned;
+	struct DBMap* db; // Char id to its queued entry
+	struct DBMap* accounts; // Account id to its first queued entry
+	int timer;
+	int64 start;
+};
+#endif
+
+#ifdef AT_SNAPSHOT_FILE
+/* Snapshot file header, followed by the clone records */
+struct at_snapshot_header {
+	char magic[4];
+	uint32 version;
+	uint32 record_size; // Layout checks, struct sizes depend on the server build
+	uint32 item_size;
+	uint32 count; // Clones
+	uint32 vendings; // Vending clones, matched against the merchants table
+	uint32 buyings; // Buying store clones, matched against the buyers table
+	int64 written; // Unix time
+	uint64 size; // Bytes after the header
+	uint64 checksum; // FNV-1a of the bytes after the header
+};
+
+/* Clone record, followed by its cart, inventory and vending entries */
+struct at_snapshot_record {
+	int char_id;
+	int account_id;
+	int group_id;
+	int sex;
+	int zeny;
+	int type;
+	int weight, max_weight;
+	int inventory_size;
+	int pushcart;
+	int timeout; // Remaining ms, -1 if not timed
+	short lv;
+	int16 x, y;
+	int16 dir;
+	char name[NAME_LENGTH];
+	char map[MAP_NAME_LENGTH_EXT];
+	char message[MESSAGE_SIZE];
+	struct view_data vd;
+	struct s_buyingstore buyingstore;
+	int cart_slots; // Slots written, vending entries refer to cart slots
+	int inventory_slots;
+	int vend_num;
+};
+#endif
+
+#ifdef AT_JOURNAL_FILE
+enum at_journal_type {
+	AT_JOURNAL_ITEMS, // Whole cart or inventory after a change
+	AT_JOURNAL_ZENY, // Zeny after a change
+	AT_JOURNAL_CLOSE // Clone removed, its character is no longer ours
+};
+
+// Changes waiting for the next sync (bits of a char's pending flags)
+#define AT_JOURNAL_TABLE(table) (1U << (table))
+#define AT_JOURNAL_ZENY_FLAG (1U << AT_TABLE_MAX)
+
+/* Journal record, followed by count entries for item records */
+struct at_journal_record {
+	uint32 size; // Bytes after the checksum
+	uint32 checksum; // FNV-1a (low bits) of the bytes after it, torn writes are dropped at replay
+	int type;
+	int char_id;
+	int account_id;
+	int table;
+	int zeny;
+	int delta;
+	int count;
+};
+
+struct at_journal_entry {
+	int slot;
+	struct item item;
+};
+
+/* State of a character rebuilt from the journal */
+struct at_journal_state {
+	int account_id;
+	bool has_zeny;
+	int zeny;
+	struct item* tables[AT_TABLE_MAX];
+};
+
+struct at_journal {
+	FILE* fp;
+	int file_gen; // Bumped every time the journal is moved aside
+	int checkpoint_first; // Checkpoint files (see journal_checkpoint_name) not dropped yet
+	int checkpoint_next;
+	uint8* scratch; // Record being built
+	struct DBMap* pending; // Char id to changes not journaled yet
+	struct DBMap* touched; // Char ids journaled since the last checkpoint
+	int sync_timer;
+	int checkpoint_timer;
+	bool checkpointing; // Waiting for the barrier
+	bool failed; // A save failed during the checkpoint, its records are kept
+	bool resave; // Save every clone on the next checkpoint
+	int64 records;
+	int64 bytes; // Written since the last checkpoint
+	int syncs;
+	int checkpoints;
+	int replayed;
+	struct thread_handle* syncer;
+	struct mutex_data* lock;
+	struct cond_data* wake;
+	bool stop;
+	int sync_count; // Descriptors waiting for the sync thread, owned by it
+	int sync_fds[AT_JOURNAL_SYNC_QUEUE];
+	int sync_gens[AT_JOURNAL_SYNC_QUEUE];
+};
+#endif
+
+#ifdef AT_SALES_RING
+/* Shop entry of a clone before a trade */
+struct at_sale_entry {
+	int key; // Cart slot for vending, item id for buying stores
+	int nameid;
+	int refine;
+	int amount;
+	int price;
+};
+
+/* Shop of a clone before a trade, diffed into sale events once it's over */
+struct at_sale_scan {
+	int char_id; // 0 when no trade is running
+	int gen;
+	int other_id;
+	int16 m;
+	enum trade_type type;
+	int count;
+	struct at_sale_entry entries[MAX_VENDING + MAX_BUYINGSTORE_SLOTS];
+};
+
+/* Sale events of the clones */
+struct at_sales {
+	struct at_sale* ring; // Last AT_SALES_RING events, oldest overwritten first
+	int64 seq; // Events recorded
+	int64 flushed; // Events handed to the writer
+	int64 dropped; // Overwritten before being handed
+	int64 written;
+	int64 lost; // Dropped after failed writes
+	int timer;
+	struct at_sale_scan scan;
+};
+
+/* @marketstats summary of an item on one side of the market */
+struct at_market_item {
+	int nameid;
+	uint8 type;
+	int trades;
+	int64 volume;
+	int median;
+	int min_price;
+	int max_price;
+};
+#endif
+
+#ifdef AT_HIBERNATE_FILE
+// Page file slot, large enough for the payload of a buying store
+#define AT_PAGE_SIZE (sizeof(struct at_payload) + sizeof(struct item[MAX_INVENTORY]))
+
+/* Page file holding the payloads of hibernated clones */
+struct at_hibernate {
+	FILE* fp;
+	int slots; // Slots in the file
+	int* free; // Stack of released slots
+	int free_count;
+	int free_max;
+	int timer;
+	int* maps; // Hibernated clones per map index
+	int* prefetch; // Char ids of the clones to read back, oldest first
+	int prefetch_count;
+	int prefetch_max;
+	int prefetch_timer;
+	int count; // Hibernated clones
+	int64 bytes; // Memory released by them
+	int hibernations;
+	int faults;
+	int64 fault_total, fault_max; // Payload read back (us)
+};
+#endif
+
+/* Persisted merchant not spawned yet */
+struct at_stub {
+	int char_id;
+	int account_id;
+	int16 m;
+	struct at_stub* prev; // Stubs of the same map
+	struct at_stub* next;
+	struct at_stub* account_prev; // Stubs of the same account
+	struct at_stub* account_next;
+};
+
+/* Item listed by a stub */
+struct at_stub_item {
+	int char_id;
+	struct at_stub_item* next; // Stubs listing the same item
+};
+
+/* Lazily loaded merchants */
+struct at_stubs {
+	struct DBMap* db; // Char id to its stub
+	struct DBMap* accounts; // Account id to its first stub
+	struct DBMap* items[2]; // Item id to the stubs listing it, per trade_type. Entries of spawned stubs are skipped
+	bool items_loaded; // Searches spawn every stub otherwise
+	struct at_stub** maps; // Stubs per map index
+	int count;
+	int64 loaded; // Tick stubs were read at
+	int spawned; // Merchants spawned from stubs
+	int64 duration; // Milliseconds spent spawning them
+};
+
+/* Timing wheel of clone timeouts */
+struct at_scheduler {
+	struct trade_clone* buckets[AT_SCHED_BUCKETS];
+	int64 cursor; // Last processed slot (tick / AT_SCHED_RESOLUTION)
+	int64 last_save;
+	int saves; // Remaining time saves issued
+	int count; // Scheduled clones
+	int timer;
+	int last_saved; // Clones written by the last remaining time save
+	int last_statements; // Statements it took, transaction excluded
+};
+
+/* Pool of materialized map_session_data adapters */
+struct at_adapters {
+	struct eri* ers;
+	int count; // Currently materialized
+	int peak;
+	int64 total; // Materializations since startup
+	struct map_session_data* search_proxy; // Stands for every clone in vending/buying store dbs
+};
+
+/* Packets queued for a client during a view refresh */
+struct at_coalesce {
+	int len;
+	int timer;
+	uint8 data[AT_COALESCE_SIZE];
+};
+
+struct at_packet_stats {
+	int64 built; // Packets serialized into a clone's cache
+	int64 queued; // Packets sent from a cache
+	int64 writes; // Socket writes carrying them
+};
+
+/* Ids of clone mobs, tested before any lookup by the global hooks */
+struct at_clone_ids {
+	uint32* bits; // Bit per block id from START_NPC_NUM
+	int words;
+};
+
+/* Clone classes allocator */
+struct at_clone_classes {
+	int free[MOB_CLONE_END - MOB_CLONE_START]; // Stack of free classes
+	int count;
+	bool owned[MOB_CLONE_END - MOB_CLONE_START]; // Classes taken by trade clones
+	struct eri* db_ers; // mob_db pool
+};
+
+/* @at handover latencies (ms since the command) */
+struct at_handoff_stats {
+	int count;
+	int released;
+	int fallbacks; // Sessions released without a char-select acknowledge
+	int64 select_total, select_max;
+	int saved; // Final saves acknowledged
+	int expired; // Holds given up on
+	int64 save_total, save_max;
 };
 
 // Databases to keep track of clones
 struct DBMap* clone_db;
 struct DBMap* vender_db;
 struct DBMap* buyer_db;
+struct DBMap* persist_db; // Char id to its newest pending save
+struct DBMap* account_db; // Account id to its clones (at_account)
+struct DBMap* listing_db[2]; // Item id to its listings, per trade_type
+struct DBMap* handoff_db; // Char server: char id to the tables (1 << at_table) its next save leaves alone
+
+struct at_persist_queue persist = { 0 };
+struct at_persist_stats persist_stats = { 0 };
+struct at_scheduler sched = { 0 };
+struct at_adapters adapters = { 0 };
+struct at_packet_stats packet_stats = { 0 };
+struct at_clone_ids clone_ids = { 0 };
+struct at_handoff_stats handoff_stats = { 0 };
+struct at_stubs stubs = { 0 };
+#ifdef AT_JOURNAL_FILE
+struct at_journal journal = { 0 };
+#endif
+#ifdef AT_HIBERNATE_FILE
+struct at_hibernate hibernate = { 0 };
+#endif
+#ifdef AT_SALES_RING
+struct at_sales sales = { 0 };
+#endif
+#if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
+struct at_spawn_queue spawn_queue = { 0 };
+#endif
+struct at_clone_classes clone_classes = { 0 };
 
 // Table names
 const char cart_db[256] = "cart_inventory";
@@ -90,47 +835,320 @@ const char inventory_db[256] = "inventory";
 const char character_db[256] = "char";
 const char login_db[256] = "login";
 const char sc_data_db[256] = "sc_data";
+const char buyers_db[256] = "autotrade_buyers"; // See autotrade_buyers.sql
+const char buyers_data_db[256] = "autotrade_buyers_data";
+const char sales_db[256] = "autotrade_sales"; // See autotrade_sales.sql
 
 //====== Function declarations =========
+static void clone_class_refill(void);
+static int clone_class_alloc(struct mob_db** out);
+static void clone_class_free(int class_);
+static int mob_clone_delete_pre(struct mob_data** md);
 static int at_clone_spawn_vending(struct map_session_data* sd);
 static void clif_getareachar_unit_post(struct map_session_data* sd, struct block_list* bl);
+static void clone_packets_invalidate(struct trade_clone* tc);
+static void packet_build_cart(struct trade_clone* tc, int id);
+static void packet_build_board(struct trade_clone* tc, int id);
+static void packet_queue(struct map_session_data* sd, const uint8* packet, int len);
+static void packet_flush(struct map_session_data* sd, struct at_coalesce* queue);
+static int packet_flush_timer(int tid, int64 tick, int id, intptr_t data);
 static struct trade_clone* id2tc(int id);
+static void clone_id_set(int id, bool clone);
+static inline bool clone_id_test(int id);
+static struct trade_clone* sd2tc(struct map_session_data* sd);
+static struct at_payload* clone_payload_create(enum trade_type type);
+static struct map_session_data* clone_sd(struct trade_clone* tc, bool deferred_release);
+static void clone_sync(struct trade_clone* tc);
+static void clone_release(struct trade_clone* tc);
+static int clone_release_timer(int tid, int64 tick, int id, intptr_t data);
+static void clone_discard(struct trade_clone* tc);
+static bool vending_searchall_pre(struct map_session_data** sd, const struct s_search_store_search** s);
+static bool buyingstore_searchall_pre(struct map_session_data** sd, const struct s_search_store_search** s);
+static bool clone_searchall(enum trade_type type, const struct s_search_store_search* s);
+static bool listing_has_card(const struct at_listing* l, const struct s_search_store_search* s);
+static void listing_link(struct at_listing* l, enum trade_type type);
+static void listing_unlink(struct at_listing* l, enum trade_type type);
+static void clone_index(struct trade_clone* tc);
+static void clone_unindex(struct trade_clone* tc);
+static bool clone_who(int fd, const char* message, enum trade_type type);
 static void save(struct trade_clone* tc);
 static void clif_authok_post(struct map_session_data* sd);
 static void remove_clone(int char_id);
-static int getitemdata_from_sql(struct item* items, int max, int guid, enum inventory_table_type table);
+static void remove_clone_sub(struct trade_clone* tc, bool save_removal);
+static void account_attach(struct trade_clone* tc);
+static void account_detach(struct trade_clone* tc);
+static void remove_account_clones(int account_id);
+static bool chrif_idbanned_pre(int* fd);
+static void stub_drop(struct at_stub* stub);
+static void stub_spawn(StringBuf* filter, int workers);
+static void stub_spawn_map(int16 m);
+static void stub_spawn_char(int char_id);
+static void stub_spawn_account(int account_id);
+static void stub_spawn_item(enum trade_type type, int nameid);
+static void stub_spawn_search(enum trade_type type, const struct s_search_store_search* s);
+static void stub_spawn_all(void);
+static int stub_items_take(enum trade_type type, int nameid, StringBuf* filter, int count);
+static bool stub_items_load(void);
+static void stub_items_final(void);
+static int map_addblock_post(int retVal, struct block_list* bl);
+static int getitemdata_from_sql(struct Sql* sql_handle, struct item* items, int max, int guid, enum inventory_table_type table);
+static int memitemdata_to_sql(struct Sql* sql_handle, const struct item* p_items, int current_size, int guid, enum inventory_table_type table, int* db_rows);
+static bool itemdata_apply_sql(struct at_persist_stmts* stmts, struct at_persist_items* pi, int max, int guid, enum at_table table);
+static bool itemdata_reconcile_sql(struct Sql* sql_handle, struct at_persist_items* pi, int max, int guid, enum inventory_table_type table);
+static void item_columns(StringBuf* buf, const char* alias, bool has_favorite);
+static bool item_bindcolumns(struct SqlStmt* stmt, int offset, struct item* item, bool has_favorite);
+static bool item_bindparams(struct SqlStmt* stmt, int offset, struct item* item, bool has_favorite);
+static void item_value_columns(StringBuf* buf, bool has_favorite);
+static void item_values(StringBuf* buf, const struct item* it, bool has_favorite);
+static bool item_same(const struct item* a, const struct item* b);
 #if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
-static int memitemdata_to_sql(const struct item* p_items, int current_size, int guid, enum inventory_table_type table);
+static const char* load_table(const struct at_load* load);
+static struct at_load_entry* load_entry(struct at_load* load, int char_id);
+static bool load_merchants(struct Sql* sql_handle, struct at_load* load);
+static bool load_characters(struct Sql* sql_handle, struct at_load* load);
+static bool load_statuses(struct Sql* sql_handle, struct at_load* load);
+static bool load_carts(struct Sql* sql_handle, struct at_load* load);
+static bool load_inventories(struct Sql* sql_handle, struct at_load* load);
+static bool load_vendings(struct Sql* sql_handle, struct at_load* load);
+static bool load_buyings(struct Sql* sql_handle, struct at_load* load);
+static bool load_build(struct Sql* sql_handle, struct at_load* load);
+static void load_run(struct Sql* sql_handle, struct at_load* load);
+static void load_free(struct at_load* load);
+#if AT_LOAD_WORKERS > 0
+static void* load_worker(void* param);
+#endif
+static int load_spawn(const char* filter, int workers, int64 elapsed, bool report, bool progressive);
+static void spawn_queue_start(struct at_load* loads, int load_count, int count);
+static bool spawn_queue_entry(struct at_load_entry* e);
+static void spawn_queue_drop(struct at_load_entry* e);
+static void spawn_queue_char(int char_id);
+static void spawn_queue_account(int account_id);
+static int64 spawn_queue_eta(void);
+static void spawn_queue_final(void);
+static int spawn_timer(int tid, int64 tick, int id, intptr_t data);
 static void pc_autotrade_load_pre(void);
-static void autotrade_clone(struct trade_clone* tc);
-static void autotrade_populate(struct trade_clone* tc);
+static bool stub_load(void);
+#ifdef AT_SNAPSHOT_FILE
+static bool snapshot_write_data(FILE* fp, uint64* hash, uint64* size, const void* data, size_t len);
+static void snapshot_write(void);
+static bool snapshot_check(const uint8* data, size_t size);
+static bool snapshot_fresh(const struct at_snapshot_header* header);
+static int snapshot_spawn(const uint8* data);
+static bool snapshot_load(void);
+#endif
+static struct trade_clone* autotrade_build(const struct at_load_entry* e);
+static bool autotrade_clone(struct at_load_entry* e);
+static void autotrade_populate(struct trade_clone* tc, const struct at_load_entry* e);
 #endif
 static int char_getgender(char sex, char sex2);
-static void save_zeny(struct trade_clone* tc);
-static void save_timeout(struct trade_clone* tc, bool remove);
+static uint64 at_checksum(uint64 hash, const void* data, size_t len);
+#ifdef AT_JOURNAL_FILE
+static bool journal_open(void);
+static void journal_touch(struct trade_clone* tc, unsigned int flags);
+static bool journal_close(struct trade_clone* tc);
+static void journal_record(struct trade_clone* tc, enum at_journal_type type, int table);
+static void journal_append(struct at_journal_record* rec);
+static void journal_release(int char_id, int account_id);
+static void journal_checkpoint_name(char* out, size_t size, int gen);
+static void journal_checkpoint_remove(void);
+static void journal_fsync(int fd, bool owned);
+static void journal_request_sync(void);
+static void* journal_syncer(void* param);
+static void journal_sync(void);
+static int journal_sync_timer(int tid, int64 tick, int id, intptr_t data);
+static void journal_saves(void);
+static int journal_checkpoint_timer(int tid, int64 tick, int id, intptr_t data);
+static void journal_checkpoint_done(void);
+static bool journal_read(const char* file, struct DBMap* states);
+static void journal_replay(void);
+static void journal_init(void);
+static void journal_final(void);
+static void persist_push_checkpoint(void);
+#endif
+static struct at_payload* clone_payload(struct trade_clone* tc);
+static void clone_wake(struct trade_clone* tc);
+#ifdef AT_HIBERNATE_FILE
+static int64 at_usec(void);
+static bool hibernate_seek(int slot);
+static bool hibernate_clone(struct trade_clone* tc);
+static void hibernate_fault(struct trade_clone* tc);
+static void hibernate_release(struct trade_clone* tc);
+static int hibernate_timer(int tid, int64 tick, int id, intptr_t data);
+static void hibernate_prefetch(struct trade_clone* tc);
+static int hibernate_prefetch_sub(struct block_list* bl, va_list ap);
+static int hibernate_prefetch_timer(int tid, int64 tick, int id, intptr_t data);
+static void hibernate_init(void);
+static void hibernate_final(void);
+#endif
+#ifdef AT_SALES_RING
+static void sales_scan_begin(struct map_session_data* vsd, struct map_session_data* other, enum trade_type type);
+static void sales_scan_end(void);
+static int sales_left(struct trade_clone* tc, enum trade_type type, int key);
+static void sales_record(const struct at_sale_scan* scan, const struct at_sale_entry* e, int amount);
+static int sales_flush_timer(int tid, int64 tick, int id, intptr_t data);
+static int sales_compare(const void* a, const void* b);
+static int market_item_compare(const void* a, const void* b);
+static bool persist_write_sales(struct Sql* sql_handle, const struct at_persist_sales* batch);
+static void persist_push_sales(struct at_persist_sales* batch);
+static void vending_purchasereq_pre(struct map_session_data** sd, int* aid, unsigned int* uid, const uint8** data, int* count);
+static void vending_purchasereq_post(struct map_session_data* sd, int aid, unsigned int uid, const uint8* data, int count);
+static void buyingstore_trade_pre(struct map_session_data** sd, int* account_id, unsigned int* buyer_id, const uint8** itemlist, unsigned int* count);
+static void buyingstore_trade_post(struct map_session_data* sd, int account_id, unsigned int buyer_id, const uint8* itemlist, unsigned int count);
+#endif
+static bool save_zeny(struct at_persist_stmts* stmts, const struct at_persist* p);
+static bool delete_timeout(struct at_persist_stmts* stmts, const struct at_persist* p);
+static bool save_buyer(struct at_persist_stmts* stmts, const struct at_persist* p);
+static bool delete_buyer(struct at_persist_stmts* stmts, int char_id);
+static bool persist_write_batch(struct Sql* sql_handle, const struct at_persist_batch* batch);
+static void persist_push_batch(struct at_persist_batch* batch);
+static void persist_free(struct at_persist* p);
+static void sched_init(void);
+static void sched_add(struct trade_clone* tc, int64 expire);
+static void sched_remove(struct trade_clone* tc);
+static void sched_save(int64 tick);
+static int sched_timer(int tid, int64 tick, int id, intptr_t data);
+static struct Sql* at_sql_connect(void);
+static struct SqlStmt* persist_stmt(struct Sql* sql_handle, const char* query);
+static bool persist_prepare(struct Sql* sql_handle, struct at_persist_stmts* stmts);
+static void persist_unprepare(struct at_persist_stmts* stmts);
+static void persist_init(void);
+static void persist_final(void);
+static void persist_push(struct trade_clone* tc, unsigned int flags);
+static void persist_items(struct trade_clone* tc, struct at_persist* p, enum at_table table);
+static bool persist_item_op(struct at_item_state* state, struct at_persist_items* pi, const struct item* it, int i);
+static void persist_dirty(struct map_session_data* sd, enum at_table table, int n);
+static struct at_item_state* item_state_create(const struct item* items, int max, bool known);
+static void item_state_free(struct trade_clone* tc);
+static void persist_enqueue(struct at_persist* p);
+static struct at_persist* persist_pop(void);
+static int persist_pop_group(struct at_persist** group);
+static void persist_done(struct at_persist* p);
+static void persist_write(struct Sql* sql_handle, struct at_persist* p);
+static void persist_write_group(struct Sql* sql_handle, struct at_persist** group, int count);
+static void persist_commit(struct Sql* sql_handle, struct at_persist** group, int count);
+static bool persist_write_items(struct Sql* sql_handle, struct at_persist_items* pi, enum at_table table, int guid);
+static void persist_collect_items(struct trade_clone* tc, struct at_persist* p, enum at_table table);
+static void persist_collect(void);
+static int persist_timer(int tid, int64 tick, int id, intptr_t data);
+#ifdef AT_PERSIST_THREAD
+static void* persist_worker(void* param);
+#endif
 static int char_delete_char_sql_post(int result, int char_id);
 static void parse_delete_char_packet(int fd);
 static int battle_check_target_post(int retval, struct block_list* src, struct block_list* target, int flag);
-static int timeout_timer(int tid, int64 tick, int id, intptr_t data);
 static int map_quit_timer(int tid, int64 tick, int id, intptr_t data);
+static void handoff_start(struct trade_clone* tc);
+static void handoff_quit(struct trade_clone* tc, struct map_session_data* sd);
+static void handoff_end(struct trade_clone* tc);
+static unsigned int handoff_clear(struct trade_clone* tc);
+static int handoff_timer(int tid, int64 tick, int id, intptr_t data);
+static void clif_charselectok_post(int id, uint8 ok);
+static bool chrif_auth_delete_post(bool retVal, int account_id, int char_id, enum sd_state state);
+static void parse_handoff_packet(int fd);
+static int chr_mmo_char_tosql_pre(int* char_id, struct mmo_charstatus** p);
+static int chr_mmo_char_fromsql_pre(int* char_id, struct mmo_charstatus** p, bool* load_everything);
+static int pc_cart_additem_post(int retVal, struct map_session_data* sd, struct item* item_data, int amount, enum e_log_pick_type log_type);
+static int pc_cart_delitem_post(int retVal, struct map_session_data* sd, int n, int amount, int type, enum e_log_pick_type log_type);
+static int pc_additem_post(int retVal, struct map_session_data* sd, const struct item* item_data, int amount, enum e_log_pick_type log_type);
+static int pc_delitem_post(int retVal, struct map_session_data* sd, int n, int amount, int type, enum delitem_reason reason, enum e_log_pick_type log_type);
+#ifdef AT_JOURNAL_FILE
+static int pc_getzeny_post(int retVal, struct map_session_data* sd, int zeny, enum e_log_pick_type type, struct map_session_data* tsd);
+static int pc_payzeny_post(int retVal, struct map_session_data* sd, int zeny, enum e_log_pick_type type, struct map_session_data* tsd);
+#endif
 // ====================================
 
+/**
+ * Builds the free list of clone classes, skipping the ones in use by the server
+ */
+static void clone_class_refill(void)
+{
+	clone_classes.count = 0;
+	for (int class_ = MOB_CLONE_END - 1; class_ >= MOB_CLONE_START; class_--) {
+		if (mob->db_data[class_] == NULL)
+			clone_classes.free[clone_classes.count++] = class_;
+	}
+}
+
+/**
+ * Takes a free clone class and assigns it a pooled mob_db entry.
+ * Returns the class or -1 if the clone range is exhausted.
+ */
+static int clone_class_alloc(struct mob_db** out)
+{
+	int class_ = -1;
+
+	while (class_ == -1) {
+		if (clone_classes.count == 0) {
+			clone_class_refill();
+			if (clone_classes.count == 0)
+				return -1;
+		}
+
+		class_ = clone_classes.free[--clone_classes.count];
+		if (mob->db_data[class_] != NULL) // Taken by a server clone (@clone, Shadow Form...), drop it
+			class_ = -1;
+	}
+
+	struct mob_db* mdb = ers_alloc(clone_classes.db_ers, struct mob_db);
+	memset(mdb, 0, sizeof(struct mob_db));
+	mob->db_data[class_] = mdb;
+	clone_classes.owned[class_ - MOB_CLONE_START] = true;
+
+	*out = mdb;
+	return class_;
+}
+
+/**
+ * Returns a clone class to the free list and its mob_db entry to the pool
+ */
+static void clone_class_free(int class_)
+{
+	if (class_ < MOB_CLONE_START || class_ >= MOB_CLONE_END || !clone_classes.owned[class_ - MOB_CLONE_START])
+		return;
+
+	ers_free(clone_classes.db_ers, mob->db_data[class_]);
+	mob->db_data[class_] = NULL;
+	clone_classes.owned[class_ - MOB_CLONE_START] = false;
+	clone_classes.free[clone_classes.count++] = class_;
+}
+
+/**
+ * mob->clone_delete prehook
+ *
+ * Trade clones' mob_db entries belong to the pool, release them there instead of freeing them
+ */
+static int mob_clone_delete_pre(struct mob_data** md)
+{
+	int class_ = (*md)->class_;
+
+	if (class_ < MOB_CLONE_START || class_ >= MOB_CLONE_END || !clone_classes.owned[class_ - MOB_CLONE_START])
+		return 0;
+
+	hookStop();
+	clone_class_free(class_);
+	clone_id_set((*md)->bl.id, false);
+
+	// Clear references to the db
+	(*md)->db = mob->dummy;
+	(*md)->vd = NULL;
+	return 1;
+}
+
 /**
  * Creates a clone of the current user as well as its cart, inventory, vending and buying shop items
  */
 static int at_clone_spawn_vending(struct map_session_data* sd)
 {
-	int class_;
+	struct mob_db* mdb;
 	int16 m = sd->bl.m;
 	int16 x = sd->bl.x;
 	int16 y = sd->bl.y;
 
-	ARR_FIND(MOB_CLONE_START, MOB_CLONE_END, class_, mob->db_data[class_] == NULL);
-	if (class_ >= MOB_CLONE_END)
+	int class_ = clone_class_alloc(&mdb);
+	if (class_ < 0)
 		return 0;
 
 	// Copy name, looks, lv, etc
-	struct mob_db* mdb = mob->db_data[class_] = (struct mob_db*)aCalloc(1, sizeof(struct mob_db));
 	struct status_data* mstatus = &mdb->status;
 
 	safestrncpy(mdb->sprite, sd->status.name, NAME_LENGTH);
@@ -146,8 +1164,10 @@ static int at_clone_spawn_vending(struct map_session_data* sd)
 
 	// Create monster
 	struct mob_data* md = mob->once_spawn_sub(&sd->bl, m, x, y, sd->status.name, class_, "", SZ_SMALL, AI_NONE, 0);
-	if (md == NULL)
+	if (md == NULL) {
+		clone_class_free(class_);
 		return 0;
+	}
 
 	md->special_state.clone = 1;
 	mob->spawn(md);
@@ -163,64 +1183,72 @@ static int at_clone_spawn_vending(struct map_session_data* sd)
 	struct trade_clone* tc;
 	CREATE(tc, struct trade_clone, 1);
 	tc->md = md;
-
-	memcpy(&tc->sd.bl, &md->bl, sizeof(struct block_list));
+	tc->release_timer = INVALID_TIMER;
 
 	tc->type = sd->state.vending == 1 ? TD_VC : TD_BC;
-	tc->sd.status.zeny = sd->status.zeny;
-	tc->sd.status.char_id = sd->status.char_id;
-	tc->sd.status.account_id = sd->status.account_id;
-	tc->sd.status.sex = sd->status.sex;
-	tc->sd.weight = sd->weight;
-	tc->sd.max_weight = sd->max_weight;
-	tc->sd.vend_num = sd->vend_num;
-	tc->sd.vender_id = sd->vender_id;
-	tc->sd.buyer_id = sd->buyer_id;
-	tc->sd.buyingstore.slots = sd->buyingstore.slots;
-	tc->sd.buyingstore.zenylimit = sd->buyingstore.zenylimit;
-	tc->sd.state.vending = sd->state.vending;
-	tc->sd.state.buyingstore = sd->state.buyingstore;
-	tc->sd.state.autotrade = 1;
-	tc->sd.status.inventorySize = sd->status.inventorySize;
-	pc->set_group(&tc->sd, sd->group_id);
-
-	safestrncpy(tc->sd.message, sd->message, MESSAGE_SIZE);
+	tc->zeny = sd->status.zeny;
+	tc->char_id = sd->status.char_id;
+	tc->account_id = sd->status.account_id;
+	tc->sex = sd->status.sex;
+	tc->weight = sd->weight;
+	tc->max_weight = sd->max_weight;
+	tc->cart_weight = sd->cart_weight;
+	tc->cart_num = sd->cart_num;
+	tc->vender_id = sd->vender_id;
+	tc->buyer_id = sd->buyer_id;
+	tc->inventory_size = sd->status.inventorySize;
+	tc->group_id = sd->group_id;
+
+	safestrncpy(tc->message, sd->message, MESSAGE_SIZE);
 
 	if (sd->sc.data[SC_PUSH_CART])
 		tc->options.pushcart = sd->sc.data[SC_PUSH_CART]->val1;
 
 	if (sd->sc.data[SC_AUTOTRADE]) {
-		int64 tick = timer->gettick();
 		tc->options.time = sd->sc.data[SC_AUTOTRADE]->total_tick;
-		tc->options.quit_timer = timer->add(tick + tc->options.time, timeout_timer, md->bl.id, 1);
-		tc->options.save_timer = INVALID_TIMER;
-		if (tc->options.time > map->autosave_interval)
-			tc->options.save_timer = timer->add_interval(tick + map->autosave_interval, timeout_timer, md->bl.id, 0, map->autosave_interval);
+		sched_add(tc, timer->gettick() + tc->options.time);
 	}
 
-	// Vending, buying, inventory and cart data
-	memcpy(&tc->sd.vending, &sd->vending, sizeof(struct s_vending[MAX_VENDING]));
-	memcpy(&tc->sd.buyingstore.items, sd->buyingstore.items, (sizeof(struct s_buyingstore_item[MAX_BUYINGSTORE_SLOTS])));
-	memcpy(&tc->sd.status.inventory, &sd->status.inventory, sizeof(struct item[MAX_INVENTORY]));
-	memcpy(&tc->sd.status.cart, &sd->status.cart, sizeof(struct item[MAX_CART]));
-
-	int trade_id = tc->type == TD_VC ? tc->sd.vender_id : tc->sd.buyer_id;
+	// Vending, buying and cart data. Inventory is only read by buying stores.
+	struct at_payload* payload = tc->payload = clone_payload_create(tc->type);
+	payload->vend_num = sd->vend_num;
+	memcpy(payload->vending, sd->vending, sizeof(payload->vending));
+	memcpy(&payload->buyingstore, &sd->buyingstore, sizeof(payload->buyingstore));
+	memcpy(payload->cart, sd->status.cart, sizeof(payload->cart));
+	if (payload->inventory != NULL)
+		memcpy(payload->inventory, sd->status.inventory, sizeof(struct item[MAX_INVENTORY]));
+
+	// Rows of the player's items are unknown until the first save reconciles them
+	tc->persist_gen = ++persist.gen;
+	tc->items[AT_TABLE_CART] = item_state_create(NULL, MAX_CART, false);
+	if (tc->type == TD_BC)
+		tc->items[AT_TABLE_INVENTORY] = item_state_create(NULL, MAX_INVENTORY, false);
+
+	// Clones are searched through the search proxy, the leaving character's shop is gone
+	int trade_id = tc->type == TD_VC ? tc->vender_id : tc->buyer_id;
 	if (sd->state.vending == 1) {
 		idb_put(vender_db, trade_id, tc); // Vender id to TC
-		idb_put(vending->db, sd->status.char_id, &tc->sd); // Char id to TC (vending)
+		idb_remove(vending->db, sd->status.char_id);
 	} else {
 		idb_put(buyer_db, trade_id, tc);
 #ifdef HERACLES_VERSION
-		idb_put(buyingstore->db, sd->status.char_id, &tc->sd);
+		idb_remove(buyingstore->db, sd->status.char_id);
 #endif
 	}
 
 	idb_put(clone_db, sd->status.char_id, tc); // Char id to TC (autotraders only)
+	account_attach(tc);
+	clone_index(tc);
 
-	if (tc->sd.state.vending == 1)
-		pc->autotrade_update(&tc->sd, PAUC_START);
+	if (tc->type == TD_VC)
+		pc->autotrade_update(clone_sd(tc, true), PAUC_START);
+#if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
+	else
+		persist_push(tc, AT_PERSIST_BUYER);
+#endif
 
 	addToMOBDATA(md, tc, 0, true);
+	clone_id_set(md->bl.id, true);
 
 	sd->state.vending = 0; // Remove flag in original sd so the clone doesn't get removed from vending
 	sd->state.buyingstore = 0; // Same with buying store
@@ -234,7 +1262,7 @@ static int at_clone_spawn_vending(struct map_session_data* sd)
 static int status_damage_pre(struct block_list** src, struct block_list** target, int64* in_hp, int64* in_sp, int* walkdelay, int* flag)
 {
 	struct block_list* tgt = *target;
-	if (tgt->type != BL_MOB)
+	if (tgt->type != BL_MOB || !clone_id_test(tgt->id))
 		return 0;
 
 	struct trade_clone* td = getFromMOBDATA((struct mob_data*)tgt, 0);
@@ -252,842 +1280,5961 @@ static int status_damage_pre(struct block_list** src, struct block_list** target
  */
 static void clif_getareachar_unit_post(struct map_session_data* sd, struct block_list* bl)
 {
-	if (bl->type != BL_MOB)
+	if (bl->type != BL_MOB || !clone_id_test(bl->id))
 		return;
 
 	struct trade_clone* td = getFromMOBDATA((struct mob_data*)bl, 0);
 	if (td == NULL)
 		return;
 
-	if (td->options.pushcart)
-		clif->sc_load(&sd->bl, bl->id, SELF, status->get_sc_icon(SC_ON_PUSH_CART), td->options.pushcart, 0, 0);
+	clone_wake(td); // Likely to be opened
+
+	int fd = sd->fd;
+	if (!sockt->session_is_active(fd) || sockt->session[fd]->session_data != sd) {
+		if (td->options.pushcart)
+			clif->sc_load(&sd->bl, bl->id, SELF, status->get_sc_icon(SC_ON_PUSH_CART), td->options.pushcart, 0, 0);
+
+		if (td->type == TD_VC)
+			clif->showvendingboard(bl, td->message, fd);
+		else if (td->type == TD_BC)
+			clif->buyingstore_entry_single(bl, td->message, fd);
+		return;
+	}
+
+	// First view of the clone: serialize its packets once and keep the bytes
+	if (td->options.pushcart) {
+		if (td->cart_packet == NULL)
+			packet_build_cart(td, bl->id);
+		packet_queue(sd, td->cart_packet, td->cart_len);
+	}
 
-	if (td->type == TD_VC)
-		clif->showvendingboard(bl, td->sd.message, sd->fd);
-	else if (td->type == TD_BC)
-		clif->buyingstore_entry_single(bl, td->sd.message, sd->fd);
+	if (td->board_packet == NULL)
+		packet_build_board(td, bl->id);
+	packet_queue(sd, td->board_packet, td->board_len);
 }
 
 /**
- * map->id2sd posthook
- *
- * Converts mob_data id into a corresponding map_session_data if it's a clone
+ * Drops the cached packets of a clone, to be rebuilt on its next view
  */
-static struct map_session_data* map_id2sd_post(struct map_session_data* retval, int id)
+static void clone_packets_invalidate(struct trade_clone* tc)
 {
-	if (retval != NULL)
-		return retval;
-
-	struct trade_clone* tc = id2tc(id);
-
-	return tc != NULL ? &tc->sd : NULL;
+	if (tc->board_packet != NULL)
+		aFree(tc->board_packet);
+	tc->board_packet = NULL;
+	tc->board_len = 0;
+	if (tc->cart_packet != NULL)
+		aFree(tc->cart_packet);
+	tc->cart_packet = NULL;
+	tc->cart_len = 0;
 }
 
 /**
- * chrif->save prehook
- *
- * Skip saving clones' data
+ * Serializes the push cart status of a clone into its cache, as clif->sc_load would send it
  */
-static bool chrif_save_pre(struct map_session_data** sd, int* flag)
+static void packet_build_cart(struct trade_clone* tc, int id)
 {
-	struct trade_clone* tc = idb_get(clone_db, (*sd)->status.char_id);
+	struct packet_status_change p;
+	int icon = status->get_sc_icon(SC_ON_PUSH_CART);
 
-	if (tc == NULL || tc->sd.bl.id != (*sd)->bl.id) // Real SD being saved
-		return true;
+	if (icon == SI_BLANK)
+		return;
 
-	hookStop();
-	save(tc);
+	memset(&p, 0, sizeof(p));
+	p.PacketType = status_changeType;
+	p.index = icon;
+	p.AID = id;
+	p.state = 1;
+#if PACKETVER >= 20120618
+	p.Total = -1; // Permanent
+#endif
+#if PACKETVER >= 20090121
+	p.Left = -1;
+	p.val1 = tc->options.pushcart;
+#endif
 
-	return true;
+	tc->cart_len = (int)sizeof(p);
+	tc->cart_packet = aMalloc(tc->cart_len);
+	memcpy(tc->cart_packet, &p, tc->cart_len);
+	packet_stats.built++;
 }
 
 /**
- * Quickly convert a mob id into the corresponding clone
+ * Serializes the vending board (0x131) or buying store board (0x814) of a clone into its cache
  */
-static struct trade_clone* id2tc(int id)
+static void packet_build_board(struct trade_clone* tc, int id)
 {
-	struct mob_data* md;
-	if ((md = map->id2md(id)) != NULL)
-		return getFromMOBDATA(md, 0);
-	else
-		return NULL;
+	uint8* buf;
+
+	if (tc->type != TD_VC && tc->type != TD_BC)
+		return;
+
+	tc->board_len = 6 + MESSAGE_SIZE;
+	buf = tc->board_packet = aCalloc(1, tc->board_len);
+	WBUFW(buf, 0) = tc->type == TD_VC ? 0x131 : 0x814;
+	WBUFL(buf, 2) = id;
+	safestrncpy((char*)WBUFP(buf, 6), tc->message, MESSAGE_SIZE);
+	packet_stats.built++;
 }
 
 /**
- * Saves clone inventory data of a character into database
+ * Queues a cached packet for a client, flushed once the current view refresh is over
  */
-static void save(struct trade_clone* tc)
+static void packet_queue(struct map_session_data* sd, const uint8* packet, int len)
 {
-	struct map_session_data* sd = &tc->sd;
-	if (tc->type == TD_BC) // Don't attempt for vending, inventory is not recovered in persistence mode
-		memitemdata_to_sql(sd->status.inventory, -1, sd->status.char_id, TABLE_INVENTORY);
-	memitemdata_to_sql(sd->status.cart, -1, sd->status.char_id, TABLE_CART);
-	save_zeny(tc);
+	struct at_coalesce* queue;
+
+	if (packet == NULL)
+		return;
+
+	if ((queue = getFromMSD(sd, 0)) == NULL) {
+		CREATE(queue, struct at_coalesce, 1);
+		queue->timer = INVALID_TIMER;
+		addToMSD(sd, queue, 0, true);
+	}
+
+	if (queue->len + len > AT_COALESCE_SIZE)
+		packet_flush(sd, queue);
+
+	memcpy(queue->data + queue->len, packet, len);
+	queue->len += len;
+	packet_stats.queued++;
+
+	if (queue->timer == INVALID_TIMER)
+		queue->timer = timer->add(timer->gettick(), packet_flush_timer, sd->bl.id, 0);
 }
 
 /**
- * Saves clone's zeny into database
+ * Sends the queued packets of a client in a single write
  */
-static void save_zeny(struct trade_clone* tc)
+static void packet_flush(struct map_session_data* sd, struct at_coalesce* queue)
 {
-	if (SQL_ERROR == SQL->Query(map->mysql_handle, "UPDATE `%s` SET `zeny`='%d'"
-		" WHERE `account_id`='%d' AND `char_id` = '%d'",
-		character_db, tc->sd.status.zeny, tc->sd.status.account_id, tc->sd.status.char_id))
-	{
-		Sql_ShowDebug(map->mysql_handle);
+	int fd = sd->fd;
+
+	if (queue->len > 0 && sockt->session_is_active(fd)) {
+		WFIFOHEAD(fd, queue->len);
+		memcpy(WFIFOP(fd, 0), queue->data, queue->len);
+#ifdef WFIFOSET2
+		WFIFOSET2(fd, queue->len); // Several packets, the length check only applies to single ones
+#else
+		WFIFOSET(fd, queue->len);
+#endif
+		packet_stats.writes++;
 	}
+
+	queue->len = 0;
 }
 
 /**
- * Saves clone's timeout into database
+ * Flushes a client's queue after the view refresh that filled it
  */
-static void save_timeout(struct trade_clone* tc, bool remove)
+static int packet_flush_timer(int tid, int64 tick, int id, intptr_t data)
 {
-	if (remove) {
-		if (SQL_ERROR == SQL->Query(map->mysql_handle, "DELETE FROM `%s` WHERE `account_id`='%d' AND `char_id` = '%d' AND `type` = '%d'",
-			sc_data_db, tc->sd.status.account_id, tc->sd.status.char_id, SC_AUTOTRADE))
-		{
-			Sql_ShowDebug(map->mysql_handle);
-		}
-	} else {
-		if (SQL_ERROR == SQL->Query(map->mysql_handle, "UPDATE `%s` SET `tick`='%d'"
-			" WHERE `account_id`='%d' AND `char_id` = '%d' AND `type` = '%d'",
-			sc_data_db, tc->options.time, tc->sd.status.account_id, tc->sd.status.char_id, SC_AUTOTRADE))
-		{
-			Sql_ShowDebug(map->mysql_handle);
-		}
-	}
+	struct map_session_data* sd = map->id2sd(id);
+	struct at_coalesce* queue;
+
+	if (sd == NULL || (queue = getFromMSD(sd, 0)) == NULL || queue->timer != tid)
+		return 0;
+
+	queue->timer = INVALID_TIMER;
+	packet_flush(sd, queue);
+
+	return 0;
 }
 
 /**
- * map->quit prehook
+ * map->id2sd posthook
  *
- * Skip quitting clone characters
+ * Converts mob_data id into a corresponding map_session_data if it's a clone
  */
-static int map_quit_pre(struct map_session_data** sd)
+static struct map_session_data* map_id2sd_post(struct map_session_data* retval, int id)
 {
-	if (sd == NULL)
-		return 0;
+	if (retval != NULL)
+		return retval;
+
+	struct trade_clone* tc = id2tc(id);
+
+	return tc != NULL ? clone_sd(tc, true) : NULL;
+}
 
+/**
+ * chrif->save prehook
+ *
+ * Skip saving clones' data
+ */
+static bool chrif_save_pre(struct map_session_data** sd, int* flag)
+{
 	struct trade_clone* tc = idb_get(clone_db, (*sd)->status.char_id);
-	if (tc == NULL || tc->sd.bl.id != (*sd)->bl.id) // Real SD going out
-		return 0;
+
+	if (tc == NULL || tc->sd != *sd) // Real SD being saved
+		return true;
 
 	hookStop();
-	remove_clone(tc->sd.status.char_id);
+#ifdef AT_JOURNAL_FILE
+	if (journal.fp != NULL) { // Already journaled, saved on the next checkpoint
+		journal_touch(tc, AT_JOURNAL_TABLE(AT_TABLE_CART) | AT_JOURNAL_TABLE(AT_TABLE_INVENTORY) | AT_JOURNAL_ZENY_FLAG);
+		return true;
+	}
+#endif
+	save(tc);
 
-	return 0;
+	return true;
 }
 
 /**
- * clif->authok posthook
- *
- * Removes clones when a matching char_id is selected
+ * Quickly convert a mob id into the corresponding clone
  */
-static void clif_authok_post(struct map_session_data* sd)
+static struct trade_clone* id2tc(int id)
 {
-	if (sd == NULL)
-		return;
-
-	remove_clone(sd->status.char_id);
+	struct mob_data* md;
+	if (clone_id_test(id) && (md = map->id2md(id)) != NULL)
+		return getFromMOBDATA(md, 0);
+	else
+		return NULL;
 }
 
 /**
- * Closes boards and removes clone from server
+ * Flags a block id as a clone mob or clears it
  */
-static void remove_clone(int char_id)
+static void clone_id_set(int id, bool clone)
 {
-	struct trade_clone* tc = idb_get(clone_db, char_id);
-	if (tc == NULL)
+	unsigned int bit = (unsigned int)(id - START_NPC_NUM);
+
+	if (id < START_NPC_NUM)
 		return;
 
-	struct mob_data* md = tc->md;
-	if (tc->type == TD_VC) {
-			clif->closevendingboard(&md->bl, 0);
-		pc->autotrade_update(&tc->sd, PAUC_REMOVE);
-		idb_remove(vending->db, char_id);
-		idb_remove(vender_db, tc->sd.vender_id);
-	} else {
-			clif->buyingstore_disappear_entry(&tc->md->bl);
-#ifdef HERACLES_VERSION
-		idb_remove(buyingstore->db, char_id);
-#endif
-		idb_remove(buyer_db, tc->sd.buyer_id);
-	}
+	if (bit / 32 >= (unsigned int)clone_ids.words) {
+		if (!clone) // Never set
+			return;
 
-	if (battle->bc->at_timeout) {
-		if (tc->options.quit_timer != INVALID_TIMER) {
-			timer->delete(tc->options.quit_timer, timeout_timer);
-		}
-		if (tc->options.save_timer != INVALID_TIMER) {
-			timer->delete(tc->options.save_timer, timeout_timer);
-		}
+		int words = max(clone_ids.words * 2, 1024);
+		while ((unsigned int)words <= bit / 32)
+			words *= 2;
+		RECREATE(clone_ids.bits, uint32, words);
+		memset(clone_ids.bits + clone_ids.words, 0, sizeof(uint32) * (words - clone_ids.words));
+		clone_ids.words = words;
 	}
 
-	save_timeout(tc, true);
-	idb_remove(clone_db, char_id);
-	unit->free(&md->bl, CLR_OUTSIGHT);
+	if (clone)
+		clone_ids.bits[bit / 32] |= 1U << (bit % 32);
+	else
+		clone_ids.bits[bit / 32] &= ~(1U << (bit % 32));
 }
 
 /**
- * Clif->search_store_info_ack prehook
- *
- * Replaces ids from account_id to the mob data id of trade clones
+ * Whether a block id may be a clone mob. Ids of other units are rejected without any lookup.
  */
-static void clif_searchstoreinfo_pre(struct map_session_data** _sd)
+static inline bool clone_id_test(int id)
 {
-	struct map_session_data* sd = *_sd;
-	struct trade_clone* tc;
-
-	for (int i = 0; i < sd->searchstore.count; i++) {
-		int store_id = sd->searchstore.items[i].store_id;
-		if (sd->searchstore.type == SEARCHTYPE_VENDING)
-			tc = idb_get(vender_db, store_id);
-		else
-			tc = idb_get(buyer_db, store_id);
+	unsigned int bit = (unsigned int)(id - START_NPC_NUM);
 
-		if (tc != NULL)
-			sd->searchstore.items[i].account_id = tc->md->bl.id;
-	}
+	return id >= START_NPC_NUM && bit / 32 < (unsigned int)clone_ids.words
+		&& (clone_ids.bits[bit / 32] & (1U << (bit % 32))) != 0;
 }
 
 /**
- * Retrieves item data from database
+ * Gets the clone owning a session data, if any
  */
-static int getitemdata_from_sql(struct item* items, int max, int guid, enum inventory_table_type table)
+static struct trade_clone* sd2tc(struct map_session_data* sd)
 {
-	int i = 0;
-	struct SqlStmt* stmt = NULL;
-	const char* tablename = NULL;
-	const char* selectoption = NULL;
-	bool has_favorite = false;
-	StringBuf buf;
-	struct item item = { 0 }; // temp storage variable
+	if (sd == NULL || !sd->state.autotrade)
+		return NULL;
 
-	if (max > 0)
-		nullpo_retr(-1, items);
-	Assert_retr(-1, guid > 0);
+	struct trade_clone* tc = idb_get(clone_db, sd->status.char_id);
+	return tc != NULL && tc->sd == sd ? tc : NULL;
+}
 
-	// Initialize the array.
-	if (max > 0)
-		memset(items, 0x0, sizeof(struct item) * max);
+/**
+ * Allocates the shop items of a clone
+ */
+static struct at_payload* clone_payload_create(enum trade_type type)
+{
+	struct at_payload* payload;
+	CREATE(payload, struct at_payload, 1);
 
-	switch (table) {
-	case TABLE_INVENTORY:
-		tablename = inventory_db;
-		selectoption = "char_id";
-		has_favorite = true;
-		break;
-	case TABLE_CART:
-		tablename = cart_db;
-		selectoption = "char_id";
-		break;
-	case TABLE_GUILD_STORAGE:
-	case TABLE_STORAGE:
-	default:
-		ShowError("char_getitemdata_from_sql: Invalid table type %d!\n", (int)table);
-		Assert_retr(-1, table);
-		return -1;
-	}
+	if (type == TD_BC)
+		CREATE(payload->inventory, struct item, MAX_INVENTORY);
 
-	StrBuf->Init(&buf);
-	StrBuf->AppendStr(&buf, "SELECT `id`, `nameid`, `amount`, `equip`, `identify`, `refine`, `grade`, `attribute`, `expire_time`, `bound`, `unique_id`");
-	for (i = 0; i < MAX_SLOTS; i++)
-		StrBuf->Printf(&buf, ", `card%d`", i);
-	for (i = 0; i < MAX_ITEM_OPTIONS; i++)
-		StrBuf->Printf(&buf, ", `opt_idx%d`, `opt_val%d`", i, i);
-	if (has_favorite)
-		StrBuf->AppendStr(&buf, ", `favorite`");
-	StrBuf->Printf(&buf, " FROM `%s` WHERE `%s`=?", tablename, selectoption);
+	return payload;
+}
 
-	stmt = SQL->StmtMalloc(map->mysql_handle);
-	if (SQL_ERROR == SQL->StmtPrepareStr(stmt, StrBuf->Value(&buf))
-		|| SQL_ERROR == SQL->StmtBindParam(stmt, 0, SQLDT_INT, &guid, sizeof guid)
-		|| SQL_ERROR == SQL->StmtExecute(stmt)) {
-		SqlStmt_ShowDebug(stmt);
-		SQL->StmtFree(stmt);
-		StrBuf->Destroy(&buf);
-		return -1;
+/**
+ * Materializes the map_session_data of a clone for the core.
+ * Deferred adapters are written back and released once the current tick is processed.
+ */
+static struct map_session_data* clone_sd(struct trade_clone* tc, bool deferred_release)
+{
+	struct map_session_data* sd = tc->sd;
+
+	if (sd == NULL) {
+		struct at_payload* payload = clone_payload(tc);
+
+		tc->active_tick = timer->gettick();
+
+		sd = ers_alloc(adapters.ers, struct map_session_data);
+		memset(sd, 0, sizeof(struct map_session_data));
+
+		memcpy(&sd->bl, &tc->md->bl, sizeof(struct block_list));
+		safestrncpy(sd->status.name, tc->md->name, NAME_LENGTH);
+		sd->status.char_id = tc->char_id;
+		sd->status.account_id = tc->account_id;
+		sd->status.sex = tc->sex;
+		sd->status.zeny = tc->zeny;
+		sd->status.inventorySize = tc->inventory_size;
+		sd->weight = tc->weight;
+		sd->max_weight = tc->max_weight;
+		sd->cart_weight = tc->cart_weight;
+		sd->cart_num = tc->cart_num;
+		sd->vender_id = tc->vender_id;
+		sd->buyer_id = tc->buyer_id;
+		sd->state.vending = tc->type == TD_VC;
+		sd->state.buyingstore = tc->type == TD_BC;
+		sd->state.autotrade = 1;
+		safestrncpy(sd->message, tc->message, MESSAGE_SIZE);
+
+		sd->vend_num = payload->vend_num;
+		memcpy(sd->vending, payload->vending, sizeof(payload->vending));
+		memcpy(&sd->buyingstore, &payload->buyingstore, sizeof(payload->buyingstore));
+		memcpy(sd->status.cart, payload->cart, sizeof(payload->cart));
+		if (payload->inventory != NULL)
+			memcpy(sd->status.inventory, payload->inventory, sizeof(struct item[MAX_INVENTORY]));
+
+		tc->sd = sd;
+		pc->set_group(sd, tc->group_id);
+
+		adapters.total++;
+		adapters.peak = max(adapters.peak, ++adapters.count);
 	}
 
-	if (SQL_ERROR == SQL->StmtBindColumn(stmt, 0, SQLDT_INT, &item.id, sizeof item.id, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 1, SQLDT_INT, &item.nameid, sizeof item.nameid, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 2, SQLDT_SHORT, &item.amount, sizeof item.amount, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 3, SQLDT_UINT, &item.equip, sizeof item.equip, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 4, SQLDT_CHAR, &item.identify, sizeof item.identify, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 5, SQLDT_CHAR, &item.refine, sizeof item.refine, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 6, SQLDT_CHAR, &item.grade, sizeof item.grade, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 7, SQLDT_CHAR, &item.attribute, sizeof item.attribute, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 8, SQLDT_UINT, &item.expire_time, sizeof item.expire_time, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 9, SQLDT_UCHAR, &item.bound, sizeof item.bound, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 10, SQLDT_UINT64, &item.unique_id, sizeof item.unique_id, NULL, NULL)
-		) {
-		SqlStmt_ShowDebug(stmt);
-	}
+	if (deferred_release && tc->release_timer == INVALID_TIMER)
+		tc->release_timer = timer->add(timer->gettick(), clone_release_timer, tc->md->bl.id, 0);
 
-	for (i = 0; i < MAX_SLOTS; i++) {
-		if (SQL_ERROR == SQL->StmtBindColumn(stmt, 11 + i, SQLDT_INT, &item.card[i], sizeof item.card[i], NULL, NULL))
-			SqlStmt_ShowDebug(stmt);
-	}
+	return sd;
+}
 
-	for (i = 0; i < MAX_ITEM_OPTIONS; i++) {
-		if (SQL_ERROR == SQL->StmtBindColumn(stmt, 11 + MAX_SLOTS + i * 2, SQLDT_INT16, &item.option[i].index, sizeof item.option[i].index, NULL, NULL)
-			|| SQL_ERROR == SQL->StmtBindColumn(stmt, 12 + MAX_SLOTS + i * 2, SQLDT_INT16, &item.option[i].value, sizeof item.option[i].index, NULL, NULL))
-			SqlStmt_ShowDebug(stmt);
-	}
+/**
+ * Writes the state of a materialized adapter back into its clone
+ */
+static void clone_sync(struct trade_clone* tc)
+{
+	struct map_session_data* sd = tc->sd;
+	struct at_payload* payload = tc->payload;
 
-	if (has_favorite) {
-		if (SQL_ERROR == SQL->StmtBindColumn(stmt, 11 + MAX_SLOTS + MAX_ITEM_OPTIONS * 2, SQLDT_CHAR, &item.favorite, sizeof item.favorite, NULL, NULL))
-			SqlStmt_ShowDebug(stmt);
-	}
+	if (sd == NULL)
+		return;
 
-	if (SQL->StmtNumRows(stmt) > 0) {
-		i = 0;
-		while (SQL_SUCCESS == SQL->StmtNextRow(stmt) && i < max) {
-			items[i++] = item;
-		}
+	if (strcmp(tc->message, sd->message) != 0) {
+		safestrncpy(tc->message, sd->message, MESSAGE_SIZE);
+		clone_packets_invalidate(tc);
 	}
 
-	SQL->StmtFree(stmt);
-	StrBuf->Destroy(&buf);
+	tc->zeny = sd->status.zeny;
+	tc->weight = sd->weight;
+	tc->cart_weight = sd->cart_weight;
+	tc->cart_num = sd->cart_num;
 
-	return i;
+	payload->vend_num = sd->vend_num;
+	memcpy(payload->vending, sd->vending, sizeof(payload->vending));
+	memcpy(&payload->buyingstore, &sd->buyingstore, sizeof(payload->buyingstore));
+	memcpy(payload->cart, sd->status.cart, sizeof(payload->cart));
+	if (payload->inventory != NULL)
+		memcpy(payload->inventory, sd->status.inventory, sizeof(struct item[MAX_INVENTORY]));
+
+	clone_index(tc); // Amounts may have changed after a sale
 }
 
 /**
- * Saves item data to database
+ * Writes back and releases the adapter of a clone
  */
-static int memitemdata_to_sql(const struct item* p_items, int current_size, int guid, enum inventory_table_type table)
+static void clone_release(struct trade_clone* tc)
 {
-	const char* tablename = NULL;
-	const char* selectoption = NULL;
-	bool has_favorite = false;
-	int total_updates = 0, total_deletes = 0, total_inserts = 0;
-	int max_size = 0;
-	int db_size = 0;
-
-	switch (table) {
-	case TABLE_INVENTORY:
-		tablename = inventory_db;
-		selectoption = "char_id";
-		has_favorite = true;
-		max_size = MAX_INVENTORY;
-		break;
-	case TABLE_CART:
-		tablename = cart_db;
-		selectoption = "char_id";
-		max_size = MAX_CART;
-		break;
-	case TABLE_GUILD_STORAGE:
-	case TABLE_STORAGE:
-	default:
-		ShowError("Invalid table type %d!\n", (int)table);
-		Assert_retr(-1, table);
-		return -1;
-	}
-	if (current_size == -1)
-		current_size = max_size;
-
-	bool* matched_p = NULL;
-	if (current_size > 0) {
-		nullpo_ret(p_items);
+	if (tc->release_timer != INVALID_TIMER)
+		timer->delete(tc->release_timer, clone_release_timer);
+	tc->release_timer = INVALID_TIMER;
 
-		matched_p = aCalloc(current_size, sizeof(bool));
-	}
+	if (tc->sd == NULL)
+		return;
 
-	StringBuf buf;
-	StrBuf->Init(&buf);
+	clone_sync(tc);
+	ers_free(adapters.ers, tc->sd);
+	tc->sd = NULL;
+	adapters.count--;
+}
 
-	/**
-	 * If the storage table is not empty, check for items and replace or delete where needed.
-	 */
-	struct item* cp_items = aCalloc(max_size, sizeof(struct item));
-	if ((db_size = getitemdata_from_sql(cp_items, max_size, guid, table)) > 0) {
-		int* deletes = aCalloc(db_size, sizeof(struct item));
+/**
+ * Releases deferred adapters
+ */
+static int clone_release_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	struct trade_clone* tc = id2tc(id);
 
-		for (int i = 0; i < db_size; i++) {
-			const struct item* cp_it = &cp_items[i];
+	if (tc == NULL || tc->release_timer != tid)
+		return 0;
 
-			int j = 0;
-			ARR_FIND(0, current_size, j,
-				matched_p[j] != true
-				&& p_items[j].nameid != 0
-				&& cp_it->nameid == p_items[j].nameid
-				&& cp_it->unique_id == p_items[j].unique_id
-				&& memcmp(p_items[j].card, cp_it->card, sizeof(int) * MAX_SLOTS) == 0
-				&& memcmp(p_items[j].option, cp_it->option, 5 * MAX_ITEM_OPTIONS) == 0);
+	tc->release_timer = INVALID_TIMER;
+	clone_release(tc);
+	return 0;
+}
 
-			if (j < current_size) { // Item found.
-				matched_p[j] = true; // Mark the item as matched.
+/**
+ * Frees a clone that never got spawned
+ */
+static void clone_discard(struct trade_clone* tc)
+{
+	item_state_free(tc);
+	if (tc->payload->inventory != NULL)
+		aFree(tc->payload->inventory);
+	aFree(tc->payload);
+	aFree(tc);
+}
 
-				// If the amount has changed, set for replacement with current item properties.
-				if (memcmp(cp_it, &p_items[j], sizeof(struct item)) != 0) {
-					if (total_updates == 0) {
-						StrBuf->Clear(&buf);
-						StrBuf->Printf(&buf, "REPLACE INTO `%s` (`id`, `%s`, `nameid`, `amount`, `equip`, `identify`, `refine`, `grade`, `attribute`", tablename, selectoption);
-						for (int k = 0; k < MAX_SLOTS; k++)
-							StrBuf->Printf(&buf, ", `card%d`", k);
-						for (int k = 0; k < MAX_ITEM_OPTIONS; k++)
-							StrBuf->Printf(&buf, ", `opt_idx%d`, `opt_val%d`", k, k);
-						StrBuf->AppendStr(&buf, ", `expire_time`, `bound`, `unique_id`");
-						if (has_favorite)
-							StrBuf->AppendStr(&buf, ", `favorite`");
+/**
+ * vending->searchall prehook
+ *
+ * The search proxy answers for every vending clone
+ */
+static bool vending_searchall_pre(struct map_session_data** sd, const struct s_search_store_search** s)
+{
+	if (*sd != adapters.search_proxy)
+		return true;
 
-						StrBuf->AppendStr(&buf, ") VALUES ");
+	hookStop();
+	stub_spawn_search(TD_VC, *s);
+	return clone_searchall(TD_VC, *s);
+}
 
-					}
+/**
+ * buyingstore->searchall prehook
+ *
+ * The search proxy answers for every buying clone
+ */
+static bool buyingstore_searchall_pre(struct map_session_data** sd, const struct s_search_store_search** s)
+{
+	if (*sd != adapters.search_proxy)
+		return true;
 
-					StrBuf->Printf(&buf, "%s('%d', '%d', '%d', '%d', '%u', '%d', '%d', '%d', '%d'",
-						total_updates > 0 ? ", " : "", cp_it->id, guid, p_items[j].nameid, p_items[j].amount, p_items[j].equip, p_items[j].identify, p_items[j].refine, p_items[j].grade, p_items[j].attribute);
-					for (int k = 0; k < MAX_SLOTS; k++)
-						StrBuf->Printf(&buf, ", '%d'", p_items[j].card[k]);
-					for (int k = 0; k < MAX_ITEM_OPTIONS; ++k)
-						StrBuf->Printf(&buf, ", '%d', '%d'", p_items[j].option[k].index, p_items[j].option[k].value);
-					StrBuf->Printf(&buf, ", '%u', '%d', '%"PRIu64"'", p_items[j].expire_time, p_items[j].bound, p_items[j].unique_id);
-					if (has_favorite)
-						StrBuf->Printf(&buf, ", %d", p_items[j].favorite);
+	hookStop();
+	stub_spawn_search(TD_BC, *s);
+	return clone_searchall(TD_BC, *s);
+}
 
-					StrBuf->AppendStr(&buf, ")");
+/**
+ * Runs a store search over the listings of the clones of a type, returns false once the result set is full
+ */
+static bool clone_searchall(enum trade_type type, const struct s_search_store_search* s)
+{
+	for (unsigned int idx = 0; idx < s->item_count; idx++) {
+		for (struct at_listing* l = idb_get(listing_db[type], s->itemlist[idx].itemId); l != NULL; l = l->next) {
+			struct trade_clone* tc = l->tc;
 
-					total_updates++;
-				}
-			}
-			else { // Doesn't exist in the table, set for deletion.
-				deletes[total_deletes++] = cp_it->id;
+			if (s->min_price && s->min_price > (unsigned int)l->price)
+				continue; // Too low price
+
+			if (s->max_price && s->max_price < (unsigned int)l->price)
+				continue; // Too high price
+
+			if (type == TD_VC && s->card_count && !listing_has_card(l, s))
+				continue; // Buying stores can't have cards
+
+			if (!searchstore->result(s->search_sd, type == TD_VC ? tc->vender_id : tc->buyer_id, tc->account_id, tc->message,
+				l->item.nameid, l->amount, l->price, l->item.card, l->item.refine, l->item.option))
+				return false; // Result set full
+
+			clone_wake(tc); // May be opened from the results
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Whether a listed stack has one of the searched cards
+ */
+static bool listing_has_card(const struct at_listing* l, const struct s_search_store_search* s)
+{
+	const struct item* it = &l->item;
+
+	if (itemdb_isspecial(it->card[0])) // Something that is not carded
+		return false;
+
+	int slot = itemdb_slot(it->nameid);
+	for (int c = 0; c < slot && it->card[c]; c++) {
+		for (unsigned int i = 0; i < s->card_count; i++) {
+			if (s->cardlist[i].itemId == it->card[c])
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Adds a listing to the index of its item
+ */
+static void listing_link(struct at_listing* l, enum trade_type type)
+{
+	struct at_listing* head = idb_get(listing_db[type], l->item.nameid);
+
+	l->prev = NULL;
+	l->next = head;
+	if (head != NULL)
+		head->prev = l;
+	idb_put(listing_db[type], l->item.nameid, l);
+}
+
+/**
+ * Removes a listing from the index of its item
+ */
+static void listing_unlink(struct at_listing* l, enum trade_type type)
+{
+	if (l->prev != NULL)
+		l->prev->next = l->next;
+	else if (l->next != NULL)
+		idb_put(listing_db[type], l->item.nameid, l->next);
+	else
+		idb_remove(listing_db[type], l->item.nameid);
+
+	if (l->next != NULL)
+		l->next->prev = l->prev;
+	l->prev = l->next = NULL;
+}
+
+/**
+ * Indexes the shop entries of a clone, replacing its previous listings
+ */
+static void clone_index(struct trade_clone* tc)
+{
+	struct at_payload* payload = clone_payload(tc);
+	int count = 0;
+
+	clone_unindex(tc);
+
+	if (tc->type == TD_VC) {
+		for (int i = 0; i < payload->vend_num; i++) {
+			const struct s_vending* v = &payload->vending[i];
+			const struct item* it = &payload->cart[v->index];
+			if (it->nameid == 0 || v->amount == 0)
+				continue;
+
+			struct at_listing* l = &tc->listings[count++];
+			l->item = *it;
+			l->price = v->value;
+			l->amount = v->amount;
+		}
+	} else {
+		for (int i = 0; i < payload->buyingstore.slots; i++) {
+			const struct s_buyingstore_item* b = &payload->buyingstore.items[i];
+			if (b->nameid == 0 || b->amount == 0)
+				continue;
+
+			struct at_listing* l = &tc->listings[count++];
+			memset(&l->item, 0, sizeof(l->item));
+			l->item.nameid = b->nameid;
+			l->price = b->price;
+			l->amount = b->amount;
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		tc->listings[i].tc = tc;
+		listing_link(&tc->listings[i], tc->type);
+	}
+	tc->listing_count = count;
+}
+
+/**
+ * Removes the listings of a clone from the index
+ */
+static void clone_unindex(struct trade_clone* tc)
+{
+	for (int i = 0; i < tc->listing_count; i++)
+		listing_unlink(&tc->listings[i], tc->type);
+	tc->listing_count = 0;
+}
+
+/**
+ * Lists the shops selling or buying an item: clones from the index, players from the store db
+ */
+static bool clone_who(int fd, const char* message, enum trade_type type)
+{
+	char output[CHAT_SIZE_MAX];
+	struct item_data* data;
+	int count = 0;
+
+	if (message == NULL || *message == '\0') {
+		clif->message(fd, type == TD_VC ? "Please enter an item name or ID (usage: @whosell <item name/ID>)." : "Please enter an item name or ID (usage: @whobuy <item name/ID>).");
+		return false;
+	}
+
+	if ((data = itemdb->search_name(message)) == NULL && (data = itemdb->exists(atoi(message))) == NULL) {
+		clif->message(fd, "Invalid item ID or name.");
+		return false;
+	}
+
+	stub_spawn_item(type, data->nameid);
+
+	for (struct at_listing* l = idb_get(listing_db[type], data->nameid); l != NULL; l = l->next) {
+		struct mob_data* md = l->tc->md;
+		if (count++ >= AT_WHO_MAX_LINES)
+			continue;
+
+		snprintf(output, sizeof(output), "%s | %d z | %d ea | %s (%d, %d)", md->name, l->price, l->amount, map->list[md->bl.m].name, md->bl.x, md->bl.y);
+		clif->message(fd, output);
+	}
+
+	struct DBMap* store_db = vending->db;
+	if (type == TD_BC) {
+#ifdef HERACLES_VERSION
+		store_db = buyingstore->db;
+#else
+		store_db = NULL; // Buying stores of players are not tracked by a db
+#endif
+	}
+
+	if (store_db != NULL) {
+		struct DBIterator* iter = db_iterator(store_db);
+		for (struct map_session_data* pl_sd = dbi_first(iter); dbi_exists(iter); pl_sd = dbi_next(iter)) {
+			int i;
+			if (pl_sd == adapters.search_proxy)
+				continue;
+
+			if (type == TD_VC) {
+				ARR_FIND(0, pl_sd->vend_num, i, pl_sd->status.cart[pl_sd->vending[i].index].nameid == data->nameid);
+				if (i == pl_sd->vend_num || count++ >= AT_WHO_MAX_LINES)
+					continue;
+				snprintf(output, sizeof(output), "%s | %d z | %d ea | %s (%d, %d)", pl_sd->status.name, pl_sd->vending[i].value,
+					pl_sd->vending[i].amount, map->list[pl_sd->bl.m].name, pl_sd->bl.x, pl_sd->bl.y);
+			} else {
+				ARR_FIND(0, pl_sd->buyingstore.slots, i, pl_sd->buyingstore.items[i].nameid == data->nameid);
+				if (i == pl_sd->buyingstore.slots || count++ >= AT_WHO_MAX_LINES)
+					continue;
+				snprintf(output, sizeof(output), "%s | %d z | %d ea | %s (%d, %d)", pl_sd->status.name, pl_sd->buyingstore.items[i].price,
+					pl_sd->buyingstore.items[i].amount, map->list[pl_sd->bl.m].name, pl_sd->bl.x, pl_sd->bl.y);
 			}
+			clif->message(fd, output);
 		}
+		dbi_destroy(iter);
+	}
 
-		if (total_updates > 0 && SQL_ERROR == SQL->QueryStr(map->mysql_handle, StrBuf->Value(&buf)))
-			Sql_ShowDebug(map->mysql_handle);
+	if (count == 0)
+		snprintf(output, sizeof(output), "Nobody is %s %s.", type == TD_VC ? "selling" : "buying", data->jname);
+	else if (count > AT_WHO_MAX_LINES)
+		snprintf(output, sizeof(output), "%d shops found, showing the first %d.", count, AT_WHO_MAX_LINES);
+	else
+		snprintf(output, sizeof(output), "%d shop(s) found.", count);
+	clif->message(fd, output);
 
-		/**
-		 * Handle deletions, if any.
-		 */
-		if (total_deletes > 0) {
-			StrBuf->Clear(&buf);
-			StrBuf->Printf(&buf, "DELETE FROM `%s` WHERE `id` IN (", tablename);
-			for (int i = 0; i < total_deletes; i++)
-				StrBuf->Printf(&buf, "%s'%d'", i == 0 ? "" : ", ", deletes[i]);
+	return true;
+}
 
-			StrBuf->AppendStr(&buf, ");");
+/**
+ * Saves clone inventory data of a character into database
+ */
+static void save(struct trade_clone* tc)
+{
+	unsigned int flags = AT_PERSIST_ITEMS | AT_PERSIST_ZENY;
+
+#if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
+	if (tc->type == TD_BC) // Amounts and limit change with every buy
+		flags |= AT_PERSIST_BUYER;
+#endif
+	persist_push(tc, flags);
+}
+
+/**
+ * FNV-1a over a block of data, continuing from hash
+ */
+static uint64 at_checksum(uint64 hash, const void* data, size_t len)
+{
+	const uint8* p = data;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= UINT64_C(0x100000001b3);
+	}
+
+	return hash;
+}
+
+#ifdef AT_JOURNAL_FILE
+/**
+ * Opens the journal for appending, records of a failed replay are kept
+ */
+static bool journal_open(void)
+{
+	if ((journal.fp = fopen(AT_JOURNAL_FILE, "ab")) == NULL) {
+		ShowError("[at2] Could not open the autotrade journal '%s', clones are saved on every request\n", AT_JOURNAL_FILE);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Flags changes of a clone, journaled on the next sync
+ */
+static void journal_touch(struct trade_clone* tc, unsigned int flags)
+{
+	if (journal.fp == NULL)
+		return;
 
-			if (SQL_ERROR == SQL->QueryStr(map->mysql_handle, StrBuf->Value(&buf)))
-				Sql_ShowDebug(map->mysql_handle);
+	idb_iput(journal.pending, tc->char_id, idb_iget(journal.pending, tc->char_id) | (int)flags);
+}
+
+/**
+ * Journals the last changes of a removed clone. Returns whether it has changes not saved yet,
+ * its records are released once they are (see journal_release).
+ */
+static bool journal_close(struct trade_clone* tc)
+{
+	if (journal.fp == NULL)
+		return false;
+
+	unsigned int flags = (unsigned int)idb_iget(journal.pending, tc->char_id);
+	bool unsaved = flags != 0 || idb_exists(journal.touched, tc->char_id) || journal.resave;
+
+	for (int i = 0; i < AT_TABLE_MAX; i++) {
+		if (flags & AT_JOURNAL_TABLE(i))
+			journal_record(tc, AT_JOURNAL_ITEMS, i);
+	}
+	if (flags & AT_JOURNAL_ZENY_FLAG)
+		journal_record(tc, AT_JOURNAL_ZENY, 0);
+
+	idb_remove(journal.pending, tc->char_id);
+	idb_remove(journal.touched, tc->char_id);
+
+	return unsaved;
+}
+
+/**
+ * The final save of a removed clone was written, its records aren't replayed anymore
+ */
+static void journal_release(int char_id, int account_id)
+{
+	struct at_journal_record* rec = (struct at_journal_record*)journal.scratch;
+
+	if (journal.fp == NULL || idb_exists(clone_db, char_id)) // Spawned again, its new records still count
+		return;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->type = AT_JOURNAL_CLOSE;
+	rec->char_id = char_id;
+	rec->account_id = account_id;
+	journal_append(rec);
+}
+
+/**
+ * Appends a record with the current state of a clone
+ */
+static void journal_record(struct trade_clone* tc, enum at_journal_type type, int table)
+{
+	struct at_journal_record* rec = (struct at_journal_record*)journal.scratch;
+	struct at_journal_entry* entries = (struct at_journal_entry*)(journal.scratch + sizeof(*rec));
+	struct map_session_data* sd = tc->sd; // Adapters hold the newest state until released
+
+	memset(rec, 0, sizeof(*rec));
+	rec->type = type;
+	rec->char_id = tc->char_id;
+	rec->account_id = tc->account_id;
+	rec->table = table;
+
+	if (type == AT_JOURNAL_ITEMS) {
+		const struct item* items;
+		int max = table == AT_TABLE_CART ? MAX_CART : MAX_INVENTORY;
+
+		if (table == AT_TABLE_CART)
+			items = sd != NULL ? sd->status.cart : clone_payload(tc)->cart;
+		else
+			items = sd != NULL ? sd->status.inventory : clone_payload(tc)->inventory;
+
+		if (items == NULL)
+			return;
+
+		for (int i = 0; i < max; i++) {
+			if (items[i].nameid == 0)
+				continue;
+			entries[rec->count].slot = i;
+			entries[rec->count].item = items[i];
+			rec->count++;
 		}
+	} else if (type == AT_JOURNAL_ZENY) {
+		rec->zeny = sd != NULL ? sd->status.zeny : tc->zeny;
+		rec->delta = tc->journal_delta;
+		tc->journal_delta = 0;
+	}
 
-		aFree(deletes);
+	journal_append(rec);
+}
+
+/**
+ * Checksums a record built in the scratch buffer and appends it
+ */
+static void journal_append(struct at_journal_record* rec)
+{
+	size_t len = sizeof(*rec) + sizeof(struct at_journal_entry) * rec->count;
+	size_t offset = offsetof(struct at_journal_record, type);
+
+	rec->size = (uint32)(len - offset);
+	rec->checksum = (uint32)at_checksum(UINT64_C(0xcbf29ce484222325), journal.scratch + offset, len - offset);
+
+	if (fwrite(journal.scratch, len, 1, journal.fp) != 1) {
+		ShowError("[at2] Could not append to the autotrade journal\n");
+		return;
 	}
 
-	/**
-	 * Check for new items and add if required.
-	 */
-	for (int i = 0; i < current_size; i++) {
-		const struct item* p_it = &p_items[i];
+	journal.records++;
+	journal.bytes += len;
+}
 
-		if (matched_p[i] || p_it->nameid == 0)
+/**
+ * Journals the pending changes of every clone and syncs them to disk
+ */
+static void journal_sync(void)
+{
+	if (journal.fp == NULL || db_size(journal.pending) == 0)
+		return;
+
+	union DBKey key;
+	struct DBIterator* iter = db_iterator(journal.pending);
+	for (union DBData* data = iter->first(iter, &key); data != NULL; data = iter->next(iter, &key)) {
+		unsigned int flags = (unsigned int)DB->data2i(data);
+		struct trade_clone* tc = idb_get(clone_db, key.i);
+		if (tc == NULL)
 			continue;
 
-		if (total_inserts == 0) {
-			StrBuf->Clear(&buf);
-			StrBuf->Printf(&buf, "INSERT INTO `%s` (`%s`, `nameid`, `amount`, `equip`, `identify`, `refine`, `grade`, `attribute`, `expire_time`, `bound`, `unique_id`", tablename, selectoption);
-			for (int j = 0; j < MAX_SLOTS; ++j)
-				StrBuf->Printf(&buf, ", `card%d`", j);
-			for (int j = 0; j < MAX_ITEM_OPTIONS; ++j)
-				StrBuf->Printf(&buf, ", `opt_idx%d`, `opt_val%d`", j, j);
-			if (has_favorite)
-				StrBuf->AppendStr(&buf, ", `favorite`");
-			StrBuf->AppendStr(&buf, ") VALUES ");
+		for (int i = 0; i < AT_TABLE_MAX; i++) {
+			if (flags & AT_JOURNAL_TABLE(i))
+				journal_record(tc, AT_JOURNAL_ITEMS, i);
 		}
+		if (flags & AT_JOURNAL_ZENY_FLAG)
+			journal_record(tc, AT_JOURNAL_ZENY, 0);
 
-		StrBuf->Printf(&buf, "%s('%d', '%d', '%d', '%u', '%d', '%d', '%d', '%d', '%u', '%d', '%"PRIu64"'",
-			total_inserts > 0 ? ", " : "", guid, p_it->nameid, p_it->amount, p_it->equip, p_it->identify, p_it->refine, p_it->grade,
-			p_it->attribute, p_it->expire_time, p_it->bound, p_it->unique_id);
+		idb_iput(journal.touched, key.i, 1);
+	}
+	dbi_destroy(iter);
+	db_clear(journal.pending);
 
-		for (int j = 0; j < MAX_SLOTS; ++j)
-			StrBuf->Printf(&buf, ", '%d'", p_it->card[j]);
-		for (int j = 0; j < MAX_ITEM_OPTIONS; ++j)
-			StrBuf->Printf(&buf, ", '%d', '%d'", p_it->option[j].index, p_it->option[j].value);
+	fflush(journal.fp);
+	journal_request_sync();
+}
 
-		if (has_favorite)
-			StrBuf->Printf(&buf, ", '%d'", p_it->favorite);
+/**
+ * Name of the nth checkpoint file, journals moved aside and waiting for their saves
+ */
+static void journal_checkpoint_name(char* out, size_t size, int gen)
+{
+	snprintf(out, size, "%s.checkpoint.%d", AT_JOURNAL_FILE, gen);
+}
 
-		StrBuf->AppendStr(&buf, ")");
+/**
+ * Drops every checkpoint file, their saves were written
+ */
+static void journal_checkpoint_remove(void)
+{
+	char checkpoint[256];
 
-		total_inserts++;
+	for (int gen = journal.checkpoint_first; gen < journal.checkpoint_next; gen++) {
+		journal_checkpoint_name(checkpoint, sizeof(checkpoint), gen);
+		remove(checkpoint);
 	}
+	journal.checkpoint_first = journal.checkpoint_next;
 
-	if (total_inserts > 0 && SQL_ERROR == SQL->QueryStr(map->mysql_handle, StrBuf->Value(&buf)))
-		Sql_ShowDebug(map->mysql_handle);
+	snprintf(checkpoint, sizeof(checkpoint), "%s.checkpoint", AT_JOURNAL_FILE); // Left by previous versions
+	remove(checkpoint);
+}
 
-	StrBuf->Destroy(&buf);
+/**
+ * Flushes a journal descriptor to disk, closing it if it's a duplicate owned by the sync thread
+ */
+static void journal_fsync(int fd, bool owned)
+{
+#ifdef WIN32
+	_commit(fd);
+	if (owned)
+		_close(fd);
+#else
+	fsync(fd);
+	if (owned)
+		close(fd);
+#endif
+}
 
-	aFree(cp_items);
-	if (matched_p != NULL)
-		aFree(matched_p);
+/**
+ * Hands the journal to the sync thread. Records already flushed are covered by any sync not started yet.
+ */
+static void journal_request_sync(void)
+{
+	int fd = -1;
 
-	ShowInfo("%s save complete - guid: %d (replace: %d, insert: %d, delete: %d)\n", tablename, guid, total_updates, total_inserts, total_deletes);
+	if (journal.syncer != NULL) {
+		mutex->lock(journal.lock);
+		if (journal.sync_count > 0 && journal.sync_gens[journal.sync_count - 1] == journal.file_gen) {
+			mutex->unlock(journal.lock);
+			return;
+		}
+
+		if (journal.sync_count < AT_JOURNAL_SYNC_QUEUE) {
+#ifdef WIN32
+			fd = _dup(_fileno(journal.fp));
+#else
+			fd = dup(fileno(journal.fp));
+#endif
+		}
+
+		if (fd >= 0) {
+			journal.sync_fds[journal.sync_count] = fd;
+			journal.sync_gens[journal.sync_count] = journal.file_gen;
+			journal.sync_count++;
+			mutex->cond_signal(journal.wake);
+		}
+		mutex->unlock(journal.lock);
+
+		if (fd >= 0)
+			return;
+	}
+
+	// No thread, or it's lagging behind
+#ifdef WIN32
+	journal_fsync(_fileno(journal.fp), false);
+#else
+	journal_fsync(fileno(journal.fp), false);
+#endif
+	journal.syncs++;
+}
+
+/**
+ * Sync thread, syncs the journal descriptors handed by journal_request_sync. Drains them before stopping.
+ */
+static void* journal_syncer(void* param)
+{
+	mutex->lock(journal.lock);
+	while (journal.sync_count > 0 || !journal.stop) {
+		if (journal.sync_count == 0) {
+			mutex->cond_wait(journal.wake, journal.lock, -1);
+			continue;
+		}
+
+		int fd = journal.sync_fds[0];
+		journal.sync_count--;
+		memmove(journal.sync_fds, journal.sync_fds + 1, sizeof(int) * journal.sync_count);
+		memmove(journal.sync_gens, journal.sync_gens + 1, sizeof(int) * journal.sync_count);
+
+		mutex->unlock(journal.lock);
+		journal_fsync(fd, true);
+		mutex->lock(journal.lock);
+		journal.syncs++;
+	}
+	mutex->unlock(journal.lock);
+
+	return NULL;
+}
+
+static int journal_sync_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	journal_sync();
+	return 0;
+}
+
+/**
+ * Queues saves of the clones journaled since the last checkpoint
+ */
+static void journal_saves(void)
+{
+	union DBKey key;
+	struct DBIterator* iter = db_iterator(journal.resave ? clone_db : journal.touched);
+
+	for (union DBData* data = iter->first(iter, &key); data != NULL; data = iter->next(iter, &key)) {
+		struct trade_clone* tc = idb_get(clone_db, key.i);
+		if (tc != NULL)
+			save(tc);
+	}
+	dbi_destroy(iter);
+
+	db_clear(journal.touched);
+	journal.resave = false;
+}
+
+/**
+ * Saves journaled clones. Their records are moved aside and dropped once the saves are written.
+ */
+static int journal_checkpoint_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	char checkpoint[256];
+
+	if (journal.fp == NULL || journal.checkpointing || persist.sql_handle == NULL)
+		return 0;
+
+	journal_sync();
+	if (db_size(journal.touched) == 0 && !journal.resave)
+		return 0;
+
+	// Pending syncs keep their own descriptor, they follow the file
+	fflush(journal.fp);
+	journal_request_sync();
+	fclose(journal.fp);
+	journal.fp = NULL;
+
+	// Records of a failed checkpoint are kept in their own files, replayed oldest first
+	journal_checkpoint_name(checkpoint, sizeof(checkpoint), journal.checkpoint_next);
+	if (rename(AT_JOURNAL_FILE, checkpoint) != 0) {
+		ShowError("[at2] Could not move autotrade journal records to '%s'\n", checkpoint);
+		journal_open(); // Keep appending, the records are replayed again
+		return 0;
+	}
+	journal.checkpoint_next++;
+	journal.file_gen++;
+	journal.bytes = 0;
+
+	journal_open(); // Saved on every request if it fails, the checkpoint still covers the moved records
+
+	journal_saves();
+	journal.failed = false;
+	journal.checkpointing = true;
+	persist_push_checkpoint();
+
+	return 0;
+}
+
+/**
+ * Every save of the checkpoint was written, drops its records unless one failed
+ */
+static void journal_checkpoint_done(void)
+{
+	journal.checkpointing = false;
+	if (journal.failed) {
+		ShowWarning("[at2] Autotrade journal checkpoint had failed saves, keeping its records\n");
+		journal.resave = true;
+		return;
+	}
+
+	journal_checkpoint_remove();
+	journal.checkpoints++;
+}
+
+/**
+ * Reads the records of a journal file into per character states. Stops at the first torn record.
+ */
+static bool journal_read(const char* file, struct DBMap* states)
+{
+	FILE* fp = fopen(file, "rb");
+	struct at_journal_record* rec = (struct at_journal_record*)journal.scratch;
+	struct at_journal_entry* entries = (struct at_journal_entry*)(journal.scratch + sizeof(*rec));
+	size_t offset = offsetof(struct at_journal_record, type);
+	int records = 0;
+
+	if (fp == NULL)
+		return false;
+
+	while (fread(rec, sizeof(*rec), 1, fp) == 1) {
+		if (rec->count < 0 || rec->count > MAX_INVENTORY || rec->table < 0 || rec->table >= AT_TABLE_MAX
+			|| rec->size != sizeof(*rec) - offset + sizeof(struct at_journal_entry) * rec->count
+			|| (rec->count > 0 && fread(entries, sizeof(struct at_journal_entry) * rec->count, 1, fp) != 1)
+			|| rec->checksum != (uint32)at_checksum(UINT64_C(0xcbf29ce484222325), journal.scratch + offset, rec->size)) {
+			ShowWarning("[at2] Autotrade journal '%s' ends with a torn record after %d records\n", file, records);
+			break;
+		}
+		records++;
+
+		struct at_journal_state* state = idb_get(states, rec->char_id);
+		if (rec->type == AT_JOURNAL_CLOSE) {
+			if (state != NULL) {
+				for (int i = 0; i < AT_TABLE_MAX; i++) {
+					if (state->tables[i] != NULL)
+						aFree(state->tables[i]);
+				}
+				idb_remove(states, rec->char_id);
+			}
+			continue;
+		}
+
+		if (state == NULL) {
+			CREATE(state, struct at_journal_state, 1);
+			idb_put(states, rec->char_id, state);
+		}
+		state->account_id = rec->account_id;
+
+		if (rec->type == AT_JOURNAL_ZENY) {
+			state->has_zeny = true;
+			state->zeny = rec->zeny;
+		} else if (rec->type == AT_JOURNAL_ITEMS) {
+			int max = rec->table == AT_TABLE_CART ? MAX_CART : MAX_INVENTORY;
+
+			if (state->tables[rec->table] == NULL)
+				CREATE(state->tables[rec->table], struct item, max);
+			memset(state->tables[rec->table], 0, sizeof(struct item) * max);
+			for (int i = 0; i < rec->count; i++) {
+				if (entries[i].slot >= 0 && entries[i].slot < max)
+					state->tables[rec->table][entries[i].slot] = entries[i].item;
+			}
+		}
+	}
+
+	fclose(fp);
+	return true;
+}
+
+/**
+ * Writes the last journaled state of every character into SQL. Replaying is idempotent,
+ * records are only dropped once every write succeeded.
+ */
+static void journal_replay(void)
+{
+	char checkpoint[256];
+	struct DBMap* states = idb_alloc(DB_OPT_RELEASE_DATA);
+	int64 start = timer->gettick_nocache();
+	bool result = true;
+
+	// Older records first: checkpoint files of previous versions, checkpoint files, then the journal
+	snprintf(checkpoint, sizeof(checkpoint), "%s.checkpoint", AT_JOURNAL_FILE);
+	bool found = journal_read(checkpoint, states);
+	for (journal.checkpoint_next = 0; ; journal.checkpoint_next++) {
+		journal_checkpoint_name(checkpoint, sizeof(checkpoint), journal.checkpoint_next);
+		if (!journal_read(checkpoint, states))
+			break;
+		found = true;
+	}
+	found = journal_read(AT_JOURNAL_FILE, states) || found;
+	if (!found) {
+		db_destroy(states);
+		return;
+	}
+
+	union DBKey key;
+	struct DBIterator* iter = db_iterator(states);
+	for (union DBData* data = iter->first(iter, &key); data != NULL; data = iter->next(iter, &key)) {
+		struct at_journal_state* state = DB->data2ptr(data);
+		int char_id = key.i;
+		for (int i = 0; i < AT_TABLE_MAX; i++) {
+			if (state->tables[i] == NULL)
+				continue;
+			// Number of rows changed, -1 on error
+			if (result && memitemdata_to_sql(map->mysql_handle, state->tables[i], i == AT_TABLE_CART ? MAX_CART : MAX_INVENTORY,
+				char_id, i == AT_TABLE_CART ? TABLE_CART : TABLE_INVENTORY, NULL) < 0)
+				result = false;
+			aFree(state->tables[i]);
+		}
+
+		if (result && state->has_zeny && SQL_ERROR == SQL->Query(map->mysql_handle, "UPDATE `%s` SET `zeny`='%d' WHERE `account_id`='%d' AND `char_id`='%d'",
+			character_db, state->zeny, state->account_id, char_id)) {
+			Sql_ShowDebug(map->mysql_handle);
+			result = false;
+		}
+
+		if (result)
+			journal.replayed++;
+	}
+	dbi_destroy(iter);
+	db_destroy(states);
+
+	if (!result) {
+		ShowError("[at2] Autotrade journal replay failed, its records are kept for the next startup\n");
+		return;
+	}
+
+	journal_checkpoint_remove();
+	remove(AT_JOURNAL_FILE);
+	ShowStatus("[at2] Replayed the autotrade journal of '"CL_WHITE"%d"CL_RESET"' characters in %"PRId64" ms.\n",
+		journal.replayed, timer->gettick_nocache() - start);
+}
+
+/**
+ * Replays what a crash may have left and starts journaling
+ */
+static void journal_init(void)
+{
+	journal.pending = idb_alloc(DB_OPT_BASE);
+	journal.touched = idb_alloc(DB_OPT_BASE);
+	journal.scratch = aMalloc(sizeof(struct at_journal_record) + sizeof(struct at_journal_entry) * MAX_INVENTORY);
+	journal.sync_timer = journal.checkpoint_timer = INVALID_TIMER;
+
+	journal_replay();
+	if (!journal_open())
+		return;
+
+	journal.lock = mutex->create();
+	journal.wake = mutex->cond_create();
+	journal.syncer = thread->create(journal_syncer, NULL);
+	if (journal.syncer == NULL)
+		ShowWarning("[at2] Could not start the autotrade journal sync thread, the journal is synced from the main loop\n");
+
+	journal.sync_timer = timer->add_interval(timer->gettick() + AT_JOURNAL_SYNC, journal_sync_timer, 0, 0, AT_JOURNAL_SYNC);
+	journal.checkpoint_timer = timer->add_interval(timer->gettick() + AT_JOURNAL_CHECKPOINT, journal_checkpoint_timer, 0, 0, AT_JOURNAL_CHECKPOINT);
+}
+
+/**
+ * Drops the journal after a clean shutdown, saves must have been written (see persist_final)
+ */
+static void journal_final(void)
+{
+	if (journal.sync_timer != INVALID_TIMER)
+		timer->delete(journal.sync_timer, journal_sync_timer);
+	if (journal.checkpoint_timer != INVALID_TIMER)
+		timer->delete(journal.checkpoint_timer, journal_checkpoint_timer);
+	journal.sync_timer = journal.checkpoint_timer = INVALID_TIMER;
+
+	if (journal.syncer != NULL) {
+		mutex->lock(journal.lock);
+		journal.stop = true;
+		mutex->cond_signal(journal.wake);
+		mutex->unlock(journal.lock);
+		thread->wait(journal.syncer, NULL);
+		journal.syncer = NULL;
+	}
+	if (journal.lock != NULL) {
+		mutex->cond_destroy(journal.wake);
+		mutex->destroy(journal.lock);
+		journal.lock = NULL;
+	}
+
+	if (journal.fp != NULL) {
+		fclose(journal.fp);
+		journal.fp = NULL;
+
+		if (!journal.failed) {
+			journal_checkpoint_remove();
+			remove(AT_JOURNAL_FILE);
+		} else {
+			ShowWarning("[at2] Some clone saves failed at shutdown, the autotrade journal is replayed on the next startup\n");
+		}
+	}
+
+	if (journal.pending != NULL)
+		db_destroy(journal.pending);
+	if (journal.touched != NULL)
+		db_destroy(journal.touched);
+	if (journal.scratch != NULL)
+		aFree(journal.scratch);
+	journal.pending = journal.touched = NULL;
+	journal.scratch = NULL;
+}
+
+/**
+ * Queues a journal barrier behind every pending save
+ */
+static void persist_push_checkpoint(void)
+{
+	struct at_persist* p;
+
+#ifdef AT_PERSIST_THREAD
+	if (persist.worker != NULL)
+		mutex->lock(persist.lock);
+#endif
+
+	CREATE(p, struct at_persist, 1);
+	p->checkpoint = true;
+	persist_enqueue(p);
+
+#ifdef AT_PERSIST_THREAD
+	if (persist.worker != NULL) {
+		mutex->cond_signal(persist.wake);
+		mutex->unlock(persist.lock);
+	}
+#endif
+}
+#endif
+
+/**
+ * Payload of a clone, read back from the page file if hibernated
+ */
+static struct at_payload* clone_payload(struct trade_clone* tc)
+{
+#ifdef AT_HIBERNATE_FILE
+	if (tc->payload == NULL)
+		hibernate_fault(tc);
+#endif
+	return tc->payload;
+}
+
+/**
+ * Marks a clone as in use, bringing its payload back in memory
+ */
+static void clone_wake(struct trade_clone* tc)
+{
+	tc->active_tick = timer->gettick();
+#ifdef AT_HIBERNATE_FILE
+	if (tc->payload == NULL)
+		hibernate_prefetch(tc);
+#endif
+}
+
+#ifdef AT_HIBERNATE_FILE
+/**
+ * Monotonic clock in microseconds, for fault latencies
+ */
+static int64 at_usec(void)
+{
+#ifdef WIN32
+	return timer->gettick_nocache() * 1000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/**
+ * Positions the page file at a slot. Offsets are 64-bit, long is 32-bit on Windows.
+ */
+static bool hibernate_seek(int slot)
+{
+	int64 offset = (int64)slot * (int64)AT_PAGE_SIZE;
+
+#ifdef WIN32
+	return _fseeki64(hibernate.fp, offset, SEEK_SET) == 0;
+#else
+	if (offset != (int64)(off_t)offset) // 32-bit off_t
+		return false;
+	return fseeko(hibernate.fp, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+/**
+ * Moves the payload of a clone into a page file slot and frees it.
+ * The clone stays in memory as it was if the slot can't be written.
+ */
+static bool hibernate_clone(struct trade_clone* tc)
+{
+	struct at_payload* payload = tc->payload;
+	struct item* inventory = payload->inventory;
+	bool fresh = hibernate.free_count == 0;
+	int slot = fresh ? hibernate.slots : hibernate.free[hibernate.free_count - 1];
+
+	payload->inventory = NULL; // Not meaningful on disk
+	uint64 checksum = at_checksum(UINT64_C(0xcbf29ce484222325), payload, sizeof(struct at_payload));
+	if (inventory != NULL)
+		checksum = at_checksum(checksum, inventory, sizeof(struct item[MAX_INVENTORY]));
+
+	bool result = hibernate_seek(slot)
+		&& fwrite(payload, sizeof(struct at_payload), 1, hibernate.fp) == 1
+		&& (inventory == NULL || fwrite(inventory, sizeof(struct item[MAX_INVENTORY]), 1, hibernate.fp) == 1);
+
+	payload->inventory = inventory;
+	if (!result) {
+		ShowError("[at2] Could not write clone %d to the page file, keeping it in memory\n", tc->char_id);
+		return false;
+	}
+
+	if (fresh)
+		hibernate.slots++;
+	else
+		hibernate.free_count--;
+
+	tc->page = slot;
+	tc->page_checksum = checksum;
+	hibernate.maps[tc->md->bl.m]++;
+	hibernate.count++;
+	hibernate.hibernations++;
+	hibernate.bytes += sizeof(struct at_payload);
+	if (inventory != NULL) {
+		hibernate.bytes += sizeof(struct item[MAX_INVENTORY]);
+		aFree(inventory);
+	}
+	aFree(payload);
+	tc->payload = NULL;
+
+	return true;
+}
+
+/**
+ * Reads the payload of a hibernated clone back from its slot.
+ * An unreadable payload leaves the clone with an empty shop, removed on the next hibernation pass.
+ */
+static void hibernate_fault(struct trade_clone* tc)
+{
+	int64 start = at_usec();
+	struct at_payload* payload;
+	struct item* inventory = NULL;
+
+	CREATE(payload, struct at_payload, 1);
+	if (tc->type == TD_BC)
+		CREATE(inventory, struct item, MAX_INVENTORY);
+
+	bool result = hibernate_seek(tc->page)
+		&& fread(payload, sizeof(struct at_payload), 1, hibernate.fp) == 1
+		&& (inventory == NULL || fread(inventory, sizeof(struct item[MAX_INVENTORY]), 1, hibernate.fp) == 1);
+
+	payload->inventory = NULL; // Written as NULL
+	uint64 checksum = at_checksum(UINT64_C(0xcbf29ce484222325), payload, sizeof(struct at_payload));
+	payload->inventory = inventory;
+	if (inventory != NULL)
+		checksum = at_checksum(checksum, inventory, sizeof(struct item[MAX_INVENTORY]));
+
+	if (!result || checksum != tc->page_checksum) {
+		ShowError("[at2] Could not read clone %d back from the page file, closing its shop\n", tc->char_id);
+		memset(payload, 0, sizeof(struct at_payload));
+		payload->inventory = inventory;
+		if (inventory != NULL)
+			memset(inventory, 0, sizeof(struct item[MAX_INVENTORY]));
+		tc->lost = true;
+	}
+
+	hibernate_release(tc);
+	tc->payload = payload;
+
+	int64 elapsed = at_usec() - start;
+	hibernate.faults++;
+	hibernate.fault_total += elapsed;
+	hibernate.fault_max = max(hibernate.fault_max, elapsed);
+}
+
+/**
+ * Gives the page file slot of a hibernated clone back
+ */
+static void hibernate_release(struct trade_clone* tc)
+{
+	if (hibernate.free_count == hibernate.free_max) {
+		hibernate.free_max = max(hibernate.free_max * 2, 64);
+		RECREATE(hibernate.free, int, hibernate.free_max);
+	}
+	hibernate.free[hibernate.free_count++] = tc->page;
+
+	hibernate.maps[tc->md->bl.m]--;
+	hibernate.count--;
+	hibernate.bytes -= sizeof(struct at_payload) + (tc->type == TD_BC ? sizeof(struct item[MAX_INVENTORY]) : 0);
+}
+
+/**
+ * Queues a hibernated clone to be read back by hibernate_prefetch_timer
+ */
+static void hibernate_prefetch(struct trade_clone* tc)
+{
+	if (tc->prefetch || hibernate.fp == NULL)
+		return;
+
+	if (hibernate.prefetch_count == hibernate.prefetch_max) {
+		hibernate.prefetch_max = max(hibernate.prefetch_max * 2, 64);
+		RECREATE(hibernate.prefetch, int, hibernate.prefetch_max);
+	}
+	hibernate.prefetch[hibernate.prefetch_count++] = tc->char_id;
+	tc->prefetch = true;
+
+	if (hibernate.prefetch_timer == INVALID_TIMER)
+		hibernate.prefetch_timer = timer->add(timer->gettick() + 1, hibernate_prefetch_timer, 0, 0);
+}
+
+/**
+ * Queues a hibernated clone of the map a player entered
+ */
+static int hibernate_prefetch_sub(struct block_list* bl, va_list ap)
+{
+	struct trade_clone* tc = id2tc(bl->id);
+
+	if (tc != NULL && tc->payload == NULL) {
+		tc->active_tick = timer->gettick();
+		hibernate_prefetch(tc);
+	}
+
+	return 0;
+}
+
+/**
+ * Reads queued clones back, AT_HIBERNATE_PREFETCH per tick
+ */
+static int hibernate_prefetch_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	int count = min(hibernate.prefetch_count, AT_HIBERNATE_PREFETCH);
+
+	hibernate.prefetch_timer = INVALID_TIMER;
+
+	for (int i = 0; i < count; i++) {
+		struct trade_clone* tc = idb_get(clone_db, hibernate.prefetch[i]);
+		if (tc == NULL || !tc->prefetch) // Removed since
+			continue;
+
+		tc->prefetch = false;
+		clone_payload(tc);
+	}
+
+	hibernate.prefetch_count -= count;
+	memmove(hibernate.prefetch, hibernate.prefetch + count, sizeof(int) * hibernate.prefetch_count);
+
+	if (hibernate.prefetch_count > 0)
+		hibernate.prefetch_timer = timer->add(tick + 1, hibernate_prefetch_timer, 0, 0);
+
+	return 0;
+}
+
+/**
+ * Hibernates the clones idle on maps without players, and removes the ones whose payload was lost
+ */
+static int hibernate_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	struct DBIterator* iter = db_iterator(clone_db);
+
+	for (struct trade_clone* tc = dbi_first(iter); dbi_exists(iter); tc = dbi_next(iter)) {
+		if (tc->lost) {
+			remove_clone_sub(tc, true);
+			continue;
+		}
+
+		if (tc->payload == NULL || tc->sd != NULL || tc->handoff.state != AT_HANDOFF_NONE)
+			continue;
+
+		if (tc->active_tick == 0 || map->list[tc->md->bl.m].users > 0) {
+			tc->active_tick = tick;
+			continue;
+		}
+
+		if (DIFF_TICK(tick, tc->active_tick) >= AT_HIBERNATE_IDLE && !hibernate_clone(tc))
+			break; // Page file unusable for now
+	}
+	dbi_destroy(iter);
+
+	return 0;
+}
+
+/**
+ * Creates the page file, its previous content belonged to clones of the previous run
+ */
+static void hibernate_init(void)
+{
+	hibernate.prefetch_timer = INVALID_TIMER;
+	CREATE(hibernate.maps, int, map->count);
+
+	if ((hibernate.fp = fopen(AT_HIBERNATE_FILE, "w+b")) == NULL) {
+		ShowError("[at2] Could not open page file '%s', clones won't hibernate\n", AT_HIBERNATE_FILE);
+		return;
+	}
+
+	hibernate.timer = timer->add_interval(timer->gettick() + AT_HIBERNATE_INTERVAL, hibernate_timer, 0, 0, AT_HIBERNATE_INTERVAL);
+}
+
+/**
+ * Closes and removes the page file. Every hibernated clone must have been freed or woken up.
+ */
+static void hibernate_final(void)
+{
+	if (hibernate.timer != INVALID_TIMER)
+		timer->delete(hibernate.timer, hibernate_timer);
+	hibernate.timer = INVALID_TIMER;
+	if (hibernate.prefetch_timer != INVALID_TIMER)
+		timer->delete(hibernate.prefetch_timer, hibernate_prefetch_timer);
+	hibernate.prefetch_timer = INVALID_TIMER;
+
+	if (hibernate.fp != NULL) {
+		fclose(hibernate.fp);
+		hibernate.fp = NULL;
+		remove(AT_HIBERNATE_FILE);
+	}
+
+	if (hibernate.free != NULL)
+		aFree(hibernate.free);
+	if (hibernate.prefetch != NULL)
+		aFree(hibernate.prefetch);
+	if (hibernate.maps != NULL)
+		aFree(hibernate.maps);
+	hibernate.free = hibernate.prefetch = hibernate.maps = NULL;
+}
+#endif
+
+#ifdef AT_SALES_RING
+/**
+ * Snapshots the shop of a clone about to trade with another player
+ */
+static void sales_scan_begin(struct map_session_data* vsd, struct map_session_data* other, enum trade_type type)
+{
+	struct at_sale_scan* scan = &sales.scan;
+	struct trade_clone* tc = vsd != NULL ? sd2tc(vsd) : NULL;
+
+	scan->char_id = 0;
+	if (tc == NULL || tc->type != type || other == NULL)
+		return;
+
+	scan->char_id = tc->char_id;
+	scan->gen = tc->persist_gen;
+	scan->other_id = other->status.char_id;
+	scan->m = tc->md->bl.m;
+	scan->type = type;
+	scan->count = 0;
+
+	if (type == TD_VC) {
+		for (int i = 0; i < vsd->vend_num; i++) {
+			const struct item* it = &vsd->status.cart[vsd->vending[i].index];
+			struct at_sale_entry* e = &scan->entries[scan->count++];
+
+			e->key = vsd->vending[i].index;
+			e->nameid = it->nameid;
+			e->refine = it->refine;
+			e->amount = vsd->vending[i].amount;
+			e->price = vsd->vending[i].value;
+		}
+	} else {
+		for (int i = 0; i < vsd->buyingstore.slots; i++) {
+			const struct s_buyingstore_item* it = &vsd->buyingstore.items[i];
+			struct at_sale_entry* e = &scan->entries[scan->count++];
+
+			e->key = it->nameid;
+			e->nameid = it->nameid;
+			e->refine = 0;
+			e->amount = it->amount;
+			e->price = it->price;
+		}
+	}
+}
+
+/**
+ * Records what the scanned clone sold or bought during the trade
+ */
+static void sales_scan_end(void)
+{
+	struct at_sale_scan* scan = &sales.scan;
+
+	if (scan->char_id == 0)
+		return;
+
+	struct trade_clone* tc = idb_get(clone_db, scan->char_id);
+	if (tc != NULL && tc->persist_gen != scan->gen)
+		tc = NULL;
+
+	// Vending clones are only removed once sold out, a closed buying store leaves nothing to compare with
+	if (tc != NULL || scan->type == TD_VC) {
+		for (int i = 0; i < scan->count; i++) {
+			const struct at_sale_entry* e = &scan->entries[i];
+			int left = tc != NULL ? sales_left(tc, scan->type, e->key) : 0;
+
+			if (left < e->amount)
+				sales_record(scan, e, e->amount - left);
+		}
+	}
+
+	scan->char_id = 0;
+}
+
+/**
+ * Amount a clone still sells or buys of a shop entry
+ */
+static int sales_left(struct trade_clone* tc, enum trade_type type, int key)
+{
+	struct map_session_data* sd = tc->sd;
+
+	if (type == TD_VC) {
+		const struct s_vending* vending = sd != NULL ? sd->vending : clone_payload(tc)->vending;
+		int vend_num = sd != NULL ? sd->vend_num : tc->payload->vend_num;
+
+		for (int i = 0; i < vend_num; i++) {
+			if (vending[i].index == key)
+				return vending[i].amount;
+		}
+	} else {
+		const struct s_buyingstore* buyingstore = sd != NULL ? &sd->buyingstore : &clone_payload(tc)->buyingstore;
+
+		for (int i = 0; i < buyingstore->slots; i++) {
+			if (buyingstore->items[i].nameid == key)
+				return buyingstore->items[i].amount;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Appends a sale event to the ring
+ */
+static void sales_record(const struct at_sale_scan* scan, const struct at_sale_entry* e, int amount)
+{
+	struct at_sale* sale = &sales.ring[sales.seq++ % AT_SALES_RING];
+
+	sale->tick = timer->gettick();
+	sale->time = time(NULL);
+	sale->nameid = e->nameid;
+	sale->refine = e->refine;
+	sale->amount = amount;
+	sale->price = e->price;
+	sale->clone_id = scan->char_id;
+	sale->other_id = scan->other_id;
+	sale->m = scan->m;
+	sale->type = (uint8)scan->type;
+}
+
+/**
+ * Hands the events recorded since the last flush to the writer
+ */
+static int sales_flush_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	int64 pending = sales.seq - sales.flushed;
+
+	if (pending == 0)
+		return 0;
+
+	if (pending > AT_SALES_RING) { // Ring wrapped over unflushed events
+		sales.dropped += pending - AT_SALES_RING;
+		sales.flushed = sales.seq - AT_SALES_RING;
+		pending = AT_SALES_RING;
+	}
+
+	struct at_persist_sales* batch;
+	CREATE(batch, struct at_persist_sales, 1);
+	batch->count = (int)pending;
+	CREATE(batch->events, struct at_sale, batch->count);
+	for (int i = 0; i < batch->count; i++)
+		batch->events[i] = sales.ring[(sales.flushed + i) % AT_SALES_RING];
+	sales.flushed = sales.seq;
+
+	persist_push_sales(batch);
+	return 0;
+}
+
+/**
+ * Orders sale events by item, side and price
+ */
+static int sales_compare(const void* a, const void* b)
+{
+	const struct at_sale* sa = a;
+	const struct at_sale* sb = b;
+
+	if (sa->nameid != sb->nameid)
+		return sa->nameid < sb->nameid ? -1 : 1;
+	if (sa->type != sb->type)
+		return sa->type < sb->type ? -1 : 1;
+	if (sa->price != sb->price)
+		return sa->price < sb->price ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Orders @marketstats summaries by volume, highest first
+ */
+static int market_item_compare(const void* a, const void* b)
+{
+	const struct at_market_item* ia = a;
+	const struct at_market_item* ib = b;
+
+	if (ia->volume != ib->volume)
+		return ia->volume > ib->volume ? -1 : 1;
+	return ia->nameid - ib->nameid;
+}
+
+/**
+ * Queues sale events to be written
+ */
+static void persist_push_sales(struct at_persist_sales* batch)
+{
+	struct at_persist* p;
+
+#ifdef AT_PERSIST_THREAD
+	if (persist.worker != NULL)
+		mutex->lock(persist.lock);
+#endif
+
+	CREATE(p, struct at_persist, 1);
+	p->sales = batch;
+	persist_enqueue(p);
+
+#ifdef AT_PERSIST_THREAD
+	if (persist.worker != NULL) {
+		mutex->cond_signal(persist.wake);
+		mutex->unlock(persist.lock);
+	}
+#endif
+}
+
+/**
+ * Appends sale events to the sales table in one transaction, AT_SALES_BATCH rows per statement
+ */
+static bool persist_write_sales(struct Sql* sql_handle, const struct at_persist_sales* batch)
+{
+	char map_name[MAP_NAME_LENGTH_EXT * 2 + 1];
+	bool result = true;
+	StringBuf buf;
+
+	if (SQL_ERROR == SQL->QueryStr(sql_handle, "START TRANSACTION")) {
+		Sql_ShowDebug(sql_handle);
+		return false;
+	}
+
+	StrBuf->Init(&buf);
+	for (int i = 0; i < batch->count && result; i += AT_SALES_BATCH) {
+		int end = min(i + AT_SALES_BATCH, batch->count);
+
+		StrBuf->Clear(&buf);
+		StrBuf->Printf(&buf, "INSERT INTO `%s` (`time`, `type`, `map`, `clone_id`, `other_id`, `nameid`, `refine`, `amount`, `price`) VALUES", sales_db);
+		for (int j = i; j < end; j++) {
+			const struct at_sale* sale = &batch->events[j];
+
+			SQL->EscapeStringLen(sql_handle, map_name, map->list[sale->m].name, strnlen(map->list[sale->m].name, MAP_NAME_LENGTH_EXT));
+			StrBuf->Printf(&buf, "%s (FROM_UNIXTIME('%"PRId64"'), '%d', '%s', '%d', '%d', '%d', '%d', '%d', '%d')", j == i ? "" : ",",
+				(int64)sale->time, sale->type, map_name, sale->clone_id, sale->other_id, sale->nameid, sale->refine, sale->amount, sale->price);
+		}
+
+		if (SQL_ERROR == SQL->QueryStr(sql_handle, StrBuf->Value(&buf))) {
+			Sql_ShowDebug(sql_handle);
+			result = false;
+		}
+	}
+	StrBuf->Destroy(&buf);
+
+	if (SQL_ERROR == SQL->QueryStr(sql_handle, result ? "COMMIT" : "ROLLBACK")) {
+		Sql_ShowDebug(sql_handle);
+		result = false;
+	}
+
+	return result;
+}
+
+/**
+ * vending->purchasereq prehook
+ *
+ * Snapshot the vending clone being bought from
+ */
+static void vending_purchasereq_pre(struct map_session_data** sd, int* aid, unsigned int* uid, const uint8** data, int* count)
+{
+	sales_scan_begin(map->id2sd(*aid), *sd, TD_VC);
+}
+
+/**
+ * vending->purchasereq posthook
+ *
+ * Record what the clone sold. A sold out clone is already gone.
+ */
+static void vending_purchasereq_post(struct map_session_data* sd, int aid, unsigned int uid, const uint8* data, int count)
+{
+	sales_scan_end();
+}
+
+/**
+ * buyingstore->trade prehook
+ *
+ * Snapshot the buying store clone being sold to
+ */
+static void buyingstore_trade_pre(struct map_session_data** sd, int* account_id, unsigned int* buyer_id, const uint8** itemlist, unsigned int* count)
+{
+	sales_scan_begin(map->id2sd(*account_id), *sd, TD_BC);
+}
+
+/**
+ * buyingstore->trade posthook
+ *
+ * Record what the clone bought
+ */
+static void buyingstore_trade_post(struct map_session_data* sd, int account_id, unsigned int buyer_id, const uint8* itemlist, unsigned int count)
+{
+	sales_scan_end();
+}
+#endif
+
+/**
+ * Saves clone's zeny into database
+ */
+static bool save_zeny(struct at_persist_stmts* stmts, const struct at_persist* p)
+{
+	if (stmts->zeny == NULL)
+		return false;
+
+	stmts->zeny_value = p->zeny;
+	stmts->account_id = p->account_id;
+	stmts->char_id = p->char_id;
+	if (SQL_ERROR == SQL->StmtExecute(stmts->zeny)) {
+		SqlStmt_ShowDebug(stmts->zeny);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Removes clone's timeout from database
+ */
+static bool delete_timeout(struct at_persist_stmts* stmts, const struct at_persist* p)
+{
+	if (stmts->timeout_del == NULL)
+		return false;
+
+	stmts->account_id = p->account_id;
+	stmts->char_id = p->char_id;
+	if (SQL_ERROR == SQL->StmtExecute(stmts->timeout_del)) {
+		SqlStmt_ShowDebug(stmts->timeout_del);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Replaces the persisted buying store of a clone, items included.
+ * Runs inside the transaction of the save.
+ */
+static bool save_buyer(struct at_persist_stmts* stmts, const struct at_persist* p)
+{
+	const struct at_persist_buyer* b = p->buyer;
+
+	if (b == NULL) { // Carried over without its data (see persist_collect), keep retrying rather than losing it
+		ShowError("[at2] Buying store save of clone %d has no data\n", p->char_id);
+		return false;
+	}
+
+	if (stmts->buyer_replace == NULL || stmts->buyer_items_delete == NULL || stmts->buyer_item_insert == NULL)
+		return false;
+
+	memcpy(&stmts->buyer, b, sizeof(stmts->buyer));
+	stmts->account_id = p->account_id;
+	stmts->char_id = p->char_id;
+
+	if (SQL_ERROR == SQL->StmtBindParam(stmts->buyer_replace, 3, SQLDT_STRING, stmts->buyer.title, strnlen(stmts->buyer.title, MESSAGE_SIZE))
+		|| SQL_ERROR == SQL->StmtExecute(stmts->buyer_replace)) {
+		SqlStmt_ShowDebug(stmts->buyer_replace);
+		return false;
+	}
+
+	if (SQL_ERROR == SQL->StmtExecute(stmts->buyer_items_delete)) {
+		SqlStmt_ShowDebug(stmts->buyer_items_delete);
+		return false;
+	}
+
+	for (int i = 0; i < b->buyingstore.slots; i++) {
+		stmts->buyer_item = b->buyingstore.items[i];
+		if (SQL_ERROR == SQL->StmtExecute(stmts->buyer_item_insert)) {
+			SqlStmt_ShowDebug(stmts->buyer_item_insert);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Removes the persisted buying store of a clone
+ */
+static bool delete_buyer(struct at_persist_stmts* stmts, int char_id)
+{
+	if (stmts->buyer_items_delete == NULL || stmts->buyer_delete == NULL)
+		return false;
+
+	stmts->char_id = char_id;
+	if (SQL_ERROR == SQL->StmtExecute(stmts->buyer_items_delete)) {
+		SqlStmt_ShowDebug(stmts->buyer_items_delete);
+		return false;
+	}
+	if (SQL_ERROR == SQL->StmtExecute(stmts->buyer_delete)) {
+		SqlStmt_ShowDebug(stmts->buyer_delete);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Writes the remaining time or removes the autotrade status of many clones in one transaction,
+ * AT_SCHED_BATCH clones per statement
+ */
+static bool persist_write_batch(struct Sql* sql_handle, const struct at_persist_batch* batch)
+{
+	bool result = true;
+	StringBuf buf;
+
+	if (SQL_ERROR == SQL->QueryStr(sql_handle, "START TRANSACTION")) {
+		Sql_ShowDebug(sql_handle);
+		return false;
+	}
+
+	StrBuf->Init(&buf);
+	for (int i = 0; i < batch->count && result; i += AT_SCHED_BATCH) {
+		int end = min(i + AT_SCHED_BATCH, batch->count);
+
+		StrBuf->Clear(&buf);
+		if (batch->remove) {
+			StrBuf->Printf(&buf, "DELETE FROM `%s`", sc_data_db);
+		} else {
+			StrBuf->Printf(&buf, "UPDATE `%s` SET `tick` = CASE `char_id`", sc_data_db);
+			for (int j = i; j < end; j++)
+				StrBuf->Printf(&buf, " WHEN '%d' THEN '%d'", batch->char_ids[j], batch->ticks[j]);
+			StrBuf->AppendStr(&buf, " ELSE `tick` END");
+		}
+
+		StrBuf->Printf(&buf, " WHERE `type` = '%d' AND `char_id` IN (", SC_AUTOTRADE);
+		for (int j = i; j < end; j++)
+			StrBuf->Printf(&buf, "%s'%d'", j == i ? "" : ", ", batch->char_ids[j]);
+		StrBuf->AppendStr(&buf, ")");
+
+		if (SQL_ERROR == SQL->QueryStr(sql_handle, StrBuf->Value(&buf))) {
+			Sql_ShowDebug(sql_handle);
+			result = false;
+		}
+	}
+	StrBuf->Destroy(&buf);
+
+	if (SQL_ERROR == SQL->QueryStr(sql_handle, result ? "COMMIT" : "ROLLBACK")) {
+		Sql_ShowDebug(sql_handle);
+		result = false;
+	}
+
+	return result;
+}
+
+/**
+ * Opens a new connection to the map server database
+ */
+static struct Sql* at_sql_connect(void)
+{
+	struct Sql* sql_handle = SQL->Malloc();
+
+	if (SQL_ERROR == SQL->Connect(sql_handle, map->map_server_id, map->map_server_pw, map->map_server_ip, map->map_server_port, map->map_server_db)) {
+		Sql_ShowDebug(sql_handle);
+		SQL->Free(sql_handle);
+		return NULL;
+	}
+
+	if (map->default_codepage[0] != '\0' && SQL_ERROR == SQL->SetEncoding(sql_handle, map->default_codepage))
+		Sql_ShowDebug(sql_handle);
+
+	return sql_handle;
+}
+
+/**
+ * Allocates and prepares a statement, NULL on failure
+ */
+static struct SqlStmt* persist_stmt(struct Sql* sql_handle, const char* query)
+{
+	struct SqlStmt* stmt = SQL->StmtMalloc(sql_handle);
+
+	if (stmt != NULL && SQL_ERROR == SQL->StmtPrepareStr(stmt, query)) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		stmt = NULL;
+	}
+
+	return stmt;
+}
+
+/**
+ * Prepares the statements reused by every save and binds their parameters.
+ * Writes using a statement that failed to prepare are reported as failed.
+ */
+static bool persist_prepare(struct Sql* sql_handle, struct at_persist_stmts* stmts)
+{
+	struct SqlStmt* stmt;
+	bool result = true;
+	StringBuf buf;
+
+	StrBuf->Init(&buf);
+	for (int i = 0; i < AT_TABLE_MAX; i++) {
+		const char* tablename = i == AT_TABLE_INVENTORY ? inventory_db : cart_db;
+		bool has_favorite = i == AT_TABLE_INVENTORY;
+		int values = 10 + MAX_SLOTS + MAX_ITEM_OPTIONS * 2 + (has_favorite ? 1 : 0); // item_value_columns
+
+		StrBuf->Clear(&buf);
+		StrBuf->Printf(&buf, "INSERT INTO `%s` (`char_id`, ", tablename);
+		item_value_columns(&buf, has_favorite);
+		StrBuf->AppendStr(&buf, ") VALUES (?");
+		for (int j = 0; j < values; j++)
+			StrBuf->AppendStr(&buf, ", ?");
+		StrBuf->AppendStr(&buf, ")");
+		if ((stmt = persist_stmt(sql_handle, StrBuf->Value(&buf))) != NULL
+			&& (SQL_ERROR == SQL->StmtBindParam(stmt, 0, SQLDT_INT, &stmts->char_id, sizeof stmts->char_id)
+			|| !item_bindparams(stmt, 1, &stmts->item, has_favorite))) {
+			SqlStmt_ShowDebug(stmt);
+			SQL->StmtFree(stmt);
+			stmt = NULL;
+		}
+		stmts->item_insert[i] = stmt;
+
+		// Same columns with the row id in front
+		StrBuf->Clear(&buf);
+		StrBuf->Printf(&buf, "REPLACE INTO `%s` (`id`, `char_id`, ", tablename);
+		item_value_columns(&buf, has_favorite);
+		StrBuf->AppendStr(&buf, ") VALUES (?, ?");
+		for (int j = 0; j < values; j++)
+			StrBuf->AppendStr(&buf, ", ?");
+		StrBuf->AppendStr(&buf, ")");
+		if ((stmt = persist_stmt(sql_handle, StrBuf->Value(&buf))) != NULL
+			&& (SQL_ERROR == SQL->StmtBindParam(stmt, 0, SQLDT_INT, &stmts->row, sizeof stmts->row)
+			|| SQL_ERROR == SQL->StmtBindParam(stmt, 1, SQLDT_INT, &stmts->char_id, sizeof stmts->char_id)
+			|| !item_bindparams(stmt, 2, &stmts->item, has_favorite))) {
+			SqlStmt_ShowDebug(stmt);
+			SQL->StmtFree(stmt);
+			stmt = NULL;
+		}
+		stmts->item_update[i] = stmt;
+
+		StrBuf->Clear(&buf);
+		StrBuf->Printf(&buf, "DELETE FROM `%s` WHERE `char_id` = ? AND `id` = ?", tablename);
+		if ((stmt = persist_stmt(sql_handle, StrBuf->Value(&buf))) != NULL
+			&& (SQL_ERROR == SQL->StmtBindParam(stmt, 0, SQLDT_INT, &stmts->char_id, sizeof stmts->char_id)
+			|| SQL_ERROR == SQL->StmtBindParam(stmt, 1, SQLDT_INT, &stmts->row, sizeof stmts->row))) {
+			SqlStmt_ShowDebug(stmt);
+			SQL->StmtFree(stmt);
+			stmt = NULL;
+		}
+		stmts->item_delete[i] = stmt;
+
+		result &= stmts->item_insert[i] != NULL && stmts->item_update[i] != NULL && stmts->item_delete[i] != NULL;
+	}
+
+	StrBuf->Clear(&buf);
+	StrBuf->Printf(&buf, "UPDATE `%s` SET `zeny` = ? WHERE `account_id` = ? AND `char_id` = ?", character_db);
+	if ((stmt = persist_stmt(sql_handle, StrBuf->Value(&buf))) != NULL
+		&& (SQL_ERROR == SQL->StmtBindParam(stmt, 0, SQLDT_INT, &stmts->zeny_value, sizeof stmts->zeny_value)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, 1, SQLDT_INT, &stmts->account_id, sizeof stmts->account_id)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, 2, SQLDT_INT, &stmts->char_id, sizeof stmts->char_id))) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		stmt = NULL;
+	}
+	stmts->zeny = stmt;
+
+	StrBuf->Clear(&buf);
+	StrBuf->Printf(&buf, "DELETE FROM `%s` WHERE `account_id` = ? AND `char_id` = ? AND `type` = '%d'", sc_data_db, SC_AUTOTRADE);
+	if ((stmt = persist_stmt(sql_handle, StrBuf->Value(&buf))) != NULL
+		&& (SQL_ERROR == SQL->StmtBindParam(stmt, 0, SQLDT_INT, &stmts->account_id, sizeof stmts->account_id)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, 1, SQLDT_INT, &stmts->char_id, sizeof stmts->char_id))) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		stmt = NULL;
+	}
+	stmts->timeout_del = stmt;
+
+	StrBuf->Clear(&buf);
+	StrBuf->Printf(&buf, "REPLACE INTO `%s` (`account_id`, `char_id`, `sex`, `title`, `limit`, `max_weight`, `inventory_size`) "
+		"VALUES (?, ?, ?, ?, ?, ?, ?)", buyers_db);
+	if ((stmt = persist_stmt(sql_handle, StrBuf->Value(&buf))) != NULL
+		&& (SQL_ERROR == SQL->StmtBindParam(stmt, 0, SQLDT_INT, &stmts->account_id, sizeof stmts->account_id)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, 1, SQLDT_INT, &stmts->char_id, sizeof stmts->char_id)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, 2, SQLDT_INT, &stmts->buyer.sex, sizeof stmts->buyer.sex)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, 4, SQLDT_UINT, &stmts->buyer.buyingstore.zenylimit, sizeof stmts->buyer.buyingstore.zenylimit)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, 5, SQLDT_INT, &stmts->buyer.max_weight, sizeof stmts->buyer.max_weight)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, 6, SQLDT_INT, &stmts->buyer.inventory_size, sizeof stmts->buyer.inventory_size))) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		stmt = NULL;
+	}
+	stmts->buyer_replace = stmt;
+
+	StrBuf->Clear(&buf);
+	StrBuf->Printf(&buf, "DELETE FROM `%s` WHERE `char_id` = ?", buyers_data_db);
+	if ((stmt = persist_stmt(sql_handle, StrBuf->Value(&buf))) != NULL
+		&& SQL_ERROR == SQL->StmtBindParam(stmt, 0, SQLDT_INT, &stmts->char_id, sizeof stmts->char_id)) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		stmt = NULL;
+	}
+	stmts->buyer_items_delete = stmt;
+
+	StrBuf->Clear(&buf);
+	StrBuf->Printf(&buf, "INSERT INTO `%s` (`char_id`, `nameid`, `amount`, `price`) VALUES (?, ?, ?, ?)", buyers_data_db);
+	if ((stmt = persist_stmt(sql_handle, StrBuf->Value(&buf))) != NULL
+		&& (SQL_ERROR == SQL->StmtBindParam(stmt, 0, SQLDT_INT, &stmts->char_id, sizeof stmts->char_id)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, 1, SQLDT_INT, &stmts->buyer_item.nameid, sizeof stmts->buyer_item.nameid)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, 2, SQLDT_USHORT, &stmts->buyer_item.amount, sizeof stmts->buyer_item.amount)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, 3, SQLDT_INT, &stmts->buyer_item.price, sizeof stmts->buyer_item.price))) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		stmt = NULL;
+	}
+	stmts->buyer_item_insert = stmt;
+
+	StrBuf->Clear(&buf);
+	StrBuf->Printf(&buf, "DELETE FROM `%s` WHERE `char_id` = ?", buyers_db);
+	if ((stmt = persist_stmt(sql_handle, StrBuf->Value(&buf))) != NULL
+		&& SQL_ERROR == SQL->StmtBindParam(stmt, 0, SQLDT_INT, &stmts->char_id, sizeof stmts->char_id)) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		stmt = NULL;
+	}
+	stmts->buyer_delete = stmt;
+	StrBuf->Destroy(&buf);
+
+	return result && stmts->zeny != NULL && stmts->timeout_del != NULL && stmts->buyer_replace != NULL
+		&& stmts->buyer_items_delete != NULL && stmts->buyer_item_insert != NULL && stmts->buyer_delete != NULL;
+}
+
+/**
+ * Frees the prepared save statements
+ */
+static void persist_unprepare(struct at_persist_stmts* stmts)
+{
+	for (int i = 0; i < AT_TABLE_MAX; i++) {
+		if (stmts->item_insert[i] != NULL)
+			SQL->StmtFree(stmts->item_insert[i]);
+		if (stmts->item_update[i] != NULL)
+			SQL->StmtFree(stmts->item_update[i]);
+		if (stmts->item_delete[i] != NULL)
+			SQL->StmtFree(stmts->item_delete[i]);
+	}
+	if (stmts->zeny != NULL)
+		SQL->StmtFree(stmts->zeny);
+	if (stmts->timeout_del != NULL)
+		SQL->StmtFree(stmts->timeout_del);
+	if (stmts->buyer_replace != NULL)
+		SQL->StmtFree(stmts->buyer_replace);
+	if (stmts->buyer_items_delete != NULL)
+		SQL->StmtFree(stmts->buyer_items_delete);
+	if (stmts->buyer_item_insert != NULL)
+		SQL->StmtFree(stmts->buyer_item_insert);
+	if (stmts->buyer_delete != NULL)
+		SQL->StmtFree(stmts->buyer_delete);
+	memset(stmts, 0, sizeof(*stmts));
+}
+
+/**
+ * Opens the dedicated persistence connection and starts the writer
+ */
+static void persist_init(void)
+{
+	if ((persist.sql_handle = at_sql_connect()) == NULL) {
+		ShowError("[at2] Could not open persistence connection, falling back to the map server connection\n");
+		persist.sql_handle = map->mysql_handle;
+	}
+
+	if (!persist_prepare(persist.sql_handle, &persist.stmts))
+		ShowError("[at2] Could not prepare persistence statements, some clone saves will fail\n");
+
+#ifdef AT_PERSIST_THREAD
+	if (persist.sql_handle != map->mysql_handle) {
+		persist.lock = mutex->create();
+		persist.wake = mutex->cond_create();
+		persist.worker = thread->create(persist_worker, NULL);
+		if (persist.worker == NULL)
+			ShowError("[at2] Could not start persistence thread, saves will be written from the main loop\n");
+	}
+#else
+	ShowInfo("[at2] Built with the memory manager, clone saves are written from the main loop\n");
+#endif
+
+	persist.timer = timer->add_interval(timer->gettick() + AT_PERSIST_INTERVAL, persist_timer, 0, 0, AT_PERSIST_INTERVAL);
+}
+
+/**
+ * Stops the writer and flushes every pending save
+ */
+static void persist_final(void)
+{
+	struct at_persist* group[AT_PERSIST_BATCH];
+	int count;
+
+	if (persist.sql_handle == NULL)
+		return;
+
+	if (persist.timer != INVALID_TIMER)
+		timer->delete(persist.timer, persist_timer);
+	persist.timer = INVALID_TIMER;
+
+#ifdef AT_PERSIST_THREAD
+	if (persist.worker != NULL) {
+		mutex->lock(persist.lock);
+		persist.stop = true;
+		mutex->cond_signal(persist.wake);
+		mutex->unlock(persist.lock);
+		thread->wait(persist.worker, NULL);
+		persist.worker = NULL;
+	}
+#endif
+
+	while ((count = persist_pop_group(group)) > 0) {
+		persist_write_group(persist.sql_handle, group, count);
+		for (int i = 0; i < count; i++)
+			persist_done(group[i]);
+	}
+	persist_collect();
+	persist_unprepare(&persist.stmts);
+
+#ifdef AT_PERSIST_THREAD
+	if (persist.lock != NULL) {
+		mutex->cond_destroy(persist.wake);
+		mutex->destroy(persist.lock);
+	}
+#endif
+
+	if (persist.sql_handle != map->mysql_handle)
+		SQL->Free(persist.sql_handle);
+	persist.sql_handle = NULL;
+}
+
+/**
+ * Snapshots clone data into its pending save.
+ * A save still waiting in the queue is updated in place so only the newest state gets written.
+ */
+static void persist_push(struct trade_clone* tc, unsigned int flags)
+{
+	if (tc->lost) { // Never overwrite the last good save, removals still go through
+		flags &= AT_PERSIST_TIMEOUT_DEL | AT_PERSIST_BUYER_DEL;
+		if (flags == 0)
+			return;
+	}
+
+	if (tc->handoff.state != AT_HANDOFF_NONE) { // Would race the player's final save
+		tc->handoff.held |= flags;
+		return;
+	}
+
+	clone_sync(tc);
+
+#ifdef AT_PERSIST_THREAD
+	if (persist.worker != NULL)
+		mutex->lock(persist.lock);
+#endif
+
+	struct at_persist* p = idb_get(persist_db, tc->char_id);
+	if (p == NULL || !p->queued || p->gen != tc->persist_gen) { // None pending, already being written or from a removed clone
+		CREATE(p, struct at_persist, 1);
+		p->char_id = tc->char_id;
+		p->gen = tc->persist_gen;
+		idb_put(persist_db, p->char_id, p);
+		persist_enqueue(p);
+	}
+
+	p->account_id = tc->account_id;
+	p->type = tc->type;
+	p->zeny = tc->zeny;
+	p->retries = 0;
+
+	if (flags & AT_PERSIST_ITEMS) {
+		for (int i = 0; i < AT_TABLE_MAX; i++)
+			persist_items(tc, p, i);
+	}
+
+	if (flags & AT_PERSIST_BUYER) {
+		if (p->buyer == NULL)
+			CREATE(p->buyer, struct at_persist_buyer, 1);
+		p->buyer->sex = tc->sex;
+		safestrncpy(p->buyer->title, tc->message, MESSAGE_SIZE);
+		p->buyer->max_weight = tc->max_weight;
+		p->buyer->inventory_size = tc->inventory_size;
+		memcpy(&p->buyer->buyingstore, &clone_payload(tc)->buyingstore, sizeof(struct s_buyingstore));
+		p->flags &= ~AT_PERSIST_BUYER_DEL;
+	}
+	if (flags & AT_PERSIST_BUYER_DEL)
+		p->flags &= ~AT_PERSIST_BUYER;
+
+	p->flags |= flags;
+
+#ifdef AT_PERSIST_THREAD
+	if (persist.worker != NULL) {
+		mutex->cond_signal(persist.wake);
+		mutex->unlock(persist.lock);
+	}
+#endif
+}
+
+/**
+ * Queues a batch of scheduler writes. The batch is owned by the queue afterwards.
+ */
+static void persist_push_batch(struct at_persist_batch* batch)
+{
+	struct at_persist* p;
+
+#ifdef AT_PERSIST_THREAD
+	if (persist.worker != NULL)
+		mutex->lock(persist.lock);
+#endif
+
+	CREATE(p, struct at_persist, 1);
+	p->batch = batch;
+	persist_enqueue(p);
+
+#ifdef AT_PERSIST_THREAD
+	if (persist.worker != NULL) {
+		mutex->cond_signal(persist.wake);
+		mutex->unlock(persist.lock);
+	}
+#endif
+}
+
+/**
+ * Snapshots the slots of a cart or inventory changed since the last save (queue lock must be held).
+ * Falls back to a whole table snapshot while the persisted state is unknown.
+ */
+static void persist_items(struct trade_clone* tc, struct at_persist* p, enum at_table table)
+{
+	struct at_item_state* state = tc->items[table];
+	if (state == NULL) // No inventory for vending, it is not recovered in persistence mode
+		return;
+
+	struct at_payload* payload = clone_payload(tc);
+	const struct item* items = table == AT_TABLE_CART ? payload->cart : payload->inventory;
+	int max = table == AT_TABLE_CART ? MAX_CART : MAX_INVENTORY;
+	struct at_persist_items* pi = p->items[table];
+
+	if (pi == NULL) {
+		CREATE(pi, struct at_persist_items, 1);
+		p->items[table] = pi;
+	}
+
+#if AT_PERSIST_RECONCILE > 0
+	if (!state->reconcile && state->pending == 0 && ++state->saves % AT_PERSIST_RECONCILE == 0) {
+		state->reconcile = true;
+		pi->verify = !pi->full && pi->ops == 0;
+	}
+#endif
+
+	if (pi->full || state->reconcile || state->pending > 0) {
+		if (!pi->full) {
+			pi->full = true;
+			state->pending++;
+		}
+		state->reconcile = false;
+		memcpy(pi->item, items, sizeof(struct item) * max);
+		memset(state->dirty, 0, sizeof(state->dirty));
+		return;
+	}
+
+	for (int w = 0; w < ARRAYLENGTH(state->dirty); w++) {
+		if (state->dirty[w] == 0)
+			continue;
+
+		for (int i = w * 32; i < (w + 1) * 32 && i < max; i++) {
+			uint32 bit = 1U << (i % 32);
+			if ((state->dirty[w] & bit) && persist_item_op(state, pi, &items[i], i))
+				state->dirty[w] &= ~bit;
+		}
+	}
+}
+
+/**
+ * Turns a dirty slot into a row write against its last persisted contents.
+ * Returns false if the slot has to wait for the row id of an insert in flight.
+ */
+static bool persist_item_op(struct at_item_state* state, struct at_persist_items* pi, const struct item* it, int i)
+{
+	struct item* saved = &state->saved[i];
+	if (saved->id < 0)
+		return false;
+
+	struct item cur = *it;
+	cur.id = saved->id;
+	if ((it->nameid == 0 && saved->nameid == 0) || memcmp(&cur, saved, sizeof(cur)) == 0)
+		return true;
+
+	if (it->nameid == 0) {
+		pi->op[i] = AT_OP_DELETE;
+		pi->row[i] = saved->id;
+		memset(saved, 0, sizeof(*saved));
+	} else if (saved->nameid == 0 && pi->op[i] != AT_OP_DELETE) {
+		pi->op[i] = AT_OP_INSERT;
+		pi->row[i] = 0;
+		*saved = *it;
+		saved->id = -1;
+	} else { // Same row, or the row of a deletion still pending in this save
+		if (saved->nameid != 0)
+			pi->row[i] = saved->id;
+		pi->op[i] = AT_OP_UPDATE;
+		*saved = *it;
+		saved->id = pi->row[i];
+	}
+
+	pi->item[i] = *it;
+	pi->ops++;
+	return true;
+}
+
+/**
+ * Flags changed slots of a clone's cart or inventory, n < 0 flags the whole table
+ */
+static void persist_dirty(struct map_session_data* sd, enum at_table table, int n)
+{
+	struct trade_clone* tc = sd2tc(sd);
+	if (tc == NULL)
+		return;
+
+#ifdef AT_JOURNAL_FILE
+	journal_touch(tc, AT_JOURNAL_TABLE(table));
+#endif
+	if (tc->items[table] == NULL)
+		return;
+
+	struct at_item_state* state = tc->items[table];
+	int max = table == AT_TABLE_CART ? MAX_CART : MAX_INVENTORY;
+
+	if (n >= max)
+		return;
+
+	for (int i = n < 0 ? 0 : n; i < (n < 0 ? max : n + 1); i++)
+		state->dirty[i / 32] |= 1U << (i % 32);
+}
+
+/**
+ * Creates the persisted state of a clone's cart or inventory.
+ * Rows of items loaded from the database are known, otherwise the first save reconciles the table.
+ */
+static struct at_item_state* item_state_create(const struct item* items, int max, bool known)
+{
+	struct at_item_state* state;
+	CREATE(state, struct at_item_state, 1);
+
+	if (known)
+		memcpy(state->saved, items, sizeof(struct item) * max);
+	state->reconcile = !known;
+
+	return state;
+}
+
+/**
+ * Releases the persisted state of a clone's cart and inventory
+ */
+static void item_state_free(struct trade_clone* tc)
+{
+	for (int i = 0; i < AT_TABLE_MAX; i++) {
+		if (tc->items[i] != NULL)
+			aFree(tc->items[i]);
+		tc->items[i] = NULL;
+	}
+}
+
+/**
+ * Appends a save to the queue (queue lock must be held)
+ */
+static void persist_enqueue(struct at_persist* p)
+{
+	p->queued = true;
+	p->next = NULL;
+	if (persist.tail != NULL)
+		persist.tail->next = p;
+	else
+		persist.head = p;
+	persist.tail = p;
+}
+
+/**
+ * Takes the oldest save from the queue (queue lock must be held)
+ */
+static struct at_persist* persist_pop(void)
+{
+	struct at_persist* p = persist.head;
+	if (p == NULL)
+		return NULL;
+
+	persist.head = p->next;
+	if (persist.head == NULL)
+		persist.tail = NULL;
+
+	p->queued = false;
+	p->next = NULL;
+	return p;
+}
+
+/**
+ * Takes up to AT_PERSIST_BATCH of the oldest saves from the queue (queue lock must be held)
+ */
+static int persist_pop_group(struct at_persist** group)
+{
+	int count = 0;
+
+	while (count < AT_PERSIST_BATCH && (group[count] = persist_pop()) != NULL)
+		count++;
+
+	return count;
+}
+
+/**
+ * Hands a written save back to the main thread (queue lock must be held)
+ */
+static void persist_done(struct at_persist* p)
+{
+	p->next = NULL;
+	if (persist.done_tail != NULL)
+		persist.done_tail->next = p;
+	else
+		persist.done = p;
+	persist.done_tail = p;
+}
+
+/**
+ * Writes a save into database, flagging any failed write
+ */
+static void persist_write(struct Sql* sql_handle, struct at_persist* p)
+{
+	p->failed = 0;
+	p->commit = false;
+
+	if (p->batch != NULL) {
+		if (!persist_write_batch(sql_handle, p->batch))
+			p->failed = ~0U; // Rolled back as a whole
+		else
+			p->commit = true;
+		return;
+	}
+
+#ifdef AT_SALES_RING
+	if (p->sales != NULL) {
+		if (!persist_write_sales(sql_handle, p->sales))
+			p->failed = ~0U;
+		else
+			p->commit = true;
+		return;
+	}
+#endif
+
+	if (p->flags & AT_PERSIST_ITEMS) {
+		for (int i = 0; i < AT_TABLE_MAX; i++) {
+			if (p->items[i] != NULL && !persist_write_items(sql_handle, p->items[i], i, p->char_id))
+				p->failed |= AT_PERSIST_ITEMS;
+		}
+	}
+
+	if ((p->flags & AT_PERSIST_ZENY) && !save_zeny(&persist.stmts, p))
+		p->failed |= AT_PERSIST_ZENY;
+
+	if ((p->flags & AT_PERSIST_TIMEOUT_DEL) && !delete_timeout(&persist.stmts, p))
+		p->failed |= AT_PERSIST_TIMEOUT_DEL;
+
+	if ((p->flags & AT_PERSIST_BUYER) && !save_buyer(&persist.stmts, p))
+		p->failed |= AT_PERSIST_BUYER;
+
+	if ((p->flags & AT_PERSIST_BUYER_DEL) && !delete_buyer(&persist.stmts, p->char_id))
+		p->failed |= AT_PERSIST_BUYER_DEL;
+}
+
+/**
+ * Writes popped saves in order. Consecutive clone saves share one transaction,
+ * each one behind a savepoint so a failing save is rolled back alone.
+ * Scheduler batches and sale events run their own transaction in between.
+ */
+static void persist_write_group(struct Sql* sql_handle, struct at_persist** group, int count)
+{
+	int first = -1; // First save of the open transaction
+
+	for (int i = 0; i < count; i++) {
+		struct at_persist* p = group[i];
+
+		if (p->batch != NULL || p->sales != NULL || p->checkpoint) {
+			if (first >= 0)
+				persist_commit(sql_handle, group + first, i - first);
+			first = -1;
+			persist_write(sql_handle, p);
+			continue;
+		}
+
+		if (first < 0) {
+			if (SQL_ERROR == SQL->QueryStr(sql_handle, "START TRANSACTION")) {
+				Sql_ShowDebug(sql_handle);
+				p->failed = p->flags;
+				p->commit = false;
+				continue;
+			}
+			first = i;
+		}
+
+		if (SQL_ERROR == SQL->QueryStr(sql_handle, "SAVEPOINT `at_save`")) {
+			Sql_ShowDebug(sql_handle);
+			p->failed = p->flags;
+			p->commit = false;
+			continue;
+		}
+
+		persist_write(sql_handle, p);
+		if (p->failed != 0) {
+			// Nothing of this save is kept, all of it has to be written again
+			if (SQL_ERROR == SQL->QueryStr(sql_handle, "ROLLBACK TO SAVEPOINT `at_save`"))
+				Sql_ShowDebug(sql_handle);
+			p->failed = p->flags;
+		}
+	}
+
+	if (first >= 0)
+		persist_commit(sql_handle, group + first, count - first);
+}
+
+/**
+ * Commits the transaction holding the given saves, failing all of them if it doesn't go through
+ */
+static void persist_commit(struct Sql* sql_handle, struct at_persist** group, int count)
+{
+	if (SQL_ERROR != SQL->QueryStr(sql_handle, "COMMIT")) {
+		group[count - 1]->commit = true;
+		return;
+	}
+
+	Sql_ShowDebug(sql_handle);
+	if (SQL_ERROR == SQL->QueryStr(sql_handle, "ROLLBACK"))
+		Sql_ShowDebug(sql_handle);
+
+	for (int i = 0; i < count; i++) {
+		if (group[i]->failed == 0)
+			group[i]->failed = group[i]->flags;
+	}
+}
+
+/**
+ * Writes the cart or inventory part of a save
+ */
+static bool persist_write_items(struct Sql* sql_handle, struct at_persist_items* pi, enum at_table table, int guid)
+{
+	enum inventory_table_type type = table == AT_TABLE_CART ? TABLE_CART : TABLE_INVENTORY;
+	int max = table == AT_TABLE_CART ? MAX_CART : MAX_INVENTORY;
+
+	pi->rows_read = pi->rows_written = 0;
+	if (pi->full)
+		return itemdata_reconcile_sql(sql_handle, pi, max, guid, type);
+
+	return itemdata_apply_sql(&persist.stmts, pi, max, guid, table);
+}
+
+/**
+ * Moves the row ids written for a cart or inventory back into the clone and updates the counters
+ */
+static void persist_collect_items(struct trade_clone* tc, struct at_persist* p, enum at_table table)
+{
+	struct at_persist_items* pi = p->items[table];
+	struct at_item_state* state = tc != NULL ? tc->items[table] : NULL;
+	bool failed = (p->failed & AT_PERSIST_ITEMS) != 0;
+	int max = table == AT_TABLE_CART ? MAX_CART : MAX_INVENTORY;
+
+	persist_stats.saves[pi->full]++;
+	persist_stats.rows_read[pi->full] += pi->rows_read;
+	persist_stats.rows_written[pi->full] += pi->rows_written;
+	if (pi->verify && !failed && pi->rows_written > 0) {
+		persist_stats.drift++;
+		ShowWarning("[at2] Reconcile of clone %d fixed %d row(s) missed by incremental saves\n", p->char_id, pi->rows_written);
+	}
+
+	if (state == NULL)
+		return;
+
+	if (pi->full)
+		state->pending--;
+
+	if (failed) { // Unknown which rows made it
+		state->reconcile = true;
+		return;
+	}
+
+	for (int i = 0; i < max; i++) {
+		if (pi->full) {
+			state->saved[i] = pi->item[i];
+			state->saved[i].id = pi->row[i];
+			if (pi->item[i].nameid != 0 && pi->row[i] == 0)
+				state->reconcile = true;
+		} else if (pi->op[i] == AT_OP_INSERT && state->saved[i].id == -1) {
+			state->saved[i].id = pi->row[i];
+		}
+	}
+}
+
+/**
+ * Releases written saves and requeues the failed ones
+ */
+static void persist_collect(void)
+{
+#ifdef AT_PERSIST_THREAD
+	if (persist.worker != NULL)
+		mutex->lock(persist.lock);
+#endif
+
+	struct at_persist* p = persist.done;
+	persist.done = persist.done_tail = NULL;
+
+	while (p != NULL) {
+		struct at_persist* next = p->next;
+
+#ifdef AT_JOURNAL_FILE
+		if (p->checkpoint) {
+			journal_checkpoint_done();
+			persist_free(p);
+			p = next;
+			continue;
+		}
+#endif
+
+		persist_stats.writes++;
+		if (p->commit)
+			persist_stats.commits++;
+
+		if (p->batch != NULL) {
+			if (p->failed != 0 && !p->batch->remove && p->batch->seq != sched.saves) {
+				// Superseded by a newer save, don't write older times over it
+			} else if (p->failed != 0 && ++p->retries <= AT_PERSIST_RETRIES) {
+				ShowWarning("[at2] Failed to write timeouts of %d clones, retrying\n", p->batch->count);
+				persist_enqueue(p);
+				p = next;
+				continue;
+			} else if (p->failed != 0) {
+				ShowError("[at2] Dropping timeouts of %d clones after %d retries\n", p->batch->count, AT_PERSIST_RETRIES);
+			}
+			persist_free(p);
+			p = next;
+			continue;
+		}
+
+#ifdef AT_SALES_RING
+		if (p->sales != NULL) {
+			if (p->failed != 0 && ++p->retries <= AT_PERSIST_RETRIES) {
+				ShowWarning("[at2] Failed to write %d sale events, retrying\n", p->sales->count);
+				persist_enqueue(p);
+				p = next;
+				continue;
+			} else if (p->failed != 0) {
+				ShowError("[at2] Dropping %d sale events after %d retries\n", p->sales->count, AT_PERSIST_RETRIES);
+				sales.lost += p->sales->count;
+			} else {
+				sales.written += p->sales->count;
+			}
+			persist_free(p);
+			p = next;
+			continue;
+		}
+#endif
+
+		struct at_persist* newest = idb_get(persist_db, p->char_id);
+		struct trade_clone* tc = idb_get(clone_db, p->char_id);
+
+		if (tc != NULL && tc->persist_gen != p->gen) // Clone was removed
+			tc = NULL;
+
+		if (p->flags & AT_PERSIST_ITEMS) {
+			for (int i = 0; i < AT_TABLE_MAX; i++) {
+				if (p->items[i] != NULL)
+					persist_collect_items(tc, p, i);
+			}
+		}
+
+		if (p->failed != 0) {
+			struct at_persist* retry = NULL;
+
+			persist_stats.rollbacks++;
+
+#ifdef AT_JOURNAL_FILE
+			journal.failed = true; // Keep the records until it's written
+#endif
+
+			if (newest != p && newest != NULL && newest->queued) {
+				// A newer snapshot is already waiting, let it carry the failed writes
+				unsigned int carried = p->failed & ~AT_PERSIST_TIMEOUT_DEL;
+
+				if (newest->flags & AT_PERSIST_BUYER_DEL) // Store closed since, nothing to write back
+					carried &= ~AT_PERSIST_BUYER;
+				if ((carried & AT_PERSIST_BUYER) && newest->buyer == NULL) { // Hand over the data it needs
+					newest->buyer = p->buyer;
+					p->buyer = NULL;
+				}
+				newest->flags |= carried;
+				retry = newest;
+			} else if (newest == p && ++p->retries <= AT_PERSIST_RETRIES) {
+				ShowWarning("[at2] Failed to save clone %d (flags 0x%x), retrying\n", p->char_id, p->failed);
+				p->flags = p->failed;
+				retry = p;
+			} else if (newest == p) {
+				ShowError("[at2] Dropping save of clone %d after %d retries (flags 0x%x)\n", p->char_id, AT_PERSIST_RETRIES, p->failed);
+			}
+
+			if (retry != NULL && (p->failed & AT_PERSIST_ITEMS)) {
+				// Slot writes can't be replayed safely, resend whole tables instead
+				for (int i = 0; i < AT_TABLE_MAX; i++) {
+					if (retry == p && p->items[i] != NULL) {
+						if (tc == NULL && !p->items[i]->full) {
+							ShowError("[at2] Dropping item save of removed clone %d\n", p->char_id);
+							p->flags &= ~AT_PERSIST_ITEMS;
+							continue;
+						}
+						if (tc != NULL)
+							memset(p->items[i], 0, sizeof(struct at_persist_items));
+					}
+					if (tc != NULL && retry->gen == p->gen)
+						persist_items(tc, retry, i);
+				}
+			}
+
+			if (retry == p && p->flags != 0) {
+				persist_enqueue(p);
+				p = next;
+				continue;
+			}
+		}
+
+		if (newest == p)
+			idb_remove(persist_db, p->char_id);
+#ifdef AT_JOURNAL_FILE
+		if (newest == p && tc == NULL && p->failed == 0)
+			journal_release(p->char_id, p->account_id);
+#endif
+		persist_free(p);
+		p = next;
+	}
+
+#ifdef AT_PERSIST_THREAD
+	if (persist.worker != NULL) {
+		if (persist.head != NULL)
+			mutex->cond_signal(persist.wake);
+		mutex->unlock(persist.lock);
+	}
+#endif
+}
+
+/**
+ * Releases a save
+ */
+static void persist_free(struct at_persist* p)
+{
+	for (int i = 0; i < AT_TABLE_MAX; i++) {
+		if (p->items[i] != NULL)
+			aFree(p->items[i]);
+	}
+
+	if (p->buyer != NULL)
+		aFree(p->buyer);
+
+	if (p->batch != NULL) {
+		aFree(p->batch->char_ids);
+		if (p->batch->ticks != NULL)
+			aFree(p->batch->ticks);
+		aFree(p->batch);
+	}
+
+	if (p->sales != NULL) {
+		aFree(p->sales->events);
+		aFree(p->sales);
+	}
+
+	aFree(p);
+}
+
+/**
+ * Collects written saves. Also writes queued saves when there is no writer thread.
+ */
+static int persist_timer(int tid, int64 tick, int id, intptr_t data)
+{
+#ifdef AT_PERSIST_THREAD
+	if (persist.worker == NULL)
+#endif
+	{
+		struct at_persist* group[AT_PERSIST_BATCH];
+		int count = persist_pop_group(group);
+
+		if (count > 0)
+			persist_write_group(persist.sql_handle, group, count);
+		for (int i = 0; i < count; i++)
+			persist_done(group[i]);
+	}
+
+	persist_collect();
+	return 0;
+}
+
+#ifdef AT_PERSIST_THREAD
+/**
+ * Writer thread. Writes queued saves in order on the dedicated connection, a group per transaction.
+ */
+static void* persist_worker(void* param)
+{
+	struct at_persist* group[AT_PERSIST_BATCH];
+
+	mutex->lock(persist.lock);
+	while (!persist.stop) {
+		int count = persist_pop_group(group);
+		if (count == 0) {
+			mutex->cond_wait(persist.wake, persist.lock, -1);
+			continue;
+		}
+
+		// Not reachable from the main thread anymore until handed back
+		mutex->unlock(persist.lock);
+		persist_write_group(persist.sql_handle, group, count);
+		mutex->lock(persist.lock);
+
+		for (int i = 0; i < count; i++)
+			persist_done(group[i]);
+	}
+	mutex->unlock(persist.lock);
+
+	return NULL;
+}
+#endif
+
+/**
+ * map->quit prehook
+ *
+ * Skip quitting clone characters
+ */
+static int map_quit_pre(struct map_session_data** sd)
+{
+	if (sd == NULL)
+		return 0;
+
+	struct trade_clone* tc = idb_get(clone_db, (*sd)->status.char_id);
+	if (tc == NULL || tc->sd != *sd) // Real SD going out
+		return 0;
+
+	hookStop();
+	remove_clone(tc->char_id);
+
+	return 0;
+}
+
+/**
+ * clif->authok posthook
+ *
+ * Removes clones when a matching char_id is selected
+ */
+static void clif_authok_post(struct map_session_data* sd)
+{
+	if (sd == NULL)
+		return;
+
+	stub_spawn_char(sd->status.char_id);
+	remove_clone(sd->status.char_id);
+}
+
+/**
+ * Closes boards and removes clone from server
+ */
+static void remove_clone(int char_id)
+{
+	struct trade_clone* tc = idb_get(clone_db, char_id);
+	if (tc == NULL)
+		return;
+
+	remove_clone_sub(tc, true);
+}
+
+/**
+ * Removes a clone. Batched removals write the autotrade status removal themselves.
+ */
+static void remove_clone_sub(struct trade_clone* tc, bool save_removal)
+{
+	int char_id = tc->char_id;
+	struct mob_data* md = tc->md;
+	if (tc->type == TD_VC) {
+			clif->closevendingboard(&md->bl, 0);
+		pc->autotrade_update(clone_sd(tc, false), PAUC_REMOVE);
+		idb_remove(vender_db, tc->vender_id);
+	} else {
+			clif->buyingstore_disappear_entry(&tc->md->bl);
+		idb_remove(buyer_db, tc->buyer_id);
+	}
+
+	sched_remove(tc);
+
+	unsigned int flags = save_removal ? AT_PERSIST_TIMEOUT_DEL : 0;
+#if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
+	if (tc->type == TD_BC)
+		flags |= AT_PERSIST_BUYER_DEL;
+#endif
+#ifdef AT_JOURNAL_FILE
+	if (journal_close(tc)) // Sales deferred to the next checkpoint
+		flags |= AT_PERSIST_ITEMS | AT_PERSIST_ZENY;
+#endif
+	if (tc->handoff.state != AT_HANDOFF_NONE)
+		flags |= handoff_clear(tc);
+	if (flags != 0)
+		persist_push(tc, flags);
+	idb_remove(clone_db, char_id);
+	account_detach(tc);
+
+	clone_release(tc);
+	clone_unindex(tc);
+	clone_packets_invalidate(tc);
+	item_state_free(tc);
+	if (tc->payload != NULL) {
+		if (tc->payload->inventory != NULL)
+			aFree(tc->payload->inventory);
+		aFree(tc->payload);
+		tc->payload = NULL;
+	}
+#ifdef AT_HIBERNATE_FILE
+	else // Hibernated
+		hibernate_release(tc);
+#endif
+
+	int class_ = md->class_;
+	clone_id_set(md->bl.id, false);
+	unit->free(&md->bl, CLR_OUTSIGHT);
+	clone_class_free(class_); // Already released if unit->free went through mob->clone_delete
+}
+
+/**
+ * Adds a clone to the index of its account
+ */
+static void account_attach(struct trade_clone* tc)
+{
+	int account_id = tc->account_id;
+	struct at_account* acc = idb_get(account_db, account_id);
+
+	if (acc == NULL) {
+		CREATE(acc, struct at_account, 1);
+		idb_put(account_db, account_id, acc);
+	}
+
+	tc->account_prev = NULL;
+	tc->account_next = acc->head;
+	if (acc->head != NULL)
+		acc->head->account_prev = tc;
+	acc->head = tc;
+	acc->count++;
+}
+
+/**
+ * Removes a clone from the index of its account
+ */
+static void account_detach(struct trade_clone* tc)
+{
+	int account_id = tc->account_id;
+	struct at_account* acc = idb_get(account_db, account_id);
+
+	if (acc == NULL)
+		return;
+
+	if (tc->account_prev != NULL)
+		tc->account_prev->account_next = tc->account_next;
+	else if (acc->head == tc)
+		acc->head = tc->account_next;
+	else
+		return; // Not indexed
+
+	if (tc->account_next != NULL)
+		tc->account_next->account_prev = tc->account_prev;
+	tc->account_prev = tc->account_next = NULL;
+
+	if (--acc->count == 0)
+		idb_remove(account_db, account_id); // Released by the db
+}
+
+/**
+ * Removes every clone of an account
+ */
+static void remove_account_clones(int account_id)
+{
+	struct at_account* acc;
+
+	while ((acc = idb_get(account_db, account_id)) != NULL && acc->head != NULL)
+		remove_clone(acc->head->char_id);
+}
+
+/**
+ * chrif->idbanned prehook
+ *
+ * Banned or blocked accounts and characters lose their clones as well
+ */
+static bool chrif_idbanned_pre(int* fd)
+{
+	int id = RFIFOL(*fd, 2);
+
+	if (RFIFOB(*fd, 6) == 2) { // Character
+		stub_spawn_char(id);
+		remove_clone(id);
+	} else {
+		stub_spawn_account(id);
+		remove_account_clones(id);
+	}
+
+	return true;
+}
+
+/**
+ * Removes a stub from the lazy loading indexes
+ */
+static void stub_drop(struct at_stub* stub)
+{
+	if (stub->prev != NULL)
+		stub->prev->next = stub->next;
+	else
+		stubs.maps[stub->m] = stub->next;
+	if (stub->next != NULL)
+		stub->next->prev = stub->prev;
+
+	if (stub->account_prev != NULL)
+		stub->account_prev->account_next = stub->account_next;
+	else if (stub->account_next != NULL)
+		idb_put(stubs.accounts, stub->account_id, stub->account_next);
+	else
+		idb_remove(stubs.accounts, stub->account_id);
+	if (stub->account_next != NULL)
+		stub->account_next->account_prev = stub->account_prev;
+
+	idb_remove(stubs.db, stub->char_id); // Released by the db
+	stubs.count--;
+}
+
+/**
+ * Spawns the persisted merchants of a filter built from dropped stubs
+ */
+static void stub_spawn(StringBuf* filter, int workers)
+{
+#if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
+	int64 start = timer->gettick_nocache();
+
+	StrBuf->AppendStr(filter, ")");
+	stubs.spawned += load_spawn(StrBuf->Value(filter), workers, timer->gettick() - stubs.loaded, false, false);
+	stubs.duration += timer->gettick_nocache() - start;
+#endif
+}
+
+/**
+ * Spawns the merchants of a map
+ */
+static void stub_spawn_map(int16 m)
+{
+	StringBuf filter;
+	struct at_stub* stub;
+	int count = 0;
+
+	if (stubs.count == 0 || stubs.maps[m] == NULL)
+		return;
+
+	StrBuf->Init(&filter);
+	StrBuf->AppendStr(&filter, "`m`.`char_id` IN (");
+	while ((stub = stubs.maps[m]) != NULL) {
+		StrBuf->Printf(&filter, "%s%d", count++ > 0 ? "," : "", stub->char_id);
+		stub_drop(stub);
+	}
+
+	stub_spawn(&filter, 1);
+	StrBuf->Destroy(&filter);
+}
+
+/**
+ * Spawns a merchant if it's still a stub or queued
+ */
+static void stub_spawn_char(int char_id)
+{
+	StringBuf filter;
+	struct at_stub* stub;
+
+#if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
+	spawn_queue_char(char_id);
+#endif
+	if (stubs.count == 0 || (stub = idb_get(stubs.db, char_id)) == NULL)
+		return;
+
+	stub_drop(stub);
+	StrBuf->Init(&filter);
+	StrBuf->Printf(&filter, "`m`.`char_id` IN (%d", char_id);
+	stub_spawn(&filter, 1);
+	StrBuf->Destroy(&filter);
+}
+
+/**
+ * Spawns the merchants of an account that are still stubs or queued
+ */
+static void stub_spawn_account(int account_id)
+{
+	StringBuf filter;
+	struct at_stub* stub;
+	int count = 0;
+
+#if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
+	spawn_queue_account(account_id);
+#endif
+	if (stubs.count == 0 || idb_get(stubs.accounts, account_id) == NULL)
+		return;
+
+	StrBuf->Init(&filter);
+	StrBuf->AppendStr(&filter, "`m`.`char_id` IN (");
+	while ((stub = idb_get(stubs.accounts, account_id)) != NULL) {
+		StrBuf->Printf(&filter, "%s%d", count++ > 0 ? "," : "", stub->char_id);
+		stub_drop(stub);
+	}
+
+	stub_spawn(&filter, 1);
+	StrBuf->Destroy(&filter);
+}
+
+/**
+ * Appends the stubs listing an item to a filter and drops them, returns the filter's count
+ */
+static int stub_items_take(enum trade_type type, int nameid, StringBuf* filter, int count)
+{
+	struct at_stub_item* it = idb_get(stubs.items[type], nameid);
+
+	idb_remove(stubs.items[type], nameid);
+	while (it != NULL) {
+		struct at_stub_item* next = it->next;
+		struct at_stub* stub = idb_get(stubs.db, it->char_id);
+
+		if (stub != NULL) { // Not spawned since
+			StrBuf->Printf(filter, "%s%d", count++ > 0 ? "," : "", stub->char_id);
+			stub_drop(stub);
+		}
+		aFree(it);
+		it = next;
+	}
+
+	return count;
+}
+
+/**
+ * Spawns the merchants selling or buying an item
+ */
+static void stub_spawn_item(enum trade_type type, int nameid)
+{
+	StringBuf filter;
+
+	if (stubs.count == 0)
+		return;
+	if (!stubs.items_loaded) {
+		stub_spawn_all();
+		return;
+	}
+
+	StrBuf->Init(&filter);
+	StrBuf->AppendStr(&filter, "`m`.`char_id` IN (");
+	if (stub_items_take(type, nameid, &filter, 0) > 0)
+		stub_spawn(&filter, 1);
+	StrBuf->Destroy(&filter);
+}
+
+/**
+ * Spawns the merchants matching the items of a shop search
+ */
+static void stub_spawn_search(enum trade_type type, const struct s_search_store_search* s)
+{
+	StringBuf filter;
+	int count = 0;
+
+	if (stubs.count == 0)
+		return;
+	if (!stubs.items_loaded) {
+		stub_spawn_all();
+		return;
+	}
+
+	StrBuf->Init(&filter);
+	StrBuf->AppendStr(&filter, "`m`.`char_id` IN (");
+	for (unsigned int idx = 0; idx < s->item_count; idx++)
+		count = stub_items_take(type, s->itemlist[idx].itemId, &filter, count);
+	if (count > 0)
+		stub_spawn(&filter, AT_LOAD_WORKERS);
+	StrBuf->Destroy(&filter);
+}
+
+/**
+ * Spawns every remaining merchant, used by searches when the stub items couldn't be read
+ */
+static void stub_spawn_all(void)
+{
+	StringBuf filter;
+	int count = 0;
+
+	if (stubs.count == 0)
+		return;
+
+	StrBuf->Init(&filter);
+	StrBuf->AppendStr(&filter, "`m`.`char_id` IN (");
+
+	struct DBIterator* iter = db_iterator(stubs.db);
+	for (struct at_stub* stub = dbi_first(iter); dbi_exists(iter); stub = dbi_next(iter)) {
+		StrBuf->Printf(&filter, "%s%d", count++ > 0 ? "," : "", stub->char_id);
+		stub_drop(stub);
+	}
+	dbi_destroy(iter);
+
+	ShowInfo("[at2] Spawning %d autotrade merchants left as stubs for a shop search\n", count);
+	stub_spawn(&filter, AT_LOAD_WORKERS);
+	StrBuf->Destroy(&filter);
+}
+
+/**
+ * map->addblock posthook
+ *
+ * The first player of a map spawns its merchants
+ */
+static int map_addblock_post(int retVal, struct block_list* bl)
+{
+	if (retVal == 0 && bl != NULL && bl->type == BL_PC && stubs.count > 0)
+		stub_spawn_map(bl->m);
+#ifdef AT_HIBERNATE_FILE
+	if (retVal == 0 && bl != NULL && bl->type == BL_PC && hibernate.maps != NULL && hibernate.maps[bl->m] > 0)
+		map->foreachinmap(hibernate_prefetch_sub, bl->m, BL_MOB); // Read back ahead of the player's view
+#endif
+
+	return retVal;
+}
+
+/**
+ * Clif->search_store_info_ack prehook
+ *
+ * Replaces ids from account_id to the mob data id of trade clones
+ */
+static void clif_searchstoreinfo_pre(struct map_session_data** _sd)
+{
+	struct map_session_data* sd = *_sd;
+	struct trade_clone* tc;
+
+	for (int i = 0; i < sd->searchstore.count; i++) {
+		int store_id = sd->searchstore.items[i].store_id;
+		if (sd->searchstore.type == SEARCHTYPE_VENDING)
+			tc = idb_get(vender_db, store_id);
+		else
+			tc = idb_get(buyer_db, store_id);
+
+		if (tc != NULL)
+			sd->searchstore.items[i].account_id = tc->md->bl.id;
+	}
+}
+
+/**
+ * Appends the item columns of an inventory-like table to a query.
+ * Column names are prefixed by alias, if any (e.g. "`c`.")
+ */
+static void item_columns(StringBuf* buf, const char* alias, bool has_favorite)
+{
+	const char* columns[] = { "id", "nameid", "amount", "equip", "identify", "refine", "grade", "attribute", "expire_time", "bound", "unique_id" };
+
+	for (int i = 0; i < ARRAYLENGTH(columns); i++)
+		StrBuf->Printf(buf, "%s%s`%s`", i == 0 ? "" : ", ", alias, columns[i]);
+	for (int i = 0; i < MAX_SLOTS; i++)
+		StrBuf->Printf(buf, ", %s`card%d`", alias, i);
+	for (int i = 0; i < MAX_ITEM_OPTIONS; i++)
+		StrBuf->Printf(buf, ", %s`opt_idx%d`, %s`opt_val%d`", alias, i, alias, i);
+	if (has_favorite)
+		StrBuf->Printf(buf, ", %s`favorite`", alias);
+}
+
+/**
+ * Appends the written columns of an inventory-like table, in item_values order
+ */
+static void item_value_columns(StringBuf* buf, bool has_favorite)
+{
+	StrBuf->AppendStr(buf, "`nameid`, `amount`, `equip`, `identify`, `refine`, `grade`, `attribute`, `expire_time`, `bound`, `unique_id`");
+	for (int i = 0; i < MAX_SLOTS; i++)
+		StrBuf->Printf(buf, ", `card%d`", i);
+	for (int i = 0; i < MAX_ITEM_OPTIONS; i++)
+		StrBuf->Printf(buf, ", `opt_idx%d`, `opt_val%d`", i, i);
+	if (has_favorite)
+		StrBuf->AppendStr(buf, ", `favorite`");
+}
+
+/**
+ * Appends the values of an item for the columns of item_value_columns
+ */
+static void item_values(StringBuf* buf, const struct item* it, bool has_favorite)
+{
+	StrBuf->Printf(buf, "'%d', '%d', '%u', '%d', '%d', '%d', '%d', '%u', '%d', '%"PRIu64"'",
+		it->nameid, it->amount, it->equip, it->identify, it->refine, it->grade, it->attribute, it->expire_time, it->bound, it->unique_id);
+	for (int i = 0; i < MAX_SLOTS; i++)
+		StrBuf->Printf(buf, ", '%d'", it->card[i]);
+	for (int i = 0; i < MAX_ITEM_OPTIONS; i++)
+		StrBuf->Printf(buf, ", '%d', '%d'", it->option[i].index, it->option[i].value);
+	if (has_favorite)
+		StrBuf->Printf(buf, ", '%d'", it->favorite);
+}
+
+/**
+ * Whether a row holds the given item stack (row id aside)
+ */
+static bool item_same(const struct item* a, const struct item* b)
+{
+	return a->nameid == b->nameid
+		&& a->amount == b->amount
+		&& a->unique_id == b->unique_id
+		&& memcmp(a->card, b->card, sizeof(a->card)) == 0
+		&& memcmp(a->option, b->option, sizeof(a->option)) == 0;
+}
+
+/**
+ * Binds the parameters of the columns appended by item_value_columns, starting at parameter offset
+ */
+static bool item_bindparams(struct SqlStmt* stmt, int offset, struct item* item, bool has_favorite)
+{
+	if (SQL_ERROR == SQL->StmtBindParam(stmt, offset + 0, SQLDT_INT, &item->nameid, sizeof item->nameid)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, offset + 1, SQLDT_SHORT, &item->amount, sizeof item->amount)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, offset + 2, SQLDT_UINT, &item->equip, sizeof item->equip)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, offset + 3, SQLDT_CHAR, &item->identify, sizeof item->identify)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, offset + 4, SQLDT_CHAR, &item->refine, sizeof item->refine)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, offset + 5, SQLDT_CHAR, &item->grade, sizeof item->grade)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, offset + 6, SQLDT_CHAR, &item->attribute, sizeof item->attribute)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, offset + 7, SQLDT_UINT, &item->expire_time, sizeof item->expire_time)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, offset + 8, SQLDT_UCHAR, &item->bound, sizeof item->bound)
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, offset + 9, SQLDT_UINT64, &item->unique_id, sizeof item->unique_id))
+		return false;
+
+	for (int i = 0; i < MAX_SLOTS; i++) {
+		if (SQL_ERROR == SQL->StmtBindParam(stmt, offset + 10 + i, SQLDT_INT, &item->card[i], sizeof item->card[i]))
+			return false;
+	}
+
+	for (int i = 0; i < MAX_ITEM_OPTIONS; i++) {
+		if (SQL_ERROR == SQL->StmtBindParam(stmt, offset + 10 + MAX_SLOTS + i * 2, SQLDT_INT16, &item->option[i].index, sizeof item->option[i].index)
+			|| SQL_ERROR == SQL->StmtBindParam(stmt, offset + 11 + MAX_SLOTS + i * 2, SQLDT_INT16, &item->option[i].value, sizeof item->option[i].value))
+			return false;
+	}
+
+	if (has_favorite && SQL_ERROR == SQL->StmtBindParam(stmt, offset + 10 + MAX_SLOTS + MAX_ITEM_OPTIONS * 2, SQLDT_CHAR, &item->favorite, sizeof item->favorite))
+		return false;
+
+	return true;
+}
+
+/**
+ * Binds the columns appended by item_columns, starting at column offset
+ */
+static bool item_bindcolumns(struct SqlStmt* stmt, int offset, struct item* item, bool has_favorite)
+{
+	bool result = true;
+
+	if (SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 0, SQLDT_INT, &item->id, sizeof item->id, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 1, SQLDT_INT, &item->nameid, sizeof item->nameid, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 2, SQLDT_SHORT, &item->amount, sizeof item->amount, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 3, SQLDT_UINT, &item->equip, sizeof item->equip, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 4, SQLDT_CHAR, &item->identify, sizeof item->identify, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 5, SQLDT_CHAR, &item->refine, sizeof item->refine, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 6, SQLDT_CHAR, &item->grade, sizeof item->grade, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 7, SQLDT_CHAR, &item->attribute, sizeof item->attribute, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 8, SQLDT_UINT, &item->expire_time, sizeof item->expire_time, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 9, SQLDT_UCHAR, &item->bound, sizeof item->bound, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 10, SQLDT_UINT64, &item->unique_id, sizeof item->unique_id, NULL, NULL)
+		) {
+		SqlStmt_ShowDebug(stmt);
+		result = false;
+	}
+
+	for (int i = 0; i < MAX_SLOTS; i++) {
+		if (SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 11 + i, SQLDT_INT, &item->card[i], sizeof item->card[i], NULL, NULL)) {
+			SqlStmt_ShowDebug(stmt);
+			result = false;
+		}
+	}
+
+	for (int i = 0; i < MAX_ITEM_OPTIONS; i++) {
+		if (SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 11 + MAX_SLOTS + i * 2, SQLDT_INT16, &item->option[i].index, sizeof item->option[i].index, NULL, NULL)
+			|| SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 12 + MAX_SLOTS + i * 2, SQLDT_INT16, &item->option[i].value, sizeof item->option[i].value, NULL, NULL)) {
+			SqlStmt_ShowDebug(stmt);
+			result = false;
+		}
+	}
+
+	if (has_favorite) {
+		if (SQL_ERROR == SQL->StmtBindColumn(stmt, offset + 11 + MAX_SLOTS + MAX_ITEM_OPTIONS * 2, SQLDT_CHAR, &item->favorite, sizeof item->favorite, NULL, NULL)) {
+			SqlStmt_ShowDebug(stmt);
+			result = false;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Retrieves item data from database
+ */
+static int getitemdata_from_sql(struct Sql* sql_handle, struct item* items, int max, int guid, enum inventory_table_type table)
+{
+	int i = 0;
+	struct SqlStmt* stmt = NULL;
+	const char* tablename = NULL;
+	const char* selectoption = NULL;
+	bool has_favorite = false;
+	StringBuf buf;
+	struct item item = { 0 }; // temp storage variable
+
+	if (max > 0)
+		nullpo_retr(-1, items);
+	Assert_retr(-1, guid > 0);
+
+	// Initialize the array.
+	if (max > 0)
+		memset(items, 0x0, sizeof(struct item) * max);
+
+	switch (table) {
+	case TABLE_INVENTORY:
+		tablename = inventory_db;
+		selectoption = "char_id";
+		has_favorite = true;
+		break;
+	case TABLE_CART:
+		tablename = cart_db;
+		selectoption = "char_id";
+		break;
+	case TABLE_GUILD_STORAGE:
+	case TABLE_STORAGE:
+	default:
+		ShowError("char_getitemdata_from_sql: Invalid table type %d!\n", (int)table);
+		Assert_retr(-1, table);
+		return -1;
+	}
+
+	StrBuf->Init(&buf);
+	StrBuf->AppendStr(&buf, "SELECT ");
+	item_columns(&buf, "", has_favorite);
+	StrBuf->Printf(&buf, " FROM `%s` WHERE `%s`=?", tablename, selectoption);
+
+	stmt = SQL->StmtMalloc(sql_handle);
+	if (SQL_ERROR == SQL->StmtPrepareStr(stmt, StrBuf->Value(&buf))
+		|| SQL_ERROR == SQL->StmtBindParam(stmt, 0, SQLDT_INT, &guid, sizeof guid)
+		|| SQL_ERROR == SQL->StmtExecute(stmt)) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		StrBuf->Destroy(&buf);
+		return -1;
+	}
+
+	item_bindcolumns(stmt, 0, &item, has_favorite);
+
+	if (SQL->StmtNumRows(stmt) > 0) {
+		i = 0;
+		while (SQL_SUCCESS == SQL->StmtNextRow(stmt) && i < max) {
+			items[i++] = item;
+		}
+	}
+
+	SQL->StmtFree(stmt);
+	StrBuf->Destroy(&buf);
+
+	return i;
+}
+
+/**
+ * Saves item data to database, diffing it against the whole table.
+ * Rows read from the table are reported through db_rows, if set.
+ */
+static int memitemdata_to_sql(struct Sql* sql_handle, const struct item* p_items, int current_size, int guid, enum inventory_table_type table, int* db_rows)
+{
+	const char* tablename = NULL;
+	const char* selectoption = NULL;
+	bool has_favorite = false;
+	int total_updates = 0, total_deletes = 0, total_inserts = 0;
+	int max_size = 0;
+	bool failed = false;
+	int db_size = 0;
+
+	switch (table) {
+	case TABLE_INVENTORY:
+		tablename = inventory_db;
+		selectoption = "char_id";
+		has_favorite = true;
+		max_size = MAX_INVENTORY;
+		break;
+	case TABLE_CART:
+		tablename = cart_db;
+		selectoption = "char_id";
+		max_size = MAX_CART;
+		break;
+	case TABLE_GUILD_STORAGE:
+	case TABLE_STORAGE:
+	default:
+		ShowError("Invalid table type %d!\n", (int)table);
+		Assert_retr(-1, table);
+		return -1;
+	}
+	if (current_size == -1)
+		current_size = max_size;
+
+	bool* matched_p = NULL;
+	if (current_size > 0) {
+		nullpo_ret(p_items);
+
+		matched_p = aCalloc(current_size, sizeof(bool));
+	}
+
+	StringBuf buf;
+	StrBuf->Init(&buf);
+
+	/**
+	 * If the storage table is not empty, check for items and replace or delete where needed.
+	 */
+	struct item* cp_items = aCalloc(max_size, sizeof(struct item));
+	if ((db_size = getitemdata_from_sql(sql_handle, cp_items, max_size, guid, table)) < 0) {
+		StrBuf->Destroy(&buf);
+		aFree(cp_items);
+		if (matched_p != NULL)
+			aFree(matched_p);
+		return -1;
+	}
+
+	if (db_rows != NULL)
+		*db_rows = db_size;
+
+	if (db_size > 0) {
+		int* deletes = aCalloc(db_size, sizeof(struct item));
+
+		for (int i = 0; i < db_size; i++) {
+			const struct item* cp_it = &cp_items[i];
+
+			int j = 0;
+			ARR_FIND(0, current_size, j,
+				matched_p[j] != true
+				&& p_items[j].nameid != 0
+				&& cp_it->nameid == p_items[j].nameid
+				&& cp_it->unique_id == p_items[j].unique_id
+				&& memcmp(p_items[j].card, cp_it->card, sizeof(int) * MAX_SLOTS) == 0
+				&& memcmp(p_items[j].option, cp_it->option, 5 * MAX_ITEM_OPTIONS) == 0);
+
+			if (j < current_size) { // Item found.
+				matched_p[j] = true; // Mark the item as matched.
+
+				// If the amount has changed, set for replacement with current item properties.
+				if (memcmp(cp_it, &p_items[j], sizeof(struct item)) != 0) {
+					if (total_updates == 0) {
+						StrBuf->Clear(&buf);
+						StrBuf->Printf(&buf, "REPLACE INTO `%s` (`id`, `%s`, ", tablename, selectoption);
+						item_value_columns(&buf, has_favorite);
+						StrBuf->AppendStr(&buf, ") VALUES ");
+					}
+
+					StrBuf->Printf(&buf, "%s('%d', '%d', ", total_updates > 0 ? ", " : "", cp_it->id, guid);
+					item_values(&buf, &p_items[j], has_favorite);
+					StrBuf->AppendStr(&buf, ")");
+
+					total_updates++;
+				}
+			}
+			else { // Doesn't exist in the table, set for deletion.
+				deletes[total_deletes++] = cp_it->id;
+			}
+		}
+
+		if (total_updates > 0 && SQL_ERROR == SQL->QueryStr(sql_handle, StrBuf->Value(&buf))) {
+			Sql_ShowDebug(sql_handle);
+			failed = true;
+		}
+
+		/**
+		 * Handle deletions, if any.
+		 */
+		if (total_deletes > 0) {
+			StrBuf->Clear(&buf);
+			StrBuf->Printf(&buf, "DELETE FROM `%s` WHERE `id` IN (", tablename);
+			for (int i = 0; i < total_deletes; i++)
+				StrBuf->Printf(&buf, "%s'%d'", i == 0 ? "" : ", ", deletes[i]);
+
+			StrBuf->AppendStr(&buf, ");");
+
+			if (SQL_ERROR == SQL->QueryStr(sql_handle, StrBuf->Value(&buf))) {
+				Sql_ShowDebug(sql_handle);
+				failed = true;
+			}
+		}
+
+		aFree(deletes);
+	}
+
+	/**
+	 * Check for new items and add if required.
+	 */
+	for (int i = 0; i < current_size; i++) {
+		const struct item* p_it = &p_items[i];
+
+		if (matched_p[i] || p_it->nameid == 0)
+			continue;
+
+		if (total_inserts == 0) {
+			StrBuf->Clear(&buf);
+			StrBuf->Printf(&buf, "INSERT INTO `%s` (`%s`, ", tablename, selectoption);
+			item_value_columns(&buf, has_favorite);
+			StrBuf->AppendStr(&buf, ") VALUES ");
+		}
+
+		StrBuf->Printf(&buf, "%s('%d', ", total_inserts > 0 ? ", " : "", guid);
+		item_values(&buf, p_it, has_favorite);
+		StrBuf->AppendStr(&buf, ")");
+
+		total_inserts++;
+	}
+
+	if (total_inserts > 0 && SQL_ERROR == SQL->QueryStr(sql_handle, StrBuf->Value(&buf))) {
+		Sql_ShowDebug(sql_handle);
+		failed = true;
+	}
+
+	StrBuf->Destroy(&buf);
+
+	aFree(cp_items);
+	if (matched_p != NULL)
+		aFree(matched_p);
+
+	ShowInfo("%s save complete - guid: %d (replace: %d, insert: %d, delete: %d)\n", tablename, guid, total_updates, total_inserts, total_deletes);
+
+	if (failed)
+		return -1;
+
+	return total_updates + total_inserts + total_deletes;
+}
+
+/**
+ * Writes the slot ops of a cart or inventory save without reading the table, using the prepared statements.
+ * Row ids of inserted stacks are stored back into the save.
+ */
+static bool itemdata_apply_sql(struct at_persist_stmts* stmts, struct at_persist_items* pi, int max, int guid, enum at_table table)
+{
+	int updates = 0, deletes = 0, inserts = 0;
+	bool result = true;
+
+	if (stmts->item_insert[table] == NULL || stmts->item_update[table] == NULL || stmts->item_delete[table] == NULL)
+		return false;
+
+	stmts->char_id = guid;
+	for (int i = 0; i < max; i++) {
+		struct SqlStmt* stmt;
+
+		switch (pi->op[i]) {
+		case AT_OP_UPDATE: stmt = stmts->item_update[table]; break;
+		case AT_OP_DELETE: stmt = stmts->item_delete[table]; break;
+		case AT_OP_INSERT: stmt = stmts->item_insert[table]; break;
+		default: continue;
+		}
+
+		stmts->row = pi->row[i];
+		stmts->item = pi->item[i];
+		if (SQL_ERROR == SQL->StmtExecute(stmt)) {
+			SqlStmt_ShowDebug(stmt);
+			if (pi->op[i] == AT_OP_INSERT)
+				pi->row[i] = 0;
+			result = false;
+			continue;
+		}
+
+		if (pi->op[i] == AT_OP_UPDATE) {
+			updates++;
+		} else if (pi->op[i] == AT_OP_DELETE) {
+			deletes++;
+		} else {
+			pi->row[i] = (int)SQL->StmtLastInsertId(stmt);
+			inserts++;
+		}
+	}
+
+	pi->rows_written = updates + deletes + inserts;
+	return result;
+}
+
+/**
+ * Reconciles a whole cart or inventory with its table, then reads back the row id of every slot
+ */
+static bool itemdata_reconcile_sql(struct Sql* sql_handle, struct at_persist_items* pi, int max, int guid, enum inventory_table_type table)
+{
+	int db_size = 0;
+	int written = memitemdata_to_sql(sql_handle, pi->item, max, guid, table, &db_size);
+
+	if (written < 0)
+		return false;
+
+	pi->rows_read = db_size;
+	pi->rows_written = written;
+
+	struct item* rows = aCalloc(max, sizeof(struct item));
+	bool* matched = aCalloc(max, sizeof(bool));
+	int count = getitemdata_from_sql(sql_handle, rows, max, guid, table);
+
+	if (count > 0)
+		pi->rows_read += count;
+
+	for (int i = 0; i < max; i++) {
+		const struct item* it = &pi->item[i];
+		int j = 0;
+
+		pi->row[i] = 0;
+		if (it->nameid == 0)
+			continue;
+
+		ARR_FIND(0, count, j, !matched[j] && item_same(&rows[j], it));
+		if (j < count) {
+			matched[j] = true;
+			pi->row[i] = rows[j].id;
+		}
+	}
+
+	aFree(matched);
+	aFree(rows);
+
+	return count >= 0;
+}
+
+#if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
+/**
+ * Merchants table of a load, aliased `m` by every phase
+ */
+static const char* load_table(const struct at_load* load)
+{
+	return load->type == TD_BC ? buyers_db : map->autotrade_merchants_db;
+}
+
+/**
+ * Finds the load entry of a character (entries are sorted by char_id)
+ */
+static struct at_load_entry* load_entry(struct at_load* load, int char_id)
+{
+	int min = 0, max = load->count - 1;
+
+	while (min <= max) {
+		int mid = (min + max) / 2;
+		struct at_load_entry* e = &load->entries[mid];
+
+		if (e->char_id == char_id)
+			return e;
+		if (e->char_id < char_id)
+			min = mid + 1;
+		else
+			max = mid - 1;
+	}
+
+	return NULL;
+}
+
+/**
+ * Bulk loader phase: merchants list
+ */
+static bool load_merchants(struct Sql* sql_handle, struct at_load* load)
+{
+	struct SqlStmt* stmt = SQL->StmtMalloc(sql_handle);
+	int account_id, char_id, limit = 0, max_weight = 0, inventory_size = 0;
+	char title[MESSAGE_SIZE];
+	bool buyer = load->type == TD_BC;
+
+	if (SQL_ERROR == SQL->StmtPrepare(stmt, "SELECT `m`.`account_id`,`m`.`char_id`,`m`.`title`%s FROM `%s` AS `m` WHERE %s ORDER BY `m`.`char_id`",
+		buyer ? ",`m`.`limit`,`m`.`max_weight`,`m`.`inventory_size`" : "", load_table(load), StrBuf->Value(&load->filter))
+		|| SQL_ERROR == SQL->StmtExecute(stmt)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 0, SQLDT_INT, &account_id, sizeof account_id, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 1, SQLDT_INT, &char_id, sizeof char_id, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 2, SQLDT_STRING, &title, sizeof title, NULL, NULL)
+		|| (buyer && (SQL_ERROR == SQL->StmtBindColumn(stmt, 3, SQLDT_INT, &limit, sizeof limit, NULL, NULL)
+			|| SQL_ERROR == SQL->StmtBindColumn(stmt, 4, SQLDT_INT, &max_weight, sizeof max_weight, NULL, NULL)
+			|| SQL_ERROR == SQL->StmtBindColumn(stmt, 5, SQLDT_INT, &inventory_size, sizeof inventory_size, NULL, NULL)))) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		return false;
+	}
+
+	load->count = 0;
+	if ((int)SQL->StmtNumRows(stmt) > 0)
+		CREATE(load->entries, struct at_load_entry, SQL->StmtNumRows(stmt));
+
+	while (SQL_SUCCESS == SQL->StmtNextRow(stmt)) {
+		struct at_load_entry* e = &load->entries[load->count++];
+		e->type = load->type;
+		e->char_id = char_id;
+		e->account_id = account_id;
+		e->timeout = -1;
+		safestrncpy(e->title, title, MESSAGE_SIZE);
+		if (buyer) {
+			e->buyingstore.zenylimit = limit;
+			e->max_weight = max_weight;
+			e->inventory_size = inventory_size;
+			CREATE(e->inventory, struct item, MAX_INVENTORY);
+		}
+	}
+
+	load->rows[AT_LOAD_MERCHANTS] = load->count;
+	SQL->StmtFree(stmt);
+	return true;
+}
+
+/**
+ * Bulk loader phase: name, looks and position of every merchant
+ */
+static bool load_characters(struct Sql* sql_handle, struct at_load* load)
+{
+	struct SqlStmt* stmt = SQL->StmtMalloc(sql_handle);
+	struct at_load_entry tmp = { 0 };
+	struct view_data* vd = &tmp.vd;
+	int char_id;
+	char sex[2];
+	char account_sex[2];
+
+	if (SQL_ERROR == SQL->StmtPrepare(stmt, "SELECT `c`.`char_id`,"
+		"`c`.`name`,`c`.`base_level`,`c`.`class`,`c`.`zeny`,`c`.`sex`,`c`.`hair`,`c`.`hair_color`,`c`.`clothes_color`,`c`.`body`,"
+		"`c`.`weapon`,`c`.`shield`,`c`.`head_top`,`c`.`head_mid`,`c`.`head_bottom`,`c`.`last_map`,`c`.`robe`,`c`.`last_x`,`c`.`last_y`,"
+		"`l`.`group_id`, `l`.`sex` "
+		"FROM `%s` AS `m` JOIN `%s` AS `c` ON `c`.`char_id` = `m`.`char_id` JOIN `%s` AS `l` ON `c`.`account_id` = `l`.`account_id` WHERE %s",
+		load_table(load), character_db, login_db, StrBuf->Value(&load->filter))
+		|| SQL_ERROR == SQL->StmtExecute(stmt)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 0, SQLDT_INT, &char_id, sizeof char_id, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 1, SQLDT_STRING, &tmp.name, sizeof tmp.name, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 2, SQLDT_SHORT, &tmp.lv, sizeof tmp.lv, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 3, SQLDT_INT, &vd->class, sizeof vd->class, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 4, SQLDT_INT, &tmp.zeny, sizeof tmp.zeny, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 5, SQLDT_ENUM, &sex, sizeof sex, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 6, SQLDT_INT, &vd->hair_style, sizeof vd->hair_style, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 7, SQLDT_SHORT, &vd->hair_color, sizeof vd->hair_color, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 8, SQLDT_SHORT, &vd->cloth_color, sizeof vd->cloth_color, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 9, SQLDT_INT, &vd->body_style, sizeof vd->body_style, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 10, SQLDT_INT, &vd->weapon, sizeof vd->weapon, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 11, SQLDT_INT, &vd->shield, sizeof vd->shield, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 12, SQLDT_INT, &vd->head_top, sizeof vd->head_top, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 13, SQLDT_INT, &vd->head_mid, sizeof vd->head_mid, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 14, SQLDT_INT, &vd->head_bottom, sizeof vd->head_bottom, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 15, SQLDT_STRING, &tmp.last_map, sizeof tmp.last_map, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 16, SQLDT_INT, &vd->robe, sizeof vd->robe, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 17, SQLDT_SHORT, &tmp.x, sizeof tmp.x, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 18, SQLDT_SHORT, &tmp.y, sizeof tmp.y, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 19, SQLDT_INT, &tmp.group_id, sizeof tmp.group_id, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 20, SQLDT_ENUM, &account_sex, sizeof account_sex, NULL, NULL)
+		) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		return false;
+	}
+
+	while (SQL_SUCCESS == SQL->StmtNextRow(stmt)) {
+		struct at_load_entry* e = load_entry(load, char_id);
+		load->rows[AT_LOAD_CHARACTERS]++;
+		if (e == NULL)
+			continue;
+
+		safestrncpy(e->name, tmp.name, NAME_LENGTH);
+		safestrncpy(e->last_map, tmp.last_map, MAP_NAME_LENGTH_EXT);
+		memcpy(&e->vd, vd, sizeof(struct view_data));
+		e->lv = tmp.lv;
+		e->zeny = tmp.zeny;
+		e->x = tmp.x;
+		e->y = tmp.y;
+		e->group_id = tmp.group_id;
+		e->sex = e->vd.sex = char_getgender(sex[0], account_sex[0]);
+		e->found = true;
+	}
+
+	SQL->StmtFree(stmt);
+	return true;
+}
+
+/**
+ * Bulk loader phase: pushcart and autotrade statuses
+ */
+static bool load_statuses(struct Sql* sql_handle, struct at_load* load)
+{
+	struct SqlStmt* stmt = SQL->StmtMalloc(sql_handle);
+	int char_id, type, val1, tick;
+
+	if (SQL_ERROR == SQL->StmtPrepare(stmt, "SELECT `s`.`char_id`, `s`.`type`, `s`.`val1`, `s`.`tick` "
+		"FROM `%s` AS `m` JOIN `%s` AS `s` ON `s`.`account_id` = `m`.`account_id` AND `s`.`char_id` = `m`.`char_id` "
+		"WHERE `s`.`type` IN ('%d', '%d') AND %s", load_table(load), sc_data_db, SC_PUSH_CART, SC_AUTOTRADE, StrBuf->Value(&load->filter))
+		|| SQL_ERROR == SQL->StmtExecute(stmt)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 0, SQLDT_INT, &char_id, sizeof char_id, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 1, SQLDT_INT, &type, sizeof type, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 2, SQLDT_INT, &val1, sizeof val1, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 3, SQLDT_INT, &tick, sizeof tick, NULL, NULL)
+		) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		return false;
+	}
+
+	while (SQL_SUCCESS == SQL->StmtNextRow(stmt)) {
+		struct at_load_entry* e = load_entry(load, char_id);
+		load->rows[AT_LOAD_STATUSES]++;
+		if (e == NULL)
+			continue;
+
+		if (type == SC_PUSH_CART)
+			e->pushcart = val1;
+		else
+			e->timeout = tick;
+	}
+
+	SQL->StmtFree(stmt);
+	return true;
+}
+
+/**
+ * Bulk loader phase: cart items
+ */
+static bool load_carts(struct Sql* sql_handle, struct at_load* load)
+{
+	struct SqlStmt* stmt = SQL->StmtMalloc(sql_handle);
+	struct item item = { 0 };
+	int char_id;
+	StringBuf buf;
+
+	StrBuf->Init(&buf);
+	StrBuf->AppendStr(&buf, "SELECT `c`.`char_id`, ");
+	item_columns(&buf, "`c`.", false);
+	StrBuf->Printf(&buf, " FROM `%s` AS `m` JOIN `%s` AS `c` ON `c`.`char_id` = `m`.`char_id` WHERE %s", load_table(load), cart_db, StrBuf->Value(&load->filter));
+
+	if (SQL_ERROR == SQL->StmtPrepareStr(stmt, StrBuf->Value(&buf))
+		|| SQL_ERROR == SQL->StmtExecute(stmt)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 0, SQLDT_INT, &char_id, sizeof char_id, NULL, NULL)
+		|| !item_bindcolumns(stmt, 1, &item, false)) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		StrBuf->Destroy(&buf);
+		return false;
+	}
+
+	while (SQL_SUCCESS == SQL->StmtNextRow(stmt)) {
+		struct at_load_entry* e = load_entry(load, char_id);
+		load->rows[AT_LOAD_CARTS]++;
+		if (e == NULL || e->cart_num >= MAX_CART)
+			continue;
+
+		e->cart[e->cart_num++] = item;
+	}
+
+	SQL->StmtFree(stmt);
+	StrBuf->Destroy(&buf);
+	return true;
+}
+
+/**
+ * Bulk loader phase: inventory items of buying stores
+ */
+static bool load_inventories(struct Sql* sql_handle, struct at_load* load)
+{
+	struct SqlStmt* stmt;
+	struct item item = { 0 };
+	int char_id;
+	StringBuf buf;
+
+	if (load->type != TD_BC)
+		return true;
+
+	stmt = SQL->StmtMalloc(sql_handle);
+	StrBuf->Init(&buf);
+	StrBuf->AppendStr(&buf, "SELECT `i`.`char_id`, ");
+	item_columns(&buf, "`i`.", true);
+	StrBuf->Printf(&buf, " FROM `%s` AS `m` JOIN `%s` AS `i` ON `i`.`char_id` = `m`.`char_id` WHERE %s", load_table(load), inventory_db, StrBuf->Value(&load->filter));
+
+	if (SQL_ERROR == SQL->StmtPrepareStr(stmt, StrBuf->Value(&buf))
+		|| SQL_ERROR == SQL->StmtExecute(stmt)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 0, SQLDT_INT, &char_id, sizeof char_id, NULL, NULL)
+		|| !item_bindcolumns(stmt, 1, &item, true)) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		StrBuf->Destroy(&buf);
+		return false;
+	}
+
+	while (SQL_SUCCESS == SQL->StmtNextRow(stmt)) {
+		struct at_load_entry* e = load_entry(load, char_id);
+		load->rows[AT_LOAD_INVENTORIES]++;
+		if (e == NULL || e->inventory_num >= MAX_INVENTORY)
+			continue;
+
+		e->inventory[e->inventory_num++] = item;
+	}
+
+	SQL->StmtFree(stmt);
+	StrBuf->Destroy(&buf);
+	return true;
+}
+
+/**
+ * Bulk loader phase: vending entries. Carts must be already loaded.
+ */
+static bool load_vendings(struct Sql* sql_handle, struct at_load* load)
+{
+	struct SqlStmt* stmt;
+	int char_id, itemkey, amount, price;
+
+	if (load->type != TD_VC)
+		return true;
+
+	stmt = SQL->StmtMalloc(sql_handle);
+
+	if (SQL_ERROR == SQL->StmtPrepare(stmt, "SELECT `d`.`char_id`, `d`.`itemkey`, `d`.`amount`, `d`.`price` "
+		"FROM `%s` AS `m` JOIN `%s` AS `d` ON `d`.`char_id` = `m`.`char_id` WHERE %s", map->autotrade_merchants_db, map->autotrade_data_db, StrBuf->Value(&load->filter))
+		|| SQL_ERROR == SQL->StmtExecute(stmt)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 0, SQLDT_INT, &char_id, sizeof char_id, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 1, SQLDT_INT, &itemkey, sizeof itemkey, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 2, SQLDT_INT, &amount, sizeof amount, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 3, SQLDT_INT, &price, sizeof price, NULL, NULL)
+		) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		return false;
+	}
+
+	while (SQL_SUCCESS == SQL->StmtNextRow(stmt)) {
+		struct at_load_entry* e = load_entry(load, char_id);
+		int i;
+		load->rows[AT_LOAD_VENDINGS]++;
+		if (e == NULL || e->vend_num >= MAX_VENDING)
+			continue;
+
+		ARR_FIND(0, e->cart_num, i, e->cart[i].id == itemkey);
+		if (i != e->cart_num && itemdb_cantrade(&e->cart[i], 0, 0)) {
+			if (amount > e->cart[i].amount)
+				amount = e->cart[i].amount;
+
+			if (amount) {
+				e->vending[e->vend_num].index = i;
+				e->vending[e->vend_num].amount = amount;
+				e->vending[e->vend_num].value = cap_value(price, 0, (unsigned int)battle->bc->vending_max_value);
+				e->vend_num++;
+			}
+		}
+	}
+
+	SQL->StmtFree(stmt);
+	return true;
+}
+
+/**
+ * Bulk loader phase: items wanted by buying stores
+ */
+static bool load_buyings(struct Sql* sql_handle, struct at_load* load)
+{
+	struct SqlStmt* stmt;
+	int char_id, nameid, amount, price;
+
+	if (load->type != TD_BC)
+		return true;
+
+	stmt = SQL->StmtMalloc(sql_handle);
+	if (SQL_ERROR == SQL->StmtPrepare(stmt, "SELECT `d`.`char_id`, `d`.`nameid`, `d`.`amount`, `d`.`price` "
+		"FROM `%s` AS `m` JOIN `%s` AS `d` ON `d`.`char_id` = `m`.`char_id` WHERE %s", load_table(load), buyers_data_db, StrBuf->Value(&load->filter))
+		|| SQL_ERROR == SQL->StmtExecute(stmt)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 0, SQLDT_INT, &char_id, sizeof char_id, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 1, SQLDT_INT, &nameid, sizeof nameid, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 2, SQLDT_INT, &amount, sizeof amount, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 3, SQLDT_INT, &price, sizeof price, NULL, NULL)
+		) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		return false;
+	}
+
+	while (SQL_SUCCESS == SQL->StmtNextRow(stmt)) {
+		struct at_load_entry* e = load_entry(load, char_id);
+		load->rows[AT_LOAD_BUYINGS]++;
+		if (e == NULL || e->buyingstore.slots >= MAX_BUYINGSTORE_SLOTS || amount <= 0 || itemdb->exists(nameid) == NULL)
+			continue;
+
+		struct s_buyingstore_item* it = &e->buyingstore.items[e->buyingstore.slots++];
+		it->nameid = nameid;
+		it->amount = amount;
+		it->price = cap_value(price, 1, BUYINGSTORE_MAX_PRICE);
+	}
+
+	SQL->StmtFree(stmt);
+	return true;
+}
+
+/**
+ * Bulk loader phase: builds the clone payload of every found merchant
+ */
+static bool load_build(struct Sql* sql_handle, struct at_load* load)
+{
+	for (int i = 0; i < load->count; i++) {
+		struct at_load_entry* e = &load->entries[i];
+		if (!e->found)
+			continue;
+
+		e->tc = autotrade_build(e);
+		load->rows[AT_LOAD_BUILD]++;
+	}
+
+	return true;
+}
+
+/**
+ * Runs every loader phase up to building the clones
+ */
+static void load_run(struct Sql* sql_handle, struct at_load* load)
+{
+	bool (*loaders[AT_LOAD_SPAWN])(struct Sql* sql_handle, struct at_load* load) = {
+		load_merchants, load_characters, load_statuses, load_carts, load_inventories, load_vendings, load_buyings, load_build
+	};
+	int64 tick = timer->gettick_nocache();
+
+	load->result = true;
+	for (int i = 0; i < AT_LOAD_SPAWN; i++) {
+		bool result = loaders[i](sql_handle, load);
+		int64 now = timer->gettick_nocache();
+		load->duration[i] = now - tick;
+		tick = now;
+		if (!result) {
+			load->result = false;
+			load->failed_phase = i;
+			break;
+		}
+	}
+}
+
+#if AT_LOAD_WORKERS > 0
+/**
+ * Loader thread. Builds the clones of a merchants partition on its own connection, every store type in turn.
+ */
+static void* load_worker(void* param)
+{
+	struct at_load* loads = param;
+	struct Sql* sql_handle = at_sql_connect(); // Connect from this thread so the client library initializes it
+
+	if (sql_handle == NULL) {
+		for (int t = 0; t < AT_LOAD_TYPES; t++) {
+			loads[t].result = false;
+			loads[t].failed_phase = AT_LOAD_MERCHANTS;
+		}
+		return NULL;
+	}
+
+	for (int t = 0; t < AT_LOAD_TYPES; t++)
+		load_run(sql_handle, &loads[t]);
+	SQL->Free(sql_handle);
+
+	return NULL;
+}
+#endif
+
+/**
+ * Frees the entries of a load, clones not spawned yet must have been discarded
+ */
+static void load_free(struct at_load* load)
+{
+	for (int i = 0; i < load->count; i++) {
+		if (load->entries[i].inventory != NULL)
+			aFree(load->entries[i].inventory);
+	}
+	if (load->entries != NULL)
+		aFree(load->entries);
+	load->entries = NULL;
+	load->count = 0;
+}
+
+/**
+ * Loads and spawns the persisted merchants matching filter (condition over `m`).
+ * Merchants are split by char_id over the given number of loader threads.
+ * Progressive loads queue built merchants for spawn_timer instead.
+ * Returns the number of spawned (or queued) merchants.
+ */
+static int load_spawn(const char* filter, int workers, int64 elapsed, bool report, bool progressive)
+{
+	const char* phases[AT_LOAD_MAX] = { "merchants", "characters", "statuses", "carts", "inventories", "vendings", "buyings", "build", "spawn" };
+	const char* types[AT_LOAD_TYPES] = { "Vending merchants", "Buying stores" };
+	int64 start = timer->gettick_nocache();
+	int64 worker_time = 0;
+	struct at_load* loads;
+	struct at_load total[AT_LOAD_TYPES] = { 0 };
+	int spawned = 0, count = 0;
+
+#if AT_LOAD_WORKERS == 0
+	workers = 1;
+#endif
+	workers = max(workers, 1);
+	CREATE(loads, struct at_load, workers * AT_LOAD_TYPES);
+	for (int i = 0; i < workers * AT_LOAD_TYPES; i++) {
+		loads[i].type = i % AT_LOAD_TYPES;
+		StrBuf->Init(&loads[i].filter);
+		if (workers > 1)
+			StrBuf->Printf(&loads[i].filter, "(%s) AND `m`.`char_id` %% %d = %d", filter, workers, i / AT_LOAD_TYPES);
+		else
+			StrBuf->AppendStr(&loads[i].filter, filter);
+	}
+
+#if AT_LOAD_WORKERS > 0
+	if (workers > 1) {
+		struct thread_handle** threads;
+		CREATE(threads, struct thread_handle*, workers);
+
+		for (int i = 0; i < workers; i++) {
+			if ((threads[i] = thread->create(load_worker, &loads[i * AT_LOAD_TYPES])) == NULL) {
+				ShowWarning("[at2] Could not start loader thread %d, loading its partition serially\n", i);
+				for (int t = 0; t < AT_LOAD_TYPES; t++)
+					load_run(map->mysql_handle, &loads[i * AT_LOAD_TYPES + t]);
+			}
+		}
+
+		for (int i = 0; i < workers; i++) {
+			if (threads[i] != NULL)
+				thread->wait(threads[i], NULL);
+		}
+		aFree(threads);
+	} else {
+		for (int t = 0; t < AT_LOAD_TYPES; t++)
+			load_run(map->mysql_handle, &loads[t]);
+	}
+#else
+	for (int t = 0; t < AT_LOAD_TYPES; t++)
+		load_run(map->mysql_handle, &loads[t]);
+#endif
+
+	int64 built = timer->gettick_nocache();
+
+	if (progressive) {
+		int entries = 0;
+		for (int i = 0; i < workers * AT_LOAD_TYPES; i++)
+			entries += loads[i].count;
+		spawn_queue_start(loads, workers * AT_LOAD_TYPES, entries);
+	}
+
+	// Spawning touches the map and databases, main thread only
+	for (int l = 0; l < workers * AT_LOAD_TYPES; l++) {
+		struct at_load* load = &loads[l];
+		struct at_load* sum = &total[load->type];
+		int64 spawn_start = timer->gettick_nocache();
+
+		if (!load->result)
+			ShowError("[at2] %s loading failed at phase '%s'\n", types[load->type], phases[load->failed_phase]);
+
+		for (int i = 0; i < load->count; i++) {
+			struct at_load_entry* e = &load->entries[i];
+			if (!e->found) {
+				ShowError("Requested non-existant character id: %d!\n", e->char_id);
+				continue;
+			}
+			e->elapsed = elapsed;
+			if (e->tc == NULL)
+				continue;
+			if (progressive ? spawn_queue_entry(e) : autotrade_clone(e))
+				sum->rows[AT_LOAD_SPAWN]++;
+		}
+		sum->duration[AT_LOAD_SPAWN] += timer->gettick_nocache() - spawn_start;
+
+		for (int i = 0; i < AT_LOAD_SPAWN; i++) {
+			sum->rows[i] += load->rows[i];
+			sum->duration[i] = max(sum->duration[i], load->duration[i]);
+			worker_time += load->duration[i];
+		}
+		sum->count += load->count;
+
+		if (!progressive)
+			load_free(load);
+		StrBuf->Destroy(&load->filter);
+	}
+
+	for (int t = 0; t < AT_LOAD_TYPES; t++) {
+		spawned += total[t].rows[AT_LOAD_SPAWN];
+		count += total[t].count;
+	}
+
+	if (report) {
+		ShowStatus("[at2] %s '"CL_WHITE"%d"CL_RESET"' of '"CL_WHITE"%d"CL_RESET"' autotrade merchants in %"PRId64" ms.\n",
+			progressive ? "Queued" : "Loaded", spawned, count, timer->gettick_nocache() - start);
+		for (int t = 0; t < AT_LOAD_TYPES; t++) {
+			ShowInfo("[at2]   %s: %d of %d\n", types[t], total[t].rows[AT_LOAD_SPAWN], total[t].count);
+			for (int i = 0; i < AT_LOAD_MAX; i++) {
+				if (total[t].rows[i] > 0 || total[t].duration[i] > 0)
+					ShowInfo("[at2]     %-11s %6d rows %6"PRId64" ms\n", phases[i], total[t].rows[i], total[t].duration[i]);
+			}
+		}
+		ShowInfo("[at2]   built with %d worker(s) in %"PRId64" ms (%"PRId64" ms of worker time)\n", workers, built - start, worker_time);
+	}
+
+	if (progressive) {
+		ShowStatus("[at2] Restoring '"CL_WHITE"%d"CL_RESET"' autotrade merchants progressively, estimated %"PRId64" ms.\n",
+			spawn_queue.count, spawn_queue_eta());
+	} else {
+		aFree(loads);
+	}
+	return spawned;
+}
+
+/**
+ * Takes ownership of the loader results, their built merchants are queued afterwards
+ */
+static void spawn_queue_start(struct at_load* loads, int load_count, int count)
+{
+	spawn_queue.loads = loads;
+	spawn_queue.load_count = load_count;
+	spawn_queue.count = spawn_queue.next = spawn_queue.spawned = 0;
+	spawn_queue.db = idb_alloc(DB_OPT_BASE);
+	spawn_queue.accounts = idb_alloc(DB_OPT_BASE);
+	spawn_queue.start = timer->gettick();
+	if (count > 0)
+		CREATE(spawn_queue.entries, struct at_load_entry*, count);
+	spawn_queue.timer = timer->add(spawn_queue.start + AT_SPAWN_INTERVAL, spawn_timer, 0, 0);
+}
+
+/**
+ * Queues a built merchant
+ */
+static bool spawn_queue_entry(struct at_load_entry* e)
+{
+	spawn_queue.entries[spawn_queue.count++] = e;
+	idb_put(spawn_queue.db, e->char_id, e);
+
+	e->account_prev = NULL;
+	e->account_next = idb_get(spawn_queue.accounts, e->account_id);
+	if (e->account_next != NULL)
+		e->account_next->account_prev = e;
+	idb_put(spawn_queue.accounts, e->account_id, e);
+	return true;
+}
+
+/**
+ * Removes a merchant from the queue indexes, its entry is skipped when its turn comes
+ */
+static void spawn_queue_drop(struct at_load_entry* e)
+{
+	idb_remove(spawn_queue.db, e->char_id);
+
+	if (e->account_prev != NULL)
+		e->account_prev->account_next = e->account_next;
+	else if (e->account_next != NULL)
+		idb_put(spawn_queue.accounts, e->account_id, e->account_next);
+	else
+		idb_remove(spawn_queue.accounts, e->account_id);
+	if (e->account_next != NULL)
+		e->account_next->account_prev = e->account_prev;
+	e->account_prev = e->account_next = NULL;
+}
+
+/**
+ * Spawns a queued merchant ahead of its turn
+ */
+static void spawn_queue_char(int char_id)
+{
+	struct at_load_entry* e;
+
+	if (spawn_queue.db == NULL || (e = idb_get(spawn_queue.db, char_id)) == NULL)
+		return;
+
+	spawn_queue_drop(e);
+	e->elapsed = timer->gettick() - spawn_queue.start;
+	if (autotrade_clone(e)) // Clears e->tc, skipped when its turn comes
+		spawn_queue.spawned++;
+}
+
+/**
+ * Spawns the queued merchants of an account ahead of their turn
+ */
+static void spawn_queue_account(int account_id)
+{
+	struct at_load_entry* e;
+
+	if (spawn_queue.db == NULL)
+		return;
+
+	while ((e = idb_get(spawn_queue.accounts, account_id)) != NULL)
+		spawn_queue_char(e->char_id);
+}
+
+/**
+ * Estimated milliseconds until every queued merchant is spawned, from the rate so far or the budget
+ */
+static int64 spawn_queue_eta(void)
+{
+	int left = spawn_queue.count - spawn_queue.next;
+	int64 elapsed = timer->gettick() - spawn_queue.start;
+
+	if (left <= 0)
+		return 0;
+	if (spawn_queue.next > 0 && elapsed > 0)
+		return left * elapsed / spawn_queue.next;
+	if (AT_SPAWN_BUDGET > 0)
+		return (int64)(left + AT_SPAWN_BUDGET - 1) / AT_SPAWN_BUDGET * AT_SPAWN_INTERVAL;
+
+	return AT_SPAWN_INTERVAL;
+}
+
+/**
+ * Releases the queue, discarding merchants that weren't spawned (they are still persisted)
+ */
+static void spawn_queue_final(void)
+{
+	if (spawn_queue.db == NULL)
+		return;
+
+	if (spawn_queue.timer != INVALID_TIMER)
+		timer->delete(spawn_queue.timer, spawn_timer);
+	spawn_queue.timer = INVALID_TIMER;
+
+	for (int i = spawn_queue.next; i < spawn_queue.count; i++) {
+		struct at_load_entry* e = spawn_queue.entries[i];
+		if (e->tc != NULL)
+			clone_discard(e->tc);
+	}
+
+	for (int i = 0; i < spawn_queue.load_count; i++)
+		load_free(&spawn_queue.loads[i]);
+	aFree(spawn_queue.loads);
+	if (spawn_queue.entries != NULL)
+		aFree(spawn_queue.entries);
+	db_destroy(spawn_queue.db);
+	db_destroy(spawn_queue.accounts);
+	spawn_queue.loads = NULL;
+	spawn_queue.entries = NULL;
+	spawn_queue.db = NULL;
+	spawn_queue.accounts = NULL;
+}
+
+/**
+ * Spawns queued merchants within the per tick budget
+ */
+static int spawn_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	int64 start = timer->gettick_nocache();
+	int spawned = 0;
+
+	spawn_queue.timer = INVALID_TIMER;
+	while (spawn_queue.next < spawn_queue.count) {
+		struct at_load_entry* e = spawn_queue.entries[spawn_queue.next++];
+
+		if (e->tc == NULL) // Spawned ahead of its turn
+			continue;
+
+		spawn_queue_drop(e);
+		e->elapsed = tick - spawn_queue.start;
+		if (autotrade_clone(e))
+			spawn_queue.spawned++;
+
+		if (AT_SPAWN_BUDGET > 0 && ++spawned >= AT_SPAWN_BUDGET)
+			break;
+		if (AT_SPAWN_BUDGET_MS > 0 && timer->gettick_nocache() - start >= AT_SPAWN_BUDGET_MS)
+			break;
+	}
+
+	if (spawn_queue.next < spawn_queue.count) {
+		spawn_queue.timer = timer->add(tick + AT_SPAWN_INTERVAL, spawn_timer, 0, 0);
+		return 0;
+	}
+
+	ShowStatus("[at2] Restored '"CL_WHITE"%d"CL_RESET"' autotrade merchants in %"PRId64" ms.\n",
+		spawn_queue.spawned, tick - spawn_queue.start);
+	spawn_queue_final();
+	return 0;
+}
+
+/**
+ * pc->autotrade_load prehook
+ *
+ * Replaces default functionality. Loads vending merchants and buying stores into clones.
+ * Every table is read once for all merchants and rows are streamed into per-character entries.
+ * With AT_LOAD_WORKERS, merchants are split by char_id and built in parallel.
+ * With AT_LAZY_LOAD, only stubs are read and merchants are spawned on demand.
+ */
+static void pc_autotrade_load_pre(void)
+{
+	hookStop(); // Don't execute original pc_autotrade_load
+
+#ifdef AT_SNAPSHOT_FILE
+	if (snapshot_load())
+		return;
+#endif
+#ifdef AT_LAZY_LOAD
+	if (stub_load())
+		return;
+	ShowWarning("[at2] Could not load autotrade stubs, spawning every merchant\n");
+#endif
+	load_spawn("1", AT_LOAD_WORKERS, 0, true, AT_SPAWN_BUDGET > 0 || AT_SPAWN_BUDGET_MS > 0);
+}
+
+/**
+ * Reads the items listed by every stub, so that shop searches only spawn the matching merchants
+ */
+static bool stub_items_load(void)
+{
+	struct SqlStmt* stmt = SQL->StmtMalloc(map->mysql_handle);
+	int char_id, nameid;
+
+	stubs.items[TD_VC] = idb_alloc(DB_OPT_BASE);
+	stubs.items[TD_BC] = idb_alloc(DB_OPT_BASE);
+
+	for (int type = TD_VC; type <= TD_BC; type++) {
+		bool result = type == TD_VC
+			? SQL_SUCCESS == SQL->StmtPrepare(stmt, "SELECT `d`.`char_id`,`c`.`nameid` FROM `%s` AS `d` "
+				"JOIN `%s` AS `c` ON `c`.`id` = `d`.`itemkey`", map->autotrade_data_db, cart_db)
+			: SQL_SUCCESS == SQL->StmtPrepare(stmt, "SELECT `char_id`,`nameid` FROM `%s`", buyers_data_db);
+
+		if (!result
+			|| SQL_ERROR == SQL->StmtExecute(stmt)
+			|| SQL_ERROR == SQL->StmtBindColumn(stmt, 0, SQLDT_INT, &char_id, sizeof char_id, NULL, NULL)
+			|| SQL_ERROR == SQL->StmtBindColumn(stmt, 1, SQLDT_INT, &nameid, sizeof nameid, NULL, NULL)) {
+			SqlStmt_ShowDebug(stmt);
+			SQL->StmtFree(stmt);
+			stub_items_final();
+			return false;
+		}
+
+		while (SQL_SUCCESS == SQL->StmtNextRow(stmt)) {
+			struct at_stub_item* it;
+
+			if (idb_get(stubs.db, char_id) == NULL)
+				continue;
+
+			CREATE(it, struct at_stub_item, 1);
+			it->char_id = char_id;
+			it->next = idb_get(stubs.items[type], nameid);
+			idb_put(stubs.items[type], nameid, it);
+		}
+	}
+
+	SQL->StmtFree(stmt);
+	return true;
+}
+
+/**
+ * Releases the stub item index
+ */
+static void stub_items_final(void)
+{
+	for (int type = TD_VC; type <= TD_BC; type++) {
+		if (stubs.items[type] == NULL)
+			continue;
+
+		struct DBIterator* iter = db_iterator(stubs.items[type]);
+		for (struct at_stub_item* it = dbi_first(iter); dbi_exists(iter); it = dbi_next(iter)) {
+			while (it != NULL) {
+				struct at_stub_item* next = it->next;
+				aFree(it);
+				it = next;
+			}
+		}
+		dbi_destroy(iter);
+		db_destroy(stubs.items[type]);
+		stubs.items[type] = NULL;
+	}
+}
+
+/**
+ * Reads the char id and map of every persisted merchant as stubs
+ */
+static bool stub_load(void)
+{
+	struct SqlStmt* stmt = SQL->StmtMalloc(map->mysql_handle);
+	int64 start = timer->gettick_nocache();
+	int account_id, char_id;
+	char last_map[MAP_NAME_LENGTH_EXT];
+	int maps = 0, skipped = 0;
+
+	if (SQL_ERROR == SQL->StmtPrepare(stmt, "SELECT `m`.`account_id`,`m`.`char_id`,`c`.`last_map` "
+		"FROM (SELECT `account_id`,`char_id` FROM `%s` UNION ALL SELECT `account_id`,`char_id` FROM `%s`) AS `m` "
+		"JOIN `%s` AS `c` ON `c`.`char_id` = `m`.`char_id`", map->autotrade_merchants_db, buyers_db, character_db)
+		|| SQL_ERROR == SQL->StmtExecute(stmt)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 0, SQLDT_INT, &account_id, sizeof account_id, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 1, SQLDT_INT, &char_id, sizeof char_id, NULL, NULL)
+		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 2, SQLDT_STRING, &last_map, sizeof last_map, NULL, NULL)) {
+		SqlStmt_ShowDebug(stmt);
+		SQL->StmtFree(stmt);
+		return false;
+	}
+
+	CREATE(stubs.maps, struct at_stub*, map->count);
+	stubs.loaded = timer->gettick();
+
+	while (SQL_SUCCESS == SQL->StmtNextRow(stmt)) {
+		struct at_stub* stub;
+		int16 m = map->mapname2mapid(last_map);
+
+		if (m < 0) {
+			ShowError("[at2] Unknown map '%s' for autotrade character %d\n", last_map, char_id);
+			skipped++;
+			continue;
+		}
+
+		CREATE(stub, struct at_stub, 1);
+		stub->char_id = char_id;
+		stub->account_id = account_id;
+		stub->m = m;
+		stub->next = stubs.maps[m];
+		if (stub->next != NULL)
+			stub->next->prev = stub;
+		else
+			maps++;
+		stubs.maps[m] = stub;
+		stub->account_next = idb_get(stubs.accounts, account_id);
+		if (stub->account_next != NULL)
+			stub->account_next->account_prev = stub;
+		idb_put(stubs.accounts, account_id, stub);
+		idb_put(stubs.db, char_id, stub);
+		stubs.count++;
+	}
+
+	SQL->StmtFree(stmt);
+
+	if (!(stubs.items_loaded = stub_items_load()))
+		ShowWarning("[at2] Could not load the items of autotrade stubs, shop searches will spawn every merchant\n");
+
+	ShowStatus("[at2] Loaded '"CL_WHITE"%d"CL_RESET"' autotrade merchants on %d maps as stubs in %"PRId64" ms, spawned on demand.\n",
+		stubs.count, maps, timer->gettick_nocache() - start);
+	if (skipped > 0)
+		ShowWarning("[at2] Skipped %d autotrade merchants on unknown maps\n", skipped);
+
+	return true;
+}
+
+/**
+ * Builds a clone from a loaded entry. Doesn't touch any shared state, safe from loader threads.
+ */
+static struct trade_clone* autotrade_build(const struct at_load_entry* e)
+{
+	struct trade_clone* tc;
+	CREATE(tc, struct trade_clone, 1);
+
+	tc->type = e->type;
+	tc->release_timer = INVALID_TIMER;
+	tc->account_id = e->account_id;
+	tc->char_id = e->char_id;
+	tc->sex = e->sex;
+	tc->zeny = e->zeny;
+	safestrncpy(tc->message, e->title, MESSAGE_SIZE);
+	tc->group_id = e->group_id;
+	tc->payload = clone_payload_create(e->type);
+	tc->max_weight = e->max_weight;
+	tc->inventory_size = e->inventory_size;
+	tc->options.pushcart = e->pushcart;
+	tc->options.time = e->timeout;
+
+	autotrade_populate(tc, e);
+
+	return tc;
+}
+
+/**
+ * Spawns a built clone from a loaded entry
+ */
+static bool autotrade_clone(struct at_load_entry* e)
+{
+	struct trade_clone* tc = e->tc;
+	int class_;
+	int16 m = map->mapname2mapid(e->last_map);
+
+	e->tc = NULL;
+
+	if (m < 0) {
+		ShowError("[at2] Unknown map '%s' for autotrade character %d\n", e->last_map, e->char_id);
+		clone_discard(tc);
+		return false;
+	}
+
+	struct mob_db* mdb;
+	if ((class_ = clone_class_alloc(&mdb)) < 0) {
+		clone_discard(tc);
+		return false;
+	}
+
+	struct status_data* mstatus = &mdb->status;
+
+	mdb->option = 0;
+	mstatus->mode = 0;
+	mstatus->hp = mstatus->max_hp = 1;
+	mdb->lv = e->lv;
+	memcpy(&mdb->vd, &e->vd, sizeof(struct view_data));
+	safestrncpy(mdb->name, e->name, NAME_LENGTH);
+	safestrncpy(mdb->sprite, e->name, NAME_LENGTH);
+	safestrncpy(mdb->jname, e->name, NAME_LENGTH);
+
+	// Create monster
+	struct mob_data* md = mob->once_spawn_sub(NULL, m, e->x, e->y, mdb->name, class_, "", SZ_SMALL, AI_NONE, 0);
+	if (md == NULL) {
+		clone_class_free(class_);
+		clone_discard(tc);
+		return false;
+	}
+	md->special_state.clone = 1;
+	mob->spawn(md);
+	unit->set_dir(&md->bl, UNIT_DIR_SOUTH);
+
+	tc->md = md;
+	tc->persist_gen = ++persist.gen;
+	addToMOBDATA(md, tc, 0, true);
+	clone_id_set(md->bl.id, true);
+
+	tc->vender_id = ++vending->next_id;
+	tc->buyer_id = buyingstore->getuid();
+
+	if (battle->bc->at_timeout) {
+		int timeout = tc->options.time >= 0 ? tc->options.time : battle->bc->at_timeout * 60000;
+		timeout = (int)max(timeout - e->elapsed, 0);
+		tc->options.time = timeout;
+		sched_add(tc, timer->gettick() + timeout);
+	}
+
+	if (map->list[m].users && tc->type == TD_VC)
+		clif->showvendingboard(&md->bl, tc->message, 0);
+	else if (map->list[m].users)
+		clif->buyingstore_entry(clone_sd(tc, true));
+
+	// Store for easy access
+	idb_put(clone_db, tc->char_id, tc);
+	account_attach(tc);
+	if (tc->type == TD_VC)
+		idb_put(vender_db, tc->vender_id, tc);
+	else
+		idb_put(buyer_db, tc->buyer_id, tc);
+	clone_index(tc);
+
+	return true;
+}
+
+/**
+ * Moves loaded cart, vending and buying store data into the clone
+ */
+static void autotrade_populate(struct trade_clone* tc, const struct at_load_entry* e)
+{
+	struct at_payload* payload = tc->payload;
+
+	memcpy(payload->cart, e->cart, sizeof(struct item) * e->cart_num);
+	memcpy(payload->vending, e->vending, sizeof(struct s_vending) * e->vend_num);
+	payload->vend_num = e->vend_num;
+
+	// Calc weight & num
+	for (int i = 0; i < e->cart_num; i++) {
+		if (payload->cart[i].nameid == 0)
+			continue;
+		tc->cart_weight += itemdb_weight(payload->cart[i].nameid) * payload->cart[i].amount;
+		tc->cart_num++;
+	}
+
+	// Loaded rows are known, saves can start incremental
+	tc->items[AT_TABLE_CART] = item_state_create(payload->cart, MAX_CART, true);
+
+	if (tc->type != TD_BC)
+		return;
+
+	memcpy(payload->inventory, e->inventory, sizeof(struct item) * e->inventory_num);
+	memcpy(&payload->buyingstore, &e->buyingstore, sizeof(struct s_buyingstore));
+
+	for (int i = 0; i < e->inventory_num; i++) {
+		if (payload->inventory[i].nameid != 0)
+			tc->weight += itemdb_weight(payload->inventory[i].nameid) * payload->inventory[i].amount;
+	}
+
+	tc->items[AT_TABLE_INVENTORY] = item_state_create(payload->inventory, MAX_INVENTORY, true);
+}
+
+#ifdef AT_SNAPSHOT_FILE
+/**
+ * Writes a block of the snapshot body, accounting it in the checksum and size
+ */
+static bool snapshot_write_data(FILE* fp, uint64* hash, uint64* size, const void* data, size_t len)
+{
+	if (len == 0)
+		return true;
+
+	*hash = at_checksum(*hash, data, len);
+	*size += len;
+
+	return fwrite(data, len, 1, fp) == 1;
+}
+
+/**
+ * Writes every trade clone to the snapshot. Clones must be written back (no adapters) and saves flushed.
+ */
+static void snapshot_write(void)
+{
+	char tmp[256];
+	struct at_snapshot_header header = { { 'A', 'T', '2', 'S' }, AT_SNAPSHOT_VERSION, sizeof(struct at_snapshot_record), sizeof(struct item) };
+	int64 tick = timer->gettick();
+	int64 start = timer->gettick_nocache();
+	bool result = true;
+	FILE* fp;
+
+#if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
+	if (stubs.count > 0 || spawn_queue.db != NULL) {
+		ShowInfo("[at2] Not every merchant is spawned, skipping the autotrade snapshot\n");
+		remove(AT_SNAPSHOT_FILE);
+		return;
+	}
+#endif
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", AT_SNAPSHOT_FILE);
+	if ((fp = fopen(tmp, "wb")) == NULL) {
+		ShowError("[at2] Could not open '%s' for writing the autotrade snapshot\n", tmp);
+		return;
+	}
+
+	header.checksum = UINT64_C(0xcbf29ce484222325);
+	result = fwrite(&header, sizeof(header), 1, fp) == 1; // Rewritten once the body is known
+
+	struct DBIterator* iter = db_iterator(clone_db);
+	for (struct trade_clone* tc = dbi_first(iter); result && dbi_exists(iter); tc = dbi_next(iter)) {
+		struct mob_data* md = tc->md;
+		struct at_payload* payload = clone_payload(tc);
+		struct at_snapshot_record rec;
+		int i;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.char_id = tc->char_id;
+		rec.account_id = tc->account_id;
+		rec.group_id = tc->group_id;
+		rec.sex = tc->sex;
+		rec.zeny = tc->zeny;
+		rec.type = tc->type;
+		rec.weight = tc->weight;
+		rec.max_weight = tc->max_weight;
+		rec.inventory_size = tc->inventory_size;
+		rec.pushcart = tc->options.pushcart;
+		rec.timeout = tc->scheduled ? (int)max(tc->options.expire - tick, 0) : -1;
+		rec.lv = md->db->lv;
+		rec.x = md->bl.x;
+		rec.y = md->bl.y;
+		rec.dir = (int16)unit->getdir(&md->bl);
+		safestrncpy(rec.name, md->name, NAME_LENGTH);
+		safestrncpy(rec.map, map->list[md->bl.m].name, MAP_NAME_LENGTH_EXT);
+		safestrncpy(rec.message, tc->message, MESSAGE_SIZE);
+		memcpy(&rec.vd, &md->db->vd, sizeof(rec.vd));
+		memcpy(&rec.buyingstore, &payload->buyingstore, sizeof(rec.buyingstore));
+
+		for (i = MAX_CART; i > 0 && payload->cart[i - 1].nameid == 0; i--);
+		rec.cart_slots = i;
+		if (payload->inventory != NULL) {
+			for (i = MAX_INVENTORY; i > 0 && payload->inventory[i - 1].nameid == 0; i--);
+			rec.inventory_slots = i;
+		}
+		rec.vend_num = payload->vend_num;
+
+		result = snapshot_write_data(fp, &header.checksum, &header.size, &rec, sizeof(rec))
+			&& snapshot_write_data(fp, &header.checksum, &header.size, payload->cart, sizeof(struct item) * rec.cart_slots)
+			&& snapshot_write_data(fp, &header.checksum, &header.size, payload->inventory, sizeof(struct item) * rec.inventory_slots)
+			&& snapshot_write_data(fp, &header.checksum, &header.size, payload->vending, sizeof(struct s_vending) * rec.vend_num);
+
+		header.count++;
+		if (tc->type == TD_VC)
+			header.vendings++;
+		else
+			header.buyings++;
+	}
+	dbi_destroy(iter);
+
+	header.written = (int64)time(NULL);
+	result = result && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+	result = fclose(fp) == 0 && result;
+
+	if (result) {
+		remove(AT_SNAPSHOT_FILE); // Windows doesn't replace on rename
+		result = rename(tmp, AT_SNAPSHOT_FILE) == 0;
+	}
+
+	if (!result) {
+		ShowError("[at2] Could not write the autotrade snapshot '%s'\n", AT_SNAPSHOT_FILE);
+		remove(tmp);
+		return;
+	}
+
+	ShowStatus("[at2] Wrote '"CL_WHITE"%u"CL_RESET"' autotrade merchants to the snapshot (%"PRIu64" KB) in %"PRId64" ms.\n",
+		header.count, header.size / 1024, timer->gettick_nocache() - start);
+}
+
+/**
+ * Validates the layout, size and checksum of a mapped snapshot, before anything is spawned
+ */
+static bool snapshot_check(const uint8* data, size_t size)
+{
+	const struct at_snapshot_header* header = (const struct at_snapshot_header*)data;
+
+	if (size < sizeof(*header) || memcmp(header->magic, "AT2S", 4) != 0 || header->version != AT_SNAPSHOT_VERSION
+		|| header->record_size != sizeof(struct at_snapshot_record) || header->item_size != sizeof(struct item)) {
+		ShowWarning("[at2] Autotrade snapshot of a different version or server build, ignoring it\n");
+		return false;
+	}
+
+	if (header->size != size - sizeof(*header)
+		|| header->checksum != at_checksum(UINT64_C(0xcbf29ce484222325), data + sizeof(*header), size - sizeof(*header))) {
+		ShowWarning("[at2] Autotrade snapshot is corrupted, ignoring it\n");
+		return false;
+	}
+
+	// Walk the records so spawning never reads out of bounds
+	size_t pos = sizeof(*header);
+	for (uint32 i = 0; i < header->count; i++) {
+		const struct at_snapshot_record* rec = (const struct at_snapshot_record*)(data + pos);
+
+		if (size - pos < sizeof(*rec)
+			|| rec->cart_slots < 0 || rec->cart_slots > MAX_CART
+			|| rec->inventory_slots < 0 || rec->inventory_slots > MAX_INVENTORY
+			|| rec->vend_num < 0 || rec->vend_num > MAX_VENDING
+			|| (rec->type == TD_VC && rec->inventory_slots != 0)) {
+			ShowWarning("[at2] Autotrade snapshot has an invalid record, ignoring it\n");
+			return false;
+		}
+
+		pos += sizeof(*rec) + sizeof(struct item) * (rec->cart_slots + rec->inventory_slots) + sizeof(struct s_vending) * rec->vend_num;
+		if (pos > size) {
+			ShowWarning("[at2] Autotrade snapshot is truncated, ignoring it\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Checks that the autotrade tables weren't written after the snapshot.
+ * Merchant carts are only written by this server while their clone lives, the snapshot includes them.
+ */
+static bool snapshot_fresh(const struct at_snapshot_header* header)
+{
+	char* data;
+	int64 updated = 0;
+	uint32 merchants = 0, buyers = 0;
+
+	if (SQL_ERROR == SQL->Query(map->mysql_handle, "SELECT UNIX_TIMESTAMP(MAX(`UPDATE_TIME`)) FROM `information_schema`.`TABLES` "
+		"WHERE `TABLE_SCHEMA` = DATABASE() AND `TABLE_NAME` IN ('%s', '%s', '%s', '%s')",
+		map->autotrade_merchants_db, map->autotrade_data_db, buyers_db, buyers_data_db)) {
+		Sql_ShowDebug(map->mysql_handle);
+		return false;
+	}
+	if (SQL_SUCCESS == SQL->NextRow(map->mysql_handle) && SQL->GetData(map->mysql_handle, 0, &data, NULL) == SQL_SUCCESS && data != NULL)
+		updated = strtoll(data, NULL, 10); // NULL if the server doesn't track it (kept in memory by InnoDB)
+	SQL->FreeResult(map->mysql_handle);
+
+	if (SQL_ERROR == SQL->Query(map->mysql_handle, "SELECT (SELECT COUNT(*) FROM `%s`), (SELECT COUNT(*) FROM `%s`)",
+		map->autotrade_merchants_db, buyers_db)) {
+		Sql_ShowDebug(map->mysql_handle);
+		return false;
+	}
+	if (SQL_SUCCESS == SQL->NextRow(map->mysql_handle)) {
+		if (SQL->GetData(map->mysql_handle, 0, &data, NULL) == SQL_SUCCESS)
+			merchants = (uint32)strtoul(data, NULL, 10);
+		if (SQL->GetData(map->mysql_handle, 1, &data, NULL) == SQL_SUCCESS)
+			buyers = (uint32)strtoul(data, NULL, 10);
+	}
+	SQL->FreeResult(map->mysql_handle);
+
+	if (updated > header->written || merchants != header->vendings || buyers != header->buyings) {
+		ShowInfo("[at2] Autotrade tables changed after the snapshot was written, loading from SQL\n");
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Spawns every clone of a checked snapshot, returns the number of spawned clones
+ */
+static int snapshot_spawn(const uint8* data)
+{
+	const struct at_snapshot_header* header = (const struct at_snapshot_header*)data;
+	struct at_load_entry* e;
+	size_t pos = sizeof(*header);
+	int spawned = 0;
+
+	CREATE(e, struct at_load_entry, 1);
+
+	for (uint32 i = 0; i < header->count; i++) {
+		const struct at_snapshot_record* rec = (const struct at_snapshot_record*)(data + pos);
+		const struct item* cart = (const struct item*)(data + pos + sizeof(*rec));
+		const struct item* inventory = cart + rec->cart_slots;
+		const struct s_vending* vending = (const struct s_vending*)(inventory + rec->inventory_slots);
+		struct trade_clone* tc;
+
+		pos += sizeof(*rec) + sizeof(struct item) * (rec->cart_slots + rec->inventory_slots) + sizeof(struct s_vending) * rec->vend_num;
+
+		CREATE(tc, struct trade_clone, 1);
+		tc->type = rec->type == TD_BC ? TD_BC : TD_VC;
+		tc->release_timer = INVALID_TIMER;
+		tc->char_id = rec->char_id;
+		tc->account_id = rec->account_id;
+		tc->group_id = rec->group_id;
+		tc->sex = rec->sex;
+		tc->zeny = rec->zeny;
+		tc->weight = rec->weight;
+		tc->max_weight = rec->max_weight;
+		tc->inventory_size = rec->inventory_size;
+		tc->options.pushcart = rec->pushcart;
+		tc->options.time = rec->timeout;
+		safestrncpy(tc->message, rec->message, MESSAGE_SIZE);
+
+		struct at_payload* payload = tc->payload = clone_payload_create(tc->type);
+		memcpy(payload->cart, cart, sizeof(struct item) * rec->cart_slots);
+		if (payload->inventory != NULL)
+			memcpy(payload->inventory, inventory, sizeof(struct item) * rec->inventory_slots);
+		memcpy(payload->vending, vending, sizeof(struct s_vending) * rec->vend_num);
+		payload->vend_num = rec->vend_num;
+		memcpy(&payload->buyingstore, &rec->buyingstore, sizeof(payload->buyingstore));
+
+		for (int j = 0; j < rec->cart_slots; j++) {
+			if (payload->cart[j].nameid == 0)
+				continue;
+			tc->cart_weight += itemdb_weight(payload->cart[j].nameid) * payload->cart[j].amount;
+			tc->cart_num++;
+		}
+
+		// Rows may have moved since the snapshot was taken, first saves reconcile them
+		tc->items[AT_TABLE_CART] = item_state_create(NULL, MAX_CART, false);
+		if (tc->type == TD_BC)
+			tc->items[AT_TABLE_INVENTORY] = item_state_create(NULL, MAX_INVENTORY, false);
+
+		e->char_id = rec->char_id;
+		e->lv = rec->lv;
+		e->x = rec->x;
+		e->y = rec->y;
+		memcpy(&e->vd, &rec->vd, sizeof(e->vd));
+		safestrncpy(e->name, rec->name, NAME_LENGTH);
+		safestrncpy(e->last_map, rec->map, MAP_NAME_LENGTH_EXT);
+		e->tc = tc;
+
+		if (!autotrade_clone(e))
+			continue;
+
+		unit->set_dir(&tc->md->bl, (enum unit_dir)rec->dir);
+		if (rec->vd.dead_sit == 2)
+			clif->sitting(&tc->md->bl);
+		spawned++;
+	}
+
+	aFree(e);
+	return spawned;
+}
+
+/**
+ * Restores the market from the snapshot if there's a valid and fresh one. It's removed afterwards either way.
+ */
+static bool snapshot_load(void)
+{
+	int64 start = timer->gettick_nocache();
+	uint8* data = NULL;
+	size_t size = 0;
+	int spawned = -1;
+
+#ifndef WIN32
+	int fd = open(AT_SNAPSHOT_FILE, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		size = (size_t)st.st_size;
+		if ((data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+			data = NULL;
+	}
+	close(fd);
+#else
+	FILE* fp = fopen(AT_SNAPSHOT_FILE, "rb");
+
+	if (fp == NULL)
+		return false;
+
+	if (fseek(fp, 0, SEEK_END) == 0 && (size = (size_t)ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0) {
+		data = aMalloc(size);
+		if (fread(data, size, 1, fp) != 1) {
+			aFree(data);
+			data = NULL;
+		}
+	}
+	fclose(fp);
+#endif
+
+	if (data == NULL)
+		ShowWarning("[at2] Could not read the autotrade snapshot '%s'\n", AT_SNAPSHOT_FILE);
+	else if (snapshot_check(data, size) && snapshot_fresh((const struct at_snapshot_header*)data))
+		spawned = snapshot_spawn(data);
+
+	if (data != NULL) {
+#ifndef WIN32
+		munmap(data, size);
+#else
+		aFree(data);
+#endif
+	}
+
+	// A snapshot is only valid for the restart that follows it
+	remove(AT_SNAPSHOT_FILE);
+
+	if (spawned < 0)
+		return false;
+
+	ShowStatus("[at2] Restored '"CL_WHITE"%d"CL_RESET"' autotrade merchants from the snapshot in %"PRId64" ms.\n",
+		spawned, timer->gettick_nocache() - start);
+	return true;
+}
+#endif
+
+#endif
+
+/**
+ * Gets gender of character
+ */
+static int char_getgender(char sex, char sex2)
+{
+	switch (sex) {
+	case 'M':
+		return SEX_MALE;
+	case 'F':
+		return SEX_FEMALE;
+	case 'U':
+	default:
+		if (sex2)
+			return char_getgender(sex2, 0);
+		else
+			return 99;
+	}
+}
+
+/**
+ * char->delete_char_sql posthook
+ *
+ * Sends a packet informing of a char delection to the map server
+ * so the map server can delete the related clone if any
+ */
+static int char_delete_char_sql_post(int result, int char_id)
+{
+	if (result == 0) {
+		uint8 buf[6];
+		WBUFW(buf, 0) = CHAR_MAP_PACKET_ID;
+		WBUFL(buf, 2) = char_id;
+		mapif->send(buf, 6);
+	}
+
+	return 0;
+}
+
+/**
+ * Parses packet informing of a char deletion in the char server.
+ * Removes clone if any found.
+ */
+static void parse_delete_char_packet(int fd)
+{
+	int char_id = RFIFOL(fd, 2);
+
+	if (char_id) {
+		stub_spawn_char(char_id);
+		remove_clone(char_id);
+	}
+}
+
+/**
+ * Makes trade clones not targeteable to other players
+ */
+int battle_check_target_post(int retval, struct block_list* src, struct block_list* target, int flag)
+{
+	if (retval == 1 && target->type == BL_MOB && clone_id_test(target->id)) {
+		struct base_data* bd = getFromMOBDATA((struct mob_data*)target, 0);
+		if (bd != NULL)
+			return -1;
+	}
+	return retval;
+}
+
+/**
+ * Starts the clone scheduler
+ */
+static void sched_init(void)
+{
+	int64 tick = timer->gettick();
+
+	sched.cursor = tick / AT_SCHED_RESOLUTION;
+	sched.last_save = tick;
+	sched.timer = timer->add_interval(tick + AT_SCHED_RESOLUTION, sched_timer, 0, 0, AT_SCHED_RESOLUTION);
+}
+
+/**
+ * Schedules the timeout of a clone
+ */
+static void sched_add(struct trade_clone* tc, int64 expire)
+{
+	int64 slot = max(expire / AT_SCHED_RESOLUTION, sched.cursor + 1); // Past slots are only checked again next turn
+	int index = (int)(slot % AT_SCHED_BUCKETS);
+	struct trade_clone** bucket = &sched.buckets[index];
+
+	sched_remove(tc);
+
+	tc->options.expire = expire;
+	tc->scheduled = true;
+	tc->sched_bucket = index;
+	tc->sched_prev = NULL;
+	tc->sched_next = *bucket;
+	if (*bucket != NULL)
+		(*bucket)->sched_prev = tc;
+	*bucket = tc;
+	sched.count++;
+}
+
+/**
+ * Unschedules the timeout of a clone
+ */
+static void sched_remove(struct trade_clone* tc)
+{
+	if (!tc->scheduled)
+		return;
+
+	if (tc->sched_prev != NULL)
+		tc->sched_prev->sched_next = tc->sched_next;
+	else
+		sched.buckets[tc->sched_bucket] = tc->sched_next;
+	if (tc->sched_next != NULL)
+		tc->sched_next->sched_prev = tc->sched_prev;
+
+	tc->scheduled = false;
+	tc->sched_prev = tc->sched_next = NULL;
+	sched.count--;
+}
+
+/**
+ * Writes the remaining time of every scheduled clone as one batch
+ */
+static void sched_save(int64 tick)
+{
+	struct at_persist_batch* batch;
+
+	sched.last_save = tick;
+	if (sched.count == 0)
+		return;
+
+	CREATE(batch, struct at_persist_batch, 1);
+	CREATE(batch->char_ids, int, sched.count);
+	CREATE(batch->ticks, int, sched.count);
+	batch->seq = ++sched.saves;
+
+	for (int i = 0; i < AT_SCHED_BUCKETS; i++) {
+		for (struct trade_clone* tc = sched.buckets[i]; tc != NULL; tc = tc->sched_next) {
+			tc->options.time = (int)max(tc->options.expire - tick, 1);
+			batch->char_ids[batch->count] = tc->char_id;
+			batch->ticks[batch->count] = tc->options.time;
+			batch->count++;
+		}
+	}
+
+	sched.last_saved = batch->count;
+	sched.last_statements = (batch->count + AT_SCHED_BATCH - 1) / AT_SCHED_BATCH;
+	persist_push_batch(batch);
+}
+
+/**
+ * Clone scheduler. Removes expired clones in a batch and saves remaining times every autosave interval.
+ */
+static int sched_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	int64 slot = tick / AT_SCHED_RESOLUTION;
+	int64 from = max(sched.cursor + 1, slot - AT_SCHED_BUCKETS + 1);
+	struct trade_clone* expired = NULL;
+	int count = 0;
+
+	// Unlink expired clones first, removal frees them
+	for (int64 s = from; s <= slot; s++) {
+		struct trade_clone* tc = sched.buckets[s % AT_SCHED_BUCKETS];
+		while (tc != NULL) {
+			struct trade_clone* next = tc->sched_next;
+			if (tc->options.expire <= tick) {
+				sched_remove(tc);
+				tc->sched_next = expired;
+				expired = tc;
+				count++;
+			}
+			tc = next;
+		}
+	}
+	sched.cursor = max(sched.cursor, slot);
+
+	if (count > 0) {
+		struct at_persist_batch* batch;
+		CREATE(batch, struct at_persist_batch, 1);
+		CREATE(batch->char_ids, int, count);
+		batch->remove = true;
+
+		while (expired != NULL) {
+			struct trade_clone* next = expired->sched_next;
+			expired->sched_next = NULL;
+			batch->char_ids[batch->count++] = expired->char_id;
+			remove_clone_sub(expired, false);
+			expired = next;
+		}
+
+		ShowInfo("[at2] Removed %d expired clone(s)\n", count);
+		persist_push_batch(batch);
+	}
+
+	if (tick - sched.last_save >= map->autosave_interval)
+		sched_save(tick);
+
+	return 0;
+}
+
+/**
+ * Timed function for exiting the server with a small delay
+ * Note: this is necessary as to not freeze the client
+ */
+static int map_quit_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	struct map_session_data* sd = map->id2sd(id);
+	if (sd != NULL) {
+		map->quit(sd);
+	}
+
+	return 0;
+}
+
+/**
+ * Hands the player's shop over to a new clone: the char server is told to leave the tables
+ * now owned by the clone out of the player's final save, and the session is released on the char-select acknowledge
+ */
+static void handoff_start(struct trade_clone* tc)
+{
+	tc->handoff.state = AT_HANDOFF_SELECT;
+	tc->handoff.tick = timer->gettick();
+	tc->handoff.held = 0;
+	tc->handoff.timer = timer->add(tc->handoff.tick + AT_HANDOFF_TIMEOUT, handoff_timer, tc->char_id, tc->persist_gen);
+	handoff_stats.count++;
+
+	if (chrif->isconnected()) {
+		int fd = chrif->fd;
+
+		WFIFOHEAD(fd, 7);
+		WFIFOW(fd, 0) = MAP_CHAR_PACKET_ID;
+		WFIFOL(fd, 2) = tc->char_id;
+		WFIFOB(fd, 6) = 1 << AT_TABLE_CART | (tc->type == TD_BC ? 1 << AT_TABLE_INVENTORY : 0);
+		WFIFOSET(fd, 7);
+	}
+}
+
+/**
+ * Releases the session of the player behind a clone, if still there, and waits for its final save
+ */
+static void handoff_quit(struct trade_clone* tc, struct map_session_data* sd)
+{
+	int64 elapsed = timer->gettick() - tc->handoff.tick;
+
+	handoff_stats.released++;
+	handoff_stats.select_total += elapsed;
+	handoff_stats.select_max = max(handoff_stats.select_max, elapsed);
+
+	if (tc->handoff.timer != INVALID_TIMER)
+		timer->delete(tc->handoff.timer, handoff_timer);
+	tc->handoff.state = AT_HANDOFF_QUIT;
+	tc->handoff.timer = timer->add(timer->gettick() + AT_HANDOFF_HOLD, handoff_timer, tc->char_id, tc->persist_gen);
+
+	if (sd != NULL)
+		map->quit(sd);
+}
+
+/**
+ * The player's final save went through, writes the clone saves held meanwhile
+ */
+static void handoff_end(struct trade_clone* tc)
+{
+	int64 elapsed = timer->gettick() - tc->handoff.tick;
+	unsigned int held = handoff_clear(tc);
+
+	handoff_stats.saved++;
+	handoff_stats.save_total += elapsed;
+	handoff_stats.save_max = max(handoff_stats.save_max, elapsed);
+
+	if (held != 0)
+		persist_push(tc, held);
+}
+
+/**
+ * Stops a handover, returning the saves held by it
+ */
+static unsigned int handoff_clear(struct trade_clone* tc)
+{
+	unsigned int held = tc->handoff.held;
+
+	if (tc->handoff.timer != INVALID_TIMER)
+		timer->delete(tc->handoff.timer, handoff_timer);
+	tc->handoff.timer = INVALID_TIMER;
+	tc->handoff.state = AT_HANDOFF_NONE;
+	tc->handoff.held = 0;
+
+	return held;
+}
+
+/**
+ * Handover fallbacks: quits the player when the char-select is never acknowledged,
+ * and stops holding saves when the final save is never acknowledged
+ */
+static int handoff_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	struct trade_clone* tc = idb_get(clone_db, id);
+
+	if (tc == NULL || tc->persist_gen != (int)data || tc->handoff.timer != tid)
+		return 0;
+
+	tc->handoff.timer = INVALID_TIMER;
+	if (tc->handoff.state == AT_HANDOFF_SELECT) {
+		struct map_session_data* sd = map->id2sd(tc->account_id);
+
+		handoff_stats.fallbacks++;
+		handoff_quit(tc, sd != NULL && sd != tc->sd && sd->status.char_id == tc->char_id ? sd : NULL);
+	} else if (tc->handoff.state == AT_HANDOFF_QUIT) {
+		unsigned int held = handoff_clear(tc);
+
+		ShowWarning("[at2] Final save of character %d wasn't acknowledged after %d ms, saving its clone anyway\n", tc->char_id, AT_HANDOFF_HOLD);
+		handoff_stats.expired++;
+		if (held != 0)
+			persist_push(tc, held);
+	}
+
+	return 0;
+}
+
+/**
+ * clif->charselectok posthook
+ *
+ * Release the session of a player that went @at as soon as the char server lets it go
+ */
+static void clif_charselectok_post(int id, uint8 ok)
+{
+	struct map_session_data* sd = map->id2sd(id);
+	struct trade_clone* tc;
+
+	if (sd == NULL || (tc = idb_get(clone_db, sd->status.char_id)) == NULL || tc->sd == sd)
+		return;
+
+	if (tc->handoff.state == AT_HANDOFF_SELECT)
+		handoff_quit(tc, sd);
+}
+
+/**
+ * chrif->auth_delete posthook
+ *
+ * Final save of a player that went @at acknowledged, its clone can be saved
+ */
+static bool chrif_auth_delete_post(bool retVal, int account_id, int char_id, enum sd_state state)
+{
+	struct trade_clone* tc;
+
+	if (state == ST_LOGOUT && (tc = idb_get(clone_db, char_id)) != NULL && tc->handoff.state != AT_HANDOFF_NONE)
+		handoff_end(tc);
+
+	return retVal;
+}
+
+/**
+ * Char server notice of an @at: the next save of the character leaves the tables taken over by its clone alone
+ */
+static void parse_handoff_packet(int fd)
+{
+	int char_id = RFIFOL(fd, 2);
+	int tables = RFIFOB(fd, 6);
+
+	if (char_id != 0 && tables != 0)
+		idb_iput(handoff_db, char_id, tables);
+}
+
+/**
+ * chr->mmo_char_tosql prehook
+ *
+ * Keep the cached cart, inventory and zeny of a character that just went @at, its clone saves them
+ */
+static int chr_mmo_char_tosql_pre(int* char_id, struct mmo_charstatus** p)
+{
+	int tables = idb_iget(handoff_db, *char_id);
+
+	if (tables == 0)
+		return 0;
+	idb_remove(handoff_db, *char_id);
+
+	const struct mmo_charstatus* cp = idb_get(chr->char_db_, *char_id);
+	if (cp == NULL) // Nothing cached to compare with, written as is
+		return 0;
+
+	(*p)->zeny = cp->zeny;
+	if (tables & (1 << AT_TABLE_CART))
+		memcpy((*p)->cart, cp->cart, sizeof(cp->cart));
+	if (tables & (1 << AT_TABLE_INVENTORY))
+		memcpy((*p)->inventory, cp->inventory, sizeof(cp->inventory));
+
+	return 0;
+}
+
+/**
+ * chr->mmo_char_fromsql prehook
+ *
+ * A character being loaded again left its @at save notice unused, drop it
+ */
+static int chr_mmo_char_fromsql_pre(int* char_id, struct mmo_charstatus** p, bool* load_everything)
+{
+	idb_remove(handoff_db, *char_id);
+	return 0;
+}
+
+/**
+ * pc->cart_additem posthook
+ *
+ * Stacks can land on any slot, flag the whole cart of clones
+ */
+static int pc_cart_additem_post(int retVal, struct map_session_data* sd, struct item* item_data, int amount, enum e_log_pick_type log_type)
+{
+	if (retVal == 0)
+		persist_dirty(sd, AT_TABLE_CART, -1);
+	return retVal;
+}
 
-	return total_updates + total_inserts + total_deletes;
+/**
+ * pc->cart_delitem posthook
+ *
+ * Flags the sold cart slot of clones
+ */
+static int pc_cart_delitem_post(int retVal, struct map_session_data* sd, int n, int amount, int type, enum e_log_pick_type log_type)
+{
+	if (retVal == 0)
+		persist_dirty(sd, AT_TABLE_CART, n);
+	return retVal;
 }
 
-#if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
 /**
- * pc->autotrade_load prehook
+ * pc->additem posthook
  *
- * Replaces default functionality. Loads vending data into a clone.
+ * Flags the whole inventory of buying clones
  */
-static void pc_autotrade_load_pre(void)
+static int pc_additem_post(int retVal, struct map_session_data* sd, const struct item* item_data, int amount, enum e_log_pick_type log_type)
 {
-	hookStop(); // Don't execute original pc_autotrade_load
+	if (retVal == 0)
+		persist_dirty(sd, AT_TABLE_INVENTORY, -1);
+	return retVal;
+}
 
-	struct SqlStmt* stmt = SQL->StmtMalloc(map->mysql_handle);
-	if (stmt == NULL) {
-		SqlStmt_ShowDebug(stmt);
-		return;
-	}
+/**
+ * pc->delitem posthook
+ *
+ * Flags the removed inventory slot of buying clones
+ */
+static int pc_delitem_post(int retVal, struct map_session_data* sd, int n, int amount, int type, enum delitem_reason reason, enum e_log_pick_type log_type)
+{
+	if (retVal == 0)
+		persist_dirty(sd, AT_TABLE_INVENTORY, n);
+	return retVal;
+}
 
-	int account_id, char_id;
-	char title[MESSAGE_SIZE];
-	unsigned char sex;
+#ifdef AT_JOURNAL_FILE
+/**
+ * pc->getzeny posthook
+ *
+ * Journals the earnings of clones
+ */
+static int pc_getzeny_post(int retVal, struct map_session_data* sd, int zeny, enum e_log_pick_type type, struct map_session_data* tsd)
+{
+	struct trade_clone* tc;
 
-	if (SQL_ERROR == SQL->StmtPrepare(stmt, "SELECT `account_id`,`char_id`,`sex`,`title` FROM `%s`", map->autotrade_merchants_db)
-		|| SQL_ERROR == SQL->StmtExecute(stmt)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 0, SQLDT_INT, &account_id, sizeof account_id, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 1, SQLDT_INT, &char_id, sizeof char_id, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 2, SQLDT_CHAR, &sex, sizeof sex, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 3, SQLDT_STRING, &title, sizeof title, NULL, NULL)) {
-		SqlStmt_ShowDebug(stmt);
-		SQL->StmtFree(stmt);
-		return;
+	if (retVal == 0 && (tc = sd2tc(sd)) != NULL) {
+		tc->journal_delta += zeny;
+		journal_touch(tc, AT_JOURNAL_ZENY_FLAG);
 	}
+	return retVal;
+}
 
-	while (SQL_SUCCESS == SQL->StmtNextRow(stmt)) {
-		struct trade_clone* tc;
-		CREATE(tc, struct trade_clone, 1);
-
-		tc->sd.status.account_id = account_id;
-		tc->sd.status.char_id = char_id;
-		tc->sd.status.sex = sex;
-		tc->type = TD_VC;
-		safestrncpy(tc->sd.message, title, MESSAGE_SIZE);
+/**
+ * pc->payzeny posthook
+ *
+ * Journals the payments of buyer clones
+ */
+static int pc_payzeny_post(int retVal, struct map_session_data* sd, int zeny, enum e_log_pick_type type, struct map_session_data* tsd)
+{
+	struct trade_clone* tc;
 
-		autotrade_clone(tc);
+	if (retVal == 0 && (tc = sd2tc(sd)) != NULL) {
+		tc->journal_delta -= zeny;
+		journal_touch(tc, AT_JOURNAL_ZENY_FLAG);
 	}
-
-	SQL->StmtFree(stmt);
+	return retVal;
 }
+#endif
 
 /**
- * Generates a clone from database
+ * Shows clone persistence counters
  */
-static void autotrade_clone(struct trade_clone* tc)
-{
-	struct map_session_data* sd = &tc->sd;
-	struct SqlStmt* stmt;
-	int class_;
+ACMD(atstats) {
+	char output[CHAT_SIZE_MAX];
+	const char* modes[] = { "Incremental", "Reconcile" };
+
+	for (int i = 0; i < 2; i++) {
+		int saves = persist_stats.saves[i];
+		snprintf(output, sizeof(output), "[at2] %s item saves: %d, rows written: %"PRId64" (%.2f per save), rows read: %"PRId64" (%.2f per save)",
+			modes[i], saves, persist_stats.rows_written[i], saves > 0 ? (double)persist_stats.rows_written[i] / saves : 0.,
+			persist_stats.rows_read[i], saves > 0 ? (double)persist_stats.rows_read[i] / saves : 0.);
+		clif->message(fd, output);
+	}
 
-	ARR_FIND(MOB_CLONE_START, MOB_CLONE_END, class_, mob->db_data[class_] == NULL);
-	if (class_ >= MOB_CLONE_END)
-		return;
+	snprintf(output, sizeof(output), "[at2] Reconciles fixing drift: %d", persist_stats.drift);
+	clif->message(fd, output);
 
-	stmt = SQL->StmtMalloc(map->mysql_handle);
-	if (stmt == NULL) {
-		SqlStmt_ShowDebug(stmt);
-		return;
-	}
+	snprintf(output, sizeof(output), "[at2] Writes: %"PRId64" in %"PRId64" commits (%.2f per commit), %d clone saves rolled back",
+		persist_stats.writes, persist_stats.commits, persist_stats.commits > 0 ? (double)persist_stats.writes / persist_stats.commits : 0.,
+		persist_stats.rollbacks);
+	clif->message(fd, output);
 
-	struct mob_db* mdb = mob->db_data[class_] = (struct mob_db*)aCalloc(1, sizeof(struct mob_db));
-	memset(mdb, 0, sizeof(struct mob_db));
-	struct status_data* mstatus = &mdb->status;
-	struct view_data* vd = &mdb->vd;
-	int16 m, x, y;
-	char last_map[MAP_NAME_LENGTH_EXT];
-	char sex[2];
-	char account_sex[2];
-	int group_id;
+	snprintf(output, sizeof(output), "[at2] @at handovers: %d, %d sessions released after %.1f ms on average (max %"PRId64"), %d without char-select acknowledge",
+		handoff_stats.count, handoff_stats.released, handoff_stats.released > 0 ? (double)handoff_stats.select_total / handoff_stats.released : 0., handoff_stats.select_max, handoff_stats.fallbacks);
+	clif->message(fd, output);
+	snprintf(output, sizeof(output), "[at2] Final saves: %d acknowledged after %.1f ms on average (max %"PRId64"), %d not acknowledged in time",
+		handoff_stats.saved, handoff_stats.saved > 0 ? (double)handoff_stats.save_total / handoff_stats.saved : 0., handoff_stats.save_max, handoff_stats.expired);
+	clif->message(fd, output);
 
-	mdb->option = 0;
-	mstatus->mode = 0;
-	mstatus->hp = mstatus->max_hp = 1;
+	snprintf(output, sizeof(output), "[at2] Scheduled clones: %d, last timeout save: %d clones in %d statement(s)",
+		sched.count, sched.last_saved, sched.last_statements);
+	clif->message(fd, output);
 
-	if (SQL_ERROR == SQL->StmtPrepare(stmt, "SELECT "
-		"`c`.`name`,`c`.`base_level`,`c`.`class`,`c`.`zeny`,`c`.`sex`,`c`.`hair`,`c`.`hair_color`,`c`.`clothes_color`,`c`.`body`,"
-		"`c`.`weapon`,`c`.`shield`,`c`.`head_top`,`c`.`head_mid`,`c`.`head_bottom`,`c`.`last_map`,`c`.`robe`,`c`.`last_x`,`c`.`last_y`,"
-		"`l`.`group_id`, `l`.`sex`"
-		"FROM `%s` AS `c` JOIN `%s` AS `l` ON `c`.`account_id` = `l`.`account_id` WHERE `char_id`=? LIMIT 1; ", character_db, login_db)
-		|| SQL_ERROR == SQL->StmtBindParam(stmt, 0, SQLDT_INT, &sd->status.char_id, sizeof sd->status.char_id)
-		|| SQL_ERROR == SQL->StmtExecute(stmt)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 0, SQLDT_STRING, &mdb->name, sizeof mdb->name, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 1, SQLDT_SHORT, &mdb->lv, sizeof mdb->lv, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 2, SQLDT_INT, &vd->class, sizeof & vd->class, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 3, SQLDT_INT, &sd->status.zeny, sizeof sd->status.zeny, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 4, SQLDT_ENUM, &sex, sizeof sex, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 5, SQLDT_INT, &vd->hair_style, sizeof vd->hair_style, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 6, SQLDT_SHORT, &vd->hair_color, sizeof vd->hair_color, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 7, SQLDT_SHORT, &vd->cloth_color, sizeof vd->cloth_color, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 8, SQLDT_INT, &vd->body_style, sizeof vd->body_style, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 9, SQLDT_INT, &vd->weapon, sizeof vd->weapon, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 10, SQLDT_INT, &vd->shield, sizeof vd->shield, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 11, SQLDT_INT, &vd->head_top, sizeof vd->head_top, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 12, SQLDT_INT, &vd->head_mid, sizeof vd->head_mid, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 13, SQLDT_INT, &vd->head_bottom, sizeof vd->head_bottom, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 14, SQLDT_STRING, &last_map, sizeof last_map, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 15, SQLDT_INT, &vd->robe, sizeof vd->robe, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 16, SQLDT_SHORT, &x, sizeof x, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 17, SQLDT_SHORT, &y, sizeof y, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 18, SQLDT_INT, &group_id, sizeof group_id, NULL, NULL)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 19, SQLDT_ENUM, &account_sex, sizeof account_sex, NULL, NULL)
-		) {
-		SqlStmt_ShowDebug(stmt);
-		SQL->StmtFree(stmt);
-		return;
-	}
-	if (SQL_SUCCESS != SQL->StmtNextRow(stmt))
-	{
-		ShowError("Requested non-existant character id: %d!\n", sd->status.char_id);
-		SQL->StmtFree(stmt);
-		return;
+	// Memory of the slim layout against embedding a whole map_session_data per clone
+	unsigned int clones = 0, resident = 0, inventories = 0;
+	struct DBIterator* iter = db_iterator(clone_db);
+	for (struct trade_clone* tc = dbi_first(iter); dbi_exists(iter); tc = dbi_next(iter)) {
+		clones++;
+		if (tc->payload == NULL) // Hibernated
+			continue;
+		resident++;
+		if (tc->payload->inventory != NULL)
+			inventories++;
 	}
+	dbi_destroy(iter);
 
-	sd->status.sex = vd->sex = char_getgender(sex[0], account_sex[0]);
-	pc->set_group(sd, group_id);
-	sd->group_id = group_id;
-	sd->vender_id = ++vending->next_id;
-	sd->buyer_id = buyingstore->getuid();
-	sd->state.vending = 1;
-	sd->state.autotrade = 1;
+	unsigned int slim = (unsigned int)(sizeof(struct trade_clone) + sizeof(struct at_payload));
+	unsigned int inventory = (unsigned int)sizeof(struct item[MAX_INVENTORY]);
+	unsigned int embedded = (unsigned int)(sizeof(struct trade_clone) + sizeof(struct map_session_data));
+
+	snprintf(output, sizeof(output), "[at2] Clone memory: %u bytes (+%u for buying store inventories), %u bytes embedding a map_session_data",
+		slim, inventory, embedded);
+	clif->message(fd, output);
+	snprintf(output, sizeof(output), "[at2] %u clones: %u KB, %u KB embedded. Adapters: %d materialized, peak %d, %"PRId64" total",
+		clones, (unsigned int)((sizeof(struct trade_clone) * clones + sizeof(struct at_payload) * resident + inventory * inventories) / 1024), embedded * clones / 1024, adapters.count, adapters.peak, adapters.total);
+	clif->message(fd, output);
+
+#ifdef AT_HIBERNATE_FILE
+	snprintf(output, sizeof(output), "[at2] Hibernated clones: %d (%"PRId64" KB released), %d hibernations, %d faults in %.1f us on average (max %"PRId64" us)",
+		hibernate.count, hibernate.bytes / 1024, hibernate.hibernations, hibernate.faults,
+		hibernate.faults > 0 ? (double)hibernate.fault_total / hibernate.faults : 0., hibernate.fault_max);
+	clif->message(fd, output);
+#endif
 
-	safestrncpy(mdb->sprite, mdb->name, NAME_LENGTH);
-	safestrncpy(mdb->jname, mdb->name, NAME_LENGTH);
+#ifdef AT_SALES_RING
+	snprintf(output, sizeof(output), "[at2] Sale events: %"PRId64" recorded, %"PRId64" written, %"PRId64" pending, %"PRId64" overwritten unflushed, %"PRId64" lost",
+		sales.seq, sales.written, sales.seq - sales.flushed, sales.dropped, sales.lost);
+	clif->message(fd, output);
+#endif
 
-	m = map->mapname2mapid(last_map);
+	snprintf(output, sizeof(output), "[at2] Stubs left: %d, merchants spawned on demand: %d in %"PRId64" ms",
+		stubs.count, stubs.spawned, stubs.duration);
+	clif->message(fd, output);
 
-	// Create monster
-	struct mob_data* md = mob->once_spawn_sub(NULL, m, x, y, mdb->name, class_, "", SZ_SMALL, AI_NONE, 0);
-	if (md == NULL)
-		return;
-	md->special_state.clone = 1;
-	mob->spawn(md);
-	unit->set_dir(&md->bl, UNIT_DIR_SOUTH);
+#if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
+	if (spawn_queue.db != NULL) {
+		snprintf(output, sizeof(output), "[at2] Restoring merchants: %d of %d queued left, %d spawned, about %"PRId64" ms to go",
+			spawn_queue.count - spawn_queue.next, spawn_queue.count, spawn_queue.spawned, spawn_queue_eta());
+		clif->message(fd, output);
+	}
+#endif
 
-	tc->md = md;
-	memcpy(&tc->sd.bl, &md->bl, sizeof(struct block_list));
+	snprintf(output, sizeof(output), "[at2] Board packets: %"PRId64" built, %"PRId64" sent from cache in %"PRId64" writes",
+		packet_stats.built, packet_stats.queued, packet_stats.writes);
+	clif->message(fd, output);
 
-	addToMOBDATA(md, tc, 0, true);
+#ifdef AT_JOURNAL_FILE
+	snprintf(output, sizeof(output), "[at2] Journal: %"PRId64" records (%"PRId64" bytes since the last checkpoint), %d syncs, %d checkpoints, %d characters replayed",
+		journal.records, journal.bytes, journal.syncs, journal.checkpoints, journal.replayed);
+	clif->message(fd, output);
+#endif
 
-	int cart_type;
-	//int sc_type = SC_PUSH_CART;
-	if (SQL_ERROR == SQL->StmtPrepare(stmt, "SELECT `val1`"
-		" FROM `%s` WHERE `account_id`=? AND `char_id`=? AND `type`='%d' LIMIT 1", sc_data_db, SC_PUSH_CART)
-		|| SQL_ERROR == SQL->StmtBindParam(stmt, 0, SQLDT_INT, &sd->status.account_id, sizeof sd->status.account_id)
-		|| SQL_ERROR == SQL->StmtBindParam(stmt, 1, SQLDT_INT, &sd->status.char_id, sizeof sd->status.char_id)
-		|| SQL_ERROR == SQL->StmtExecute(stmt)
-		|| SQL_ERROR == SQL->StmtBindColumn(stmt, 0, SQLDT_INT, &cart_type, sizeof cart_type, NULL, NULL)
-		) {
-		SqlStmt_ShowDebug(stmt);
-		SQL->StmtFree(stmt);
-		return;
-	}
-	if (SQL_SUCCESS == SQL->StmtNextRow(stmt))
-		tc->options.pushcart = cart_type;
+	return true;
+}
 
-	if (battle->bc->at_timeout) {
-		int timeout = battle->bc->at_timeout * 60000;
-		if (SQL_ERROR == SQL->StmtPrepare(stmt, "SELECT `tick`"
-			" FROM `%s` WHERE `account_id`=? AND `char_id`=? AND `type`='%d' LIMIT 1", sc_data_db, SC_AUTOTRADE)
-			|| SQL_ERROR == SQL->StmtBindParam(stmt, 0, SQLDT_INT, &sd->status.account_id, sizeof sd->status.account_id)
-			|| SQL_ERROR == SQL->StmtBindParam(stmt, 1, SQLDT_INT, &sd->status.char_id, sizeof sd->status.char_id)
-			|| SQL_ERROR == SQL->StmtExecute(stmt)
-			|| SQL_ERROR == SQL->StmtBindColumn(stmt, 0, SQLDT_INT, &timeout, sizeof timeout, NULL, NULL)
-			) {
-			SqlStmt_ShowDebug(stmt);
-			SQL->StmtFree(stmt);
-			return;
-		}
-		SQL->StmtNextRow(stmt);
+/**
+ * Times the clone checks of the global hooks against the lookups they replaced.
+ * Usage: @atbench [<iterations>]
+ */
+ACMD(atbench) {
+	char output[CHAT_SIZE_MAX];
+	int iterations = 1000000;
+	int ids[] = { sd->bl.id, START_NPC_NUM, START_NPC_NUM + clone_ids.words * 32, 0 }; // Player, first clone id, past the bitset, none
+	int64 elapsed[2];
+	int found[2] = { 0 };
 
-		int64 tick = timer->gettick();
-		tc->options.time = timeout;
-		tc->options.quit_timer = timer->add(tick + timeout, timeout_timer, md->bl.id, 1);
-		tc->options.save_timer = INVALID_TIMER;
-		if (timeout > map->autosave_interval)
-			tc->options.save_timer = timer->add_interval(tick + map->autosave_interval, timeout_timer, md->bl.id, 0, map->autosave_interval);
+	if (message != NULL && *message != '\0')
+		iterations = cap_value(atoi(message), 1000, 100000000);
+
+	// A player, an early object id, an id past the bitset and a clone if there's one
+	struct DBIterator* iter = db_iterator(clone_db);
+	struct trade_clone* sample = dbi_first(iter);
+	dbi_destroy(iter);
+	if (sample != NULL)
+		ids[3] = sample->md->bl.id;
+
+	// Lookups done by the hooks before the bitset
+	int64 start = timer->gettick_nocache();
+	for (int i = 0; i < iterations; i++) {
+		struct mob_data* md = map->id2md(ids[i % ARRAYLENGTH(ids)]);
+		if (md != NULL && getFromMOBDATA(md, 0) != NULL)
+			found[0]++;
 	}
+	elapsed[0] = timer->gettick_nocache() - start;
 
-	if (map->list[m].users)
-		clif->showvendingboard(&md->bl, sd->message, 0);
+	start = timer->gettick_nocache();
+	for (int i = 0; i < iterations; i++) {
+		if (id2tc(ids[i % ARRAYLENGTH(ids)]) != NULL)
+			found[1]++;
+	}
+	elapsed[1] = timer->gettick_nocache() - start;
 
-	SQL->StmtFree(stmt);
+	snprintf(output, sizeof(output), "[at2] %d checks (%d clones): lookups %"PRId64" ms (%.1f ns each), bitset %"PRId64" ms (%.1f ns each)",
+		iterations, found[1], elapsed[0], elapsed[0] * 1e6 / iterations, elapsed[1], elapsed[1] * 1e6 / iterations);
+	clif->message(fd, output);
 
-	autotrade_populate(tc);
+	if (found[0] != found[1])
+		clif->message(fd, "[at2] Warning: both checks found a different number of clones.");
 
-	// Store for easy access
-	// Persistence supports vending only
-	idb_put(clone_db, sd->status.char_id, tc);
-	idb_put(vender_db, sd->vender_id, tc);
-	idb_put(vending->db, sd->status.char_id, tc);
+	return true;
 }
 
+#ifdef AT_SALES_RING
 /**
- * Fetches cart inventory data and populates vending data
+ * Shows volume and median price of the items traded by clones, from the in-memory window only.
+ * Usage: @marketstats [<item name or id>]
  */
-static void autotrade_populate(struct trade_clone* tc)
-{
-	// General data
-	int i = 0;
-	struct SqlStmt* stmt = NULL;
-	struct map_session_data* sd = &tc->sd;
+ACMD(marketstats) {
+	char output[CHAT_SIZE_MAX];
+	struct item_data* filter = NULL;
+	int count = (int)min(sales.seq, (int64)AT_SALES_RING);
+
+	if (message != NULL && *message != '\0') {
+		if ((filter = itemdb->search_name(message)) == NULL && (filter = itemdb->exists(atoi(message))) == NULL) {
+			clif->message(fd, "[at2] Invalid item name or id.");
+			return false;
+		}
+	}
 
-	// Load cart items
-	int result = getitemdata_from_sql(tc->sd.status.cart, MAX_CART, tc->sd.status.char_id, TABLE_CART);
-	if (result == 0)
-		return;
+	struct at_sale* events;
+	int n = 0;
+	int64 oldest = 0;
+	CREATE(events, struct at_sale, max(count, 1));
+	for (int64 seq = sales.seq - count; seq < sales.seq; seq++) {
+		const struct at_sale* sale = &sales.ring[seq % AT_SALES_RING];
 
-	// Calc weight & num
-	for (i = 0; i < MAX_CART; i++) {
-		if (sd->status.cart[i].nameid == 0)
+		if (filter != NULL && sale->nameid != filter->nameid)
 			continue;
-		sd->cart_weight += itemdb_weight(sd->status.cart[i].nameid) * sd->status.cart[i].amount;
-		sd->cart_num++;
+		if (n == 0)
+			oldest = sale->tick;
+		events[n++] = *sale;
 	}
 
-	// Autotrade data
-	char* data;
-	int count = 0;
-
-	stmt = SQL->StmtMalloc(map->mysql_handle);
-	if (SQL_ERROR == SQL->Query(map->mysql_handle, "SELECT `itemkey`,`amount`,`price` FROM `%s` WHERE `char_id` = '%d'", map->autotrade_data_db, tc->sd.status.char_id))
-		Sql_ShowDebug(map->mysql_handle);
-
-	while (SQL_SUCCESS == SQL->NextRow(map->mysql_handle)) {
-		int itemkey, amount, price;
-
-		SQL->GetData(map->mysql_handle, 0, &data, NULL); itemkey = atoi(data);
-		SQL->GetData(map->mysql_handle, 1, &data, NULL); amount = atoi(data);
-		SQL->GetData(map->mysql_handle, 2, &data, NULL); price = atoi(data);
+	if (n == 0) {
+		clif->message(fd, "[at2] No trades recorded yet.");
+		aFree(events);
+		return true;
+	}
 
-		ARR_FIND(0, MAX_CART, i, tc->sd.status.cart[i].id == itemkey);
-		if (i != MAX_CART && itemdb_cantrade(&tc->sd.status.cart[i], 0, 0)) {
-			if (amount > tc->sd.status.cart[i].amount)
-				amount = tc->sd.status.cart[i].amount;
+	// Events of the same item and side end up next to each other, by price
+	qsort(events, n, sizeof(*events), sales_compare);
+
+	struct at_market_item* items;
+	int item_count = 0;
+	CREATE(items, struct at_market_item, n);
+	for (int i = 0; i < n;) {
+		struct at_market_item* it = &items[item_count++];
+		int j;
+
+		it->nameid = events[i].nameid;
+		it->type = events[i].type;
+		it->min_price = events[i].price;
+		for (j = i; j < n && events[j].nameid == it->nameid && events[j].type == it->type; j++) {
+			it->trades++;
+			it->volume += events[j].amount;
+			it->max_price = events[j].price;
+		}
 
-			if (amount) {
-				tc->sd.vending[count].index = i;
-				tc->sd.vending[count].amount = amount;
-				tc->sd.vending[count].value = cap_value(price, 0, (unsigned int)battle->bc->vending_max_value);
-				count++;
+		// Median weighted by amount
+		int64 half = (it->volume + 1) / 2, seen = 0;
+		for (int k = i; k < j; k++) {
+			seen += events[k].amount;
+			if (seen >= half) {
+				it->median = events[k].price;
+				break;
 			}
 		}
+		i = j;
 	}
 
-	tc->sd.vend_num = count;
-
-	SQL->StmtFree(stmt);
-}
+	qsort(items, item_count, sizeof(*items), market_item_compare);
 
-#endif
+	snprintf(output, sizeof(output), "[at2] %d trades of %d items over the last %"PRId64" s:", n, item_count, (timer->gettick() - oldest) / 1000);
+	clif->message(fd, output);
 
-/**
- * Gets gender of character
- */
-static int char_getgender(char sex, char sex2)
-{
-	switch (sex) {
-	case 'M':
-		return SEX_MALE;
-	case 'F':
-		return SEX_FEMALE;
-	case 'U':
-	default:
-		if (sex2)
-			return char_getgender(sex2, 0);
-		else
-			return 99;
-	}
-}
+	for (int i = 0; i < item_count && i < AT_MARKETSTATS_LINES; i++) {
+		const struct at_market_item* it = &items[i];
+		struct item_data* data = itemdb->exists(it->nameid);
 
-/**
- * char->delete_char_sql posthook
- *
- * Sends a packet informing of a char delection to the map server
- * so the map server can delete the related clone if any
- */
-static int char_delete_char_sql_post(int result, int char_id)
-{
-	if (result == 0) {
-		uint8 buf[6];
-		WBUFW(buf, 0) = CHAR_MAP_PACKET_ID;
-		WBUFL(buf, 2) = char_id;
-		mapif->send(buf, 6);
+		snprintf(output, sizeof(output), "[at2]   %s (%d) %s: %"PRId64" ea in %d trades, median %d z (%d - %d z)",
+			data != NULL ? data->jname : "Unknown", it->nameid, it->type == TD_VC ? "sold" : "bought",
+			it->volume, it->trades, it->median, it->min_price, it->max_price);
+		clif->message(fd, output);
 	}
 
-	return 0;
+	aFree(items);
+	aFree(events);
+	return true;
 }
+#endif
 
 /**
- * Parses packet informing of a char deletion in the char server.
- * Removes clone if any found.
+ * Lists the clones of the user's account
  */
-static void parse_delete_char_packet(int fd)
-{
-	int char_id = RFIFOL(fd, 2);
+ACMD(atlist) {
+	char output[CHAT_SIZE_MAX];
 
-	if (char_id)
-		remove_clone(char_id);
-}
+	stub_spawn_account(sd->status.account_id);
+	struct at_account* acc = idb_get(account_db, sd->status.account_id);
 
-/**
- * Makes trade clones not targeteable to other players
- */
-int battle_check_target_post(int retval, struct block_list* src, struct block_list* target, int flag)
-{
-	if (retval == 1 && target->type == BL_MOB) {
-		struct base_data* bd = getFromMOBDATA((struct mob_data*)target, 0);
-		if (bd != NULL)
-			return -1;
+	if (acc == NULL) {
+		clif->message(fd, "[at2] You have no autotrade characters.");
+		return true;
 	}
-	return retval;
-}
 
-/**
- * Autotrade timeout timer.
- *
- * If data = 0, update remaining time and save
- * If data = 1, timer expired and clone must be removed
- */
-static int timeout_timer(int tid, int64 tick, int id, intptr_t data)
-{
-	struct trade_clone* tc = id2tc(id);
-	if (tc == NULL)
-		return 0;
+	snprintf(output, sizeof(output), "[at2] Autotrade characters: %d", acc->count);
+	clif->message(fd, output);
 
-	if (data == 1)
-		tc->options.time = 0;
-	else
-		tc->options.time -= map->autosave_interval;
+	for (struct trade_clone* tc = acc->head; tc != NULL; tc = tc->account_next) {
+		struct mob_data* md = tc->md;
+		char left[32] = "";
 
-	if (tc->options.time <= 0) {
-		ShowInfo("[at2] Removing clone: %d\n", tc->sd.status.char_id);
-		remove_clone(tc->sd.status.char_id);
-	} else {
-		save_timeout(tc, false);
+		if (tc->scheduled)
+			snprintf(left, sizeof(left), ", %d min left", (int)((tc->options.expire - timer->gettick()) / 60000));
+
+		snprintf(output, sizeof(output), "[at2]   %s (%s) at %s %d,%d%s", md->name, tc->type == TD_VC ? "vending" : "buying",
+			map->list[md->bl.m].name, md->bl.x, md->bl.y, left);
+		clif->message(fd, output);
 	}
 
-	return 1;
+	return true;
 }
 
-/**
- * Timed function for exiting the server with a small delay
- * Note: this is necessary as to not freeze the client
- */
-static int map_quit_timer(int tid, int64 tick, int id, intptr_t data)
-{
-	struct map_session_data* sd = map->id2sd(id);
-	if (sd != NULL) {
-		map->quit(sd);
-	}
+ACMD(whosell2) {
+	return clone_who(fd, message, TD_VC);
+}
 
-	return 0;
+ACMD(whobuy2) {
+	return clone_who(fd, message, TD_BC);
 }
 
 ACMD(autotrade2) {
@@ -1107,17 +7254,10 @@ ACMD(autotrade2) {
 	}
 
 #if MAX_AUTOTRADE_PER_ACCOUNT > 0
-	int count = 0;
-	struct trade_clone* tmp;
-	struct DBIterator* iter = db_iterator(clone_db);
-
-	for (tmp = dbi_first(iter); dbi_exists(iter); tmp = dbi_next(iter)) {
-		if (tmp->sd.status.account_id == sd->status.account_id)
-			count++;
-	}
-	dbi_destroy(iter);
+	stub_spawn_account(sd->status.account_id);
+	struct at_account* acc = idb_get(account_db, sd->status.account_id);
 
-	if (count >= MAX_AUTOTRADE_PER_ACCOUNT) {
+	if (acc != NULL && acc->count >= MAX_AUTOTRADE_PER_ACCOUNT) {
 		clif->message(fd, "You have reached the maximum number of allowed autotrade characters.");
 		return false;
 	}
@@ -1135,8 +7275,13 @@ ACMD(autotrade2) {
 
 	at_clone_spawn_vending(sd);
 
+	struct trade_clone* tc = idb_get(clone_db, sd->status.char_id);
+	if (tc != NULL)
+		handoff_start(tc);
+
 	chrif->charselectreq(sd, sockt->session[fd]->client_addr);
-	timer->add(timer->gettick() + 500, map_quit_timer, sd->bl.id, 0);
+	if (tc == NULL) // No clone to hand over to
+		timer->add(timer->gettick() + AT_HANDOFF_TIMEOUT, map_quit_timer, sd->bl.id, 0);
 
 	return false;/* we fail to not cause it to proceed on is_atcommand */
 }
@@ -1146,19 +7291,65 @@ HPExport void plugin_init(void) {
 		clone_db = idb_alloc(DB_OPT_BASE);
 		vender_db = idb_alloc(DB_OPT_BASE);
 		buyer_db = idb_alloc(DB_OPT_BASE);
+		persist_db = idb_alloc(DB_OPT_BASE);
+		account_db = idb_alloc(DB_OPT_RELEASE_DATA);
+		listing_db[TD_VC] = idb_alloc(DB_OPT_BASE);
+		listing_db[TD_BC] = idb_alloc(DB_OPT_BASE);
+		stubs.db = idb_alloc(DB_OPT_RELEASE_DATA);
+		stubs.accounts = idb_alloc(DB_OPT_BASE);
+		persist.timer = INVALID_TIMER;
+		sched.timer = INVALID_TIMER;
+#ifdef AT_HIBERNATE_FILE
+		hibernate.timer = INVALID_TIMER;
+#endif
+#ifdef AT_SALES_RING
+		sales.timer = INVALID_TIMER;
+		CREATE(sales.ring, struct at_sale, AT_SALES_RING);
+#endif
+		clone_classes.db_ers = ers_new(sizeof(struct mob_db), "parallel_autotrade::mob_db", ERS_OPT_NONE);
+		adapters.ers = ers_new(sizeof(struct map_session_data), "parallel_autotrade::adapter", ERS_OPT_NONE);
 
 		addAtcommand("autotrade", autotrade2);
 		addAtcommand("at", autotrade2);
+		addAtcommand("atstats", atstats);
+		addAtcommand("atbench", atbench);
+#ifdef AT_SALES_RING
+		addAtcommand("marketstats", marketstats);
+#endif
+		addAtcommand("atlist", atlist);
+		addAtcommand("whosell", whosell2);
+		addAtcommand("whobuy", whobuy2);
 
 		addHookPre(chrif, save, chrif_save_pre);
 		addHookPre(map, quit, map_quit_pre);
 		addHookPre(status, damage, status_damage_pre);
 		addHookPre(clif, search_store_info_ack, clif_searchstoreinfo_pre);
+		addHookPre(mob, clone_delete, mob_clone_delete_pre);
+		addHookPre(chrif, idbanned, chrif_idbanned_pre);
+		addHookPre(vending, searchall, vending_searchall_pre);
+		addHookPre(buyingstore, searchall, buyingstore_searchall_pre);
+#ifdef AT_SALES_RING
+		addHookPre(vending, purchasereq, vending_purchasereq_pre);
+		addHookPost(vending, purchasereq, vending_purchasereq_post);
+		addHookPre(buyingstore, trade, buyingstore_trade_pre);
+		addHookPost(buyingstore, trade, buyingstore_trade_post);
+#endif
 
 		addHookPost(clif, authok, clif_authok_post);
+		addHookPost(clif, charselectok, clif_charselectok_post);
+		addHookPost(chrif, auth_delete, chrif_auth_delete_post);
 		addHookPost(clif, getareachar_unit, clif_getareachar_unit_post);
 		addHookPost(battle, check_target, battle_check_target_post);
 		addHookPost(map, id2sd, map_id2sd_post);
+		addHookPost(map, addblock, map_addblock_post);
+		addHookPost(pc, cart_additem, pc_cart_additem_post);
+		addHookPost(pc, cart_delitem, pc_cart_delitem_post);
+		addHookPost(pc, additem, pc_additem_post);
+		addHookPost(pc, delitem, pc_delitem_post);
+#ifdef AT_JOURNAL_FILE
+		addHookPost(pc, getzeny, pc_getzeny_post);
+		addHookPost(pc, payzeny, pc_payzeny_post);
+#endif
 
 		addPacket(CHAR_MAP_PACKET_ID, 6, parse_delete_char_packet, hpChrif_Parse);
 
@@ -1166,7 +7357,130 @@ HPExport void plugin_init(void) {
 		addHookPre(pc, autotrade_load, pc_autotrade_load_pre);
 #endif
 	} else if (SERVER_TYPE == SERVER_TYPE_CHAR) {
+		handoff_db = idb_alloc(DB_OPT_BASE);
 		addHookPost(chr, delete_char_sql, char_delete_char_sql_post);
+		addHookPre(chr, mmo_char_tosql, chr_mmo_char_tosql_pre);
+		addHookPre(chr, mmo_char_fromsql, chr_mmo_char_fromsql_pre);
+		addPacket(MAP_CHAR_PACKET_ID, 7, parse_handoff_packet, hpParse_FromMap);
 	}
 
+}
+
+HPExport void server_online(void) {
+	if (SERVER_TYPE == SERVER_TYPE_MAP) {
+		timer->add_func_list(persist_timer, "parallel_autotrade::persist_timer");
+		timer->add_func_list(sched_timer, "parallel_autotrade::sched_timer");
+		timer->add_func_list(clone_release_timer, "parallel_autotrade::clone_release_timer");
+		timer->add_func_list(handoff_timer, "parallel_autotrade::handoff_timer");
+#ifdef AT_HIBERNATE_FILE
+		timer->add_func_list(hibernate_timer, "parallel_autotrade::hibernate_timer");
+		timer->add_func_list(hibernate_prefetch_timer, "parallel_autotrade::hibernate_prefetch_timer");
+		hibernate_init();
+#endif
+#ifdef AT_SALES_RING
+		timer->add_func_list(sales_flush_timer, "parallel_autotrade::sales_flush_timer");
+		sales.timer = timer->add_interval(timer->gettick() + AT_SALES_FLUSH, sales_flush_timer, 0, 0, AT_SALES_FLUSH);
+#endif
+		timer->add_func_list(packet_flush_timer, "parallel_autotrade::packet_flush_timer");
+#if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
+		timer->add_func_list(spawn_timer, "parallel_autotrade::spawn_timer");
+#endif
+#ifdef AT_JOURNAL_FILE
+		timer->add_func_list(journal_sync_timer, "parallel_autotrade::journal_sync_timer");
+		timer->add_func_list(journal_checkpoint_timer, "parallel_autotrade::journal_checkpoint_timer");
+		journal_init(); // Before any clone is loaded from the database
+#endif
+		persist_init();
+		sched_init();
+
+		// Override the core's shop listings, if any
+		AtCommandInfo* info;
+		if ((info = atcommand->get_info_byname("whosell")) != NULL)
+			info->func = atcommand_whosell2;
+		if ((info = atcommand->get_info_byname("whobuy")) != NULL)
+			info->func = atcommand_whobuy2;
+
+		// Single entry searched in place of every clone
+		CREATE(adapters.search_proxy, struct map_session_data, 1);
+		adapters.search_proxy->state.vending = 1;
+		adapters.search_proxy->state.buyingstore = 1;
+		idb_put(vending->db, 0, adapters.search_proxy);
+#ifdef HERACLES_VERSION
+		idb_put(buyingstore->db, 0, adapters.search_proxy);
+#endif
+	}
+}
+
+HPExport void plugin_final(void) {
+	if (SERVER_TYPE == SERVER_TYPE_MAP) {
+		struct DBIterator* iter = db_iterator(clone_db);
+		for (struct trade_clone* tc = dbi_first(iter); dbi_exists(iter); tc = dbi_next(iter)) {
+			unsigned int held = tc->handoff.state != AT_HANDOFF_NONE ? handoff_clear(tc) : 0;
+			if (held != 0) // Still waiting for a final save, not flushed otherwise
+				persist_push(tc, held);
+		}
+		dbi_destroy(iter);
+
+		if (sched.timer != INVALID_TIMER)
+			timer->delete(sched.timer, sched_timer);
+		if (persist.sql_handle != NULL)
+			sched_save(timer->gettick()); // Keep remaining times up to date for the next boot
+#ifdef AT_SALES_RING
+		if (sales.timer != INVALID_TIMER)
+			timer->delete(sales.timer, sales_flush_timer);
+		if (persist.sql_handle != NULL)
+			sales_flush_timer(INVALID_TIMER, timer->gettick(), 0, 0);
+#endif
+#ifdef AT_JOURNAL_FILE
+		if (journal.fp != NULL && persist.sql_handle != NULL) {
+			journal_sync();
+			journal_saves();
+		}
+#endif
+		persist_final();
+#ifdef AT_JOURNAL_FILE
+		journal_final();
+#endif
+
+		iter = db_iterator(clone_db);
+		for (struct trade_clone* tc = dbi_first(iter); dbi_exists(iter); tc = dbi_next(iter))
+			clone_release(tc);
+		dbi_destroy(iter);
+#if defined(AUTOTRADE_PERSISTENCY) && defined(SUPPORT_AT_PERSISTENCY)
+#ifdef AT_SNAPSHOT_FILE
+		snapshot_write(); // Before dropping the spawn queue, incomplete markets aren't snapshotted
+#endif
+		spawn_queue_final();
+#endif
+
+		if (adapters.search_proxy != NULL) {
+			idb_remove(vending->db, 0);
+#ifdef HERACLES_VERSION
+			idb_remove(buyingstore->db, 0);
+#endif
+			aFree(adapters.search_proxy);
+		}
+
+		db_destroy(persist_db);
+		db_destroy(account_db);
+		db_destroy(listing_db[TD_VC]);
+		db_destroy(listing_db[TD_BC]);
+		db_destroy(stubs.db);
+		db_destroy(stubs.accounts);
+		stub_items_final();
+		if (clone_ids.bits != NULL)
+			aFree(clone_ids.bits);
+		if (stubs.maps != NULL)
+			aFree(stubs.maps);
+		ers_destroy(clone_classes.db_ers);
+		ers_destroy(adapters.ers);
+#ifdef AT_HIBERNATE_FILE
+		hibernate_final();
+#endif
+#ifdef AT_SALES_RING
+		aFree(sales.ring);
+#endif
+	} else if (SERVER_TYPE == SERVER_TYPE_CHAR) {
+		db_destroy(handoff_db);
+	}
 }
\ No newline at end of file